@@ -0,0 +1,133 @@
+/* 
+* Molecular Visualization HTTP Server
+* Copyright (C) 2011-2012 Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* aint with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+*/
+
+
+#include "Base64.h"
+
+// SSSE3 kernel picked at runtime on x86, define BASE64_NO_SIMD to build the scalar code only
+#if !defined(BASE64_NO_SIMD) && (defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__))
+#define BASE64_SIMD 1
+#include <tmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define BASE64_TARGET_SSSE3
+#else
+#define BASE64_TARGET_SSSE3 __attribute__((target("ssse3")))
+#endif
+#endif
+
+static const char gBase64Table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// ----------------------------------------------------------------------
+// Scalar encoder, 3 bytes to 4 characters. Also does the tails of the SIMD one
+// ----------------------------------------------------------------------
+static size_t base64EncodeScalar( const unsigned char* data, const size_t length, char* out )
+{
+   char* o = out;
+   size_t i(0);
+   for( ; i+3<=length; i+=3 )
+   {
+      const unsigned int triple = (data[i] << 16) | (data[i+1] << 8) | data[i+2];
+      *o++ = gBase64Table[(triple >> 18) & 0x3F];
+      *o++ = gBase64Table[(triple >> 12) & 0x3F];
+      *o++ = gBase64Table[(triple >>  6) & 0x3F];
+      *o++ = gBase64Table[ triple        & 0x3F];
+   }
+   if( i<length )
+   {
+      const bool two = (i+1<length);
+      const unsigned int triple = (data[i] << 16) | (two ? (data[i+1] << 8) : 0);
+      *o++ = gBase64Table[(triple >> 18) & 0x3F];
+      *o++ = gBase64Table[(triple >> 12) & 0x3F];
+      *o++ = two ? gBase64Table[(triple >> 6) & 0x3F] : '=';
+      *o++ = '=';
+   }
+   return o-out;
+}
+
+#ifdef BASE64_SIMD
+// ----------------------------------------------------------------------
+// SSSE3 encoder, 12 bytes to 16 characters per iteration. The 6 bit
+// fields are moved into bytes with multiplies, then turned into ASCII by
+// adding a per range offset looked up with pshufb (W. Mula's method)
+// ----------------------------------------------------------------------
+BASE64_TARGET_SSSE3 static size_t base64EncodeSSSE3( const unsigned char* data, const size_t length, char* out )
+{
+   const __m128i shuffle   = _mm_setr_epi8( 1,0,2,1, 4,3,5,4, 7,6,8,7, 10,9,11,10 );
+   const __m128i maskHigh  = _mm_set1_epi32( 0x0FC0FC00 );
+   const __m128i mulHigh   = _mm_set1_epi32( 0x04000040 );
+   const __m128i maskLow   = _mm_set1_epi32( 0x003F03F0 );
+   const __m128i mulLow    = _mm_set1_epi32( 0x01000010 );
+   const __m128i offsets   = _mm_setr_epi8( 'a'-26, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '0'-52, '+'-62, '/'-63, 'A', 0, 0 );
+
+   char* o = out;
+   size_t i(0);
+   // 16 bytes are loaded for 12 consumed, the last 4 must still be inside the input
+   for( ; i+16<=length; i+=12, o+=16 )
+   {
+      __m128i in = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i*)(data+i) ), shuffle );
+      const __m128i high = _mm_mulhi_epu16( _mm_and_si128( in, maskHigh ), mulHigh );
+      const __m128i low  = _mm_mullo_epi16( _mm_and_si128( in, maskLow ), mulLow );
+      const __m128i indices = _mm_or_si128( high, low );
+
+      // 0..25 -> 13, 26..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12
+      __m128i range = _mm_subs_epu8( indices, _mm_set1_epi8( 51 ) );
+      range = _mm_or_si128( range, _mm_and_si128( _mm_cmpgt_epi8( _mm_set1_epi8( 26 ), indices ), _mm_set1_epi8( 13 ) ) );
+      _mm_storeu_si128( (__m128i*)o, _mm_add_epi8( indices, _mm_shuffle_epi8( offsets, range ) ) );
+   }
+   return (o-out) + base64EncodeScalar( data+i, length-i, o );
+}
+
+static bool hasSSSE3()
+{
+#if defined(_MSC_VER)
+   int info[4];
+   __cpuid(info, 1);
+   return (info[2] & (1<<9)) != 0;
+#else
+   __builtin_cpu_init();
+   return __builtin_cpu_supports("ssse3") != 0;
+#endif
+}
+#endif // BASE64_SIMD
+
+size_t base64Encode( const unsigned char* data, const size_t length, char* out )
+{
+#ifdef BASE64_SIMD
+   static const bool ssse3 = hasSSSE3();
+   if( ssse3 ) return base64EncodeSSSE3( data, length, out );
+#endif
+   return base64EncodeScalar( data, length, out );
+}
+
+void base64EncodeStream( const unsigned char* data, const size_t length, Base64WriteFunc func, void* context )
+{
+   // Chunks are a multiple of 3 bytes so that padding only ever shows up in the last one
+   const size_t chunkBytes = 3*1024;
+   char chunk[4*1024];
+   for( size_t i(0); i<length; i+=chunkBytes )
+   {
+      const size_t n = (length-i<chunkBytes) ? length-i : chunkBytes;
+      func( context, chunk, base64Encode( data+i, n, chunk ) );
+   }
+}
@@ -0,0 +1,47 @@
+/* 
+* Molecular Visualization HTTP Server
+* Copyright (C) 2011-2012 Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* aint with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+*/
+
+
+#pragma once
+
+#include <stddef.h>
+
+// ----------------------------------------------------------------------
+// Base64 (RFC 4648, with padding)
+// ----------------------------------------------------------------------
+
+// Number of characters produced for inputLength bytes
+inline size_t base64EncodedLength( const size_t inputLength )
+{
+   return ((inputLength+2)/3)*4;
+}
+
+// Encodes length bytes into out, which must hold base64EncodedLength(length) characters.
+// No terminating zero is written. Returns the number of characters written
+size_t base64Encode( const unsigned char* data, const size_t length, char* out );
+
+// Receives the encoded text in consecutive chunks
+typedef void (*Base64WriteFunc)( void* context, const char* data, const size_t size );
+
+// Encodes through a small stack buffer and hands it to func chunk by chunk, nothing is allocated
+void base64EncodeStream( const unsigned char* data, const size_t length, Base64WriteFunc func, void* context );
@@ -0,0 +1,233 @@
+/* 
+* Molecular Visualization HTTP Server
+* Copyright (C) 2011-2012 Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* aint with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+*/
+
+
+#include "Bvh.h"
+
+#include <thread>
+#include <algorithm>
+
+namespace
+{
+   const int BINS           = 12;
+   const int PARALLEL_ITEMS = 4096; // Smaller subtrees are built on the calling thread
+
+   // Half the surface of a box, what the heuristic compares
+   inline float area( const float* minPos, const float* maxPos )
+   {
+      const float x = maxPos[0]-minPos[0], y = maxPos[1]-minPos[1], z = maxPos[2]-minPos[2];
+      return (x<0.f || y<0.f || z<0.f) ? 0.f : x*y + y*z + z*x;
+   }
+
+   inline float component( const float4& v, const int axis )
+   {
+      return (axis==0) ? v.x : ((axis==1) ? v.y : v.z);
+   }
+
+   struct Bin
+   {
+      float minPos[3];
+      float maxPos[3];
+      int   count;
+
+      Bin() : count(0)
+      {
+         minPos[0] = minPos[1] = minPos[2] =  1e30f;
+         maxPos[0] = maxPos[1] = maxPos[2] = -1e30f;
+      }
+
+      void grow( const float4& lo, const float4& hi )
+      {
+         minPos[0] = (lo.x<minPos[0]) ? lo.x : minPos[0];
+         minPos[1] = (lo.y<minPos[1]) ? lo.y : minPos[1];
+         minPos[2] = (lo.z<minPos[2]) ? lo.z : minPos[2];
+         maxPos[0] = (hi.x>maxPos[0]) ? hi.x : maxPos[0];
+         maxPos[1] = (hi.y>maxPos[1]) ? hi.y : maxPos[1];
+         maxPos[2] = (hi.z>maxPos[2]) ? hi.z : maxPos[2];
+      }
+
+      void grow( const Bin& bin )
+      {
+         for( int i(0); i<3; ++i )
+         {
+            minPos[i] = (bin.minPos[i]<minPos[i]) ? bin.minPos[i] : minPos[i];
+            maxPos[i] = (bin.maxPos[i]>maxPos[i]) ? bin.maxPos[i] : maxPos[i];
+         }
+         count += bin.count;
+      }
+   };
+}
+
+Bvh::Bvh()
+ : m_minPos(nullptr),
+   m_maxPos(nullptr),
+   m_nodesUsed(0),
+   m_depth(0),
+   m_maxLeafSize(8)
+{
+}
+
+void Bvh::build( const std::vector<float4>& minPos, const std::vector<float4>& maxPos, const int threads, const int maxLeafSize )
+{
+   m_minPos = &minPos;
+   m_maxPos = &maxPos;
+   m_maxLeafSize = (maxLeafSize<1) ? 1 : maxLeafSize;
+
+   const int count = static_cast<int>(minPos.size());
+   m_items.resize(count);
+   m_centroids.resize(count);
+   for( int i(0); i<count; ++i )
+   {
+      m_items[i] = i;
+      m_centroids[i].x = (minPos[i].x+maxPos[i].x)*0.5f;
+      m_centroids[i].y = (minPos[i].y+maxPos[i].y)*0.5f;
+      m_centroids[i].z = (minPos[i].z+maxPos[i].z)*0.5f;
+      m_centroids[i].w = 0.f;
+   }
+
+   // At most 2n-1 nodes. Node 1 is left unused so that siblings start on even indices
+   m_nodes.resize( 2*count+1 );
+   m_nodes[0].leftFirst = 0;
+   m_nodes[0].count     = count;
+   m_nodesUsed = 2;
+   m_depth = 1;
+   updateBounds(0);
+   if( count>0 ) subdivide( 0, 1, (threads<1) ? 1 : threads );
+   m_nodes.resize( m_nodesUsed );
+
+   m_minPos = nullptr;
+   m_maxPos = nullptr;
+}
+
+void Bvh::updateBounds( const int node )
+{
+   Bin bounds;
+   const BvhNode& n = m_nodes[node];
+   for( int i(n.leftFirst); i<n.leftFirst+n.count; ++i )
+   {
+      bounds.grow( (*m_minPos)[m_items[i]], (*m_maxPos)[m_items[i]] );
+   }
+   BvhNode& updated = m_nodes[node];
+   for( int i(0); i<3; ++i )
+   {
+      updated.minPos[i] = bounds.minPos[i];
+      updated.maxPos[i] = bounds.maxPos[i];
+   }
+}
+
+int Bvh::binOf( const Split& split, const int item ) const
+{
+   const int bin = static_cast<int>( (component(m_centroids[item],split.axis)-split.minCentroid)*split.scale );
+   return (bin<0) ? 0 : ((bin>=BINS) ? BINS-1 : bin);
+}
+
+Bvh::Split Bvh::findSplit( const BvhNode& node ) const
+{
+   Split best = { 0, -1, 0.f, 0.f, 1e30f };
+   const int first = node.leftFirst, last = node.leftFirst+node.count;
+
+   Bin centroids;
+   for( int i(first); i<last; ++i ) centroids.grow( m_centroids[m_items[i]], m_centroids[m_items[i]] );
+
+   for( int axis(0); axis<3; ++axis )
+   {
+      const float extent = centroids.maxPos[axis]-centroids.minPos[axis];
+      if( extent<=0.f ) continue;
+
+      Split split = { axis, -1, centroids.minPos[axis], BINS/extent, 1e30f };
+      Bin bins[BINS];
+      for( int i(first); i<last; ++i )
+      {
+         const int item = m_items[i];
+         Bin& bin = bins[binOf(split,item)];
+         bin.grow( (*m_minPos)[item], (*m_maxPos)[item] );
+         ++bin.count;
+      }
+
+      // Sweep from both ends, the cost of a plane is the items on each side times their area
+      float leftCost[BINS-1];
+      Bin left, right;
+      for( int i(0); i<BINS-1; ++i )
+      {
+         left.grow( bins[i] );
+         leftCost[i] = (left.count>0) ? left.count*area(left.minPos,left.maxPos) : -1.f;
+      }
+      for( int i(BINS-1); i>0; --i )
+      {
+         right.grow( bins[i] );
+         if( leftCost[i-1]<0.f || right.count==0 ) continue;
+         const float cost = leftCost[i-1] + right.count*area(right.minPos,right.maxPos);
+         if( cost<best.cost )
+         {
+            best = split;
+            best.bin  = i-1;
+            best.cost = cost;
+         }
+      }
+   }
+   return best;
+}
+
+void Bvh::subdivide( const int node, const int depth, const int threads )
+{
+   for( int deepest(m_depth); depth>deepest && !m_depth.compare_exchange_weak(deepest,depth); );
+
+   BvhNode& n = m_nodes[node];
+   if( n.count<=1 || depth>=Bvh::MAX_DEPTH ) return;
+
+   // A leaf costs an intersection per item, a split one traversal plus its children
+   const Split split = findSplit(n);
+   const float leafCost = n.count*area(n.minPos,n.maxPos);
+   if( split.bin<0 ) return;
+   if( n.count<=m_maxLeafSize && area(n.minPos,n.maxPos)+split.cost>=leafCost ) return;
+
+   int i(n.leftFirst), j(n.leftFirst+n.count-1);
+   while( i<=j )
+   {
+      if( binOf(split,m_items[i])<=split.bin ) ++i;
+      else std::swap( m_items[i], m_items[j--] );
+   }
+   const int leftCount = i-n.leftFirst;
+
+   const int pair = m_nodesUsed.fetch_add(2);
+   m_nodes[pair].leftFirst   = n.leftFirst;
+   m_nodes[pair].count       = leftCount;
+   m_nodes[pair+1].leftFirst = i;
+   m_nodes[pair+1].count     = n.count-leftCount;
+   n.leftFirst = pair;
+   n.count     = 0;
+   updateBounds(pair);
+   updateBounds(pair+1);
+
+   if( threads>1 && m_nodes[pair].count+m_nodes[pair+1].count>=PARALLEL_ITEMS )
+   {
+      std::thread left( &Bvh::subdivide, this, pair, depth+1, threads/2 );
+      subdivide( pair+1, depth+1, threads-threads/2 );
+      left.join();
+   }
+   else
+   {
+      subdivide( pair, depth+1, 1 );
+      subdivide( pair+1, depth+1, 1 );
+   }
+}
@@ -0,0 +1,88 @@
+/* 
+* Molecular Visualization HTTP Server
+* Copyright (C) 2011-2012 Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* aint with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+*/
+
+
+#pragma once
+
+#include <vector>
+#include <atomic>
+
+#include "../../../RaytracingEngine/tags/version-00.02.00/Consts.h"
+
+// ----------------------------------------------------------------------
+// Bounding volume hierarchy node, 32 bytes so that the two children,
+// which are always next to each other, share a cache line
+// ----------------------------------------------------------------------
+struct BvhNode
+{
+   float minPos[3];
+   int   leftFirst; // left child for an inner node, first item for a leaf
+   float maxPos[3];
+   int   count;     // items in a leaf, 0 for an inner node
+};
+
+// ----------------------------------------------------------------------
+// Bounding volume hierarchy over a set of boxes, split with the surface
+// area heuristic evaluated on bins. Nodes are stored flat, the root
+// first, and items are reordered so that every leaf is a range of
+// items(). Large subtrees are built on their own thread
+// ----------------------------------------------------------------------
+class Bvh
+{
+public:
+   static const int MAX_DEPTH = 64; // Deeper nodes become leaves, traversal stacks stay small
+
+   Bvh();
+
+   void build( const std::vector<float4>& minPos, const std::vector<float4>& maxPos, const int threads, const int maxLeafSize = 8 );
+
+   const std::vector<BvhNode>& nodes() const { return m_nodes; }
+   std::vector<BvhNode>& nodes() { return m_nodes; }
+   const std::vector<int>& items() const { return m_items; }
+   int size() const { return m_nodesUsed; }
+   int depth() const { return m_depth; }
+
+private:
+   struct Split
+   {
+      int   axis;
+      int   bin;         // last bin on the left, -1 when the items cannot be split
+      float minCentroid;
+      float scale;       // bins per unit along the axis
+      float cost;
+   };
+
+   void  updateBounds( const int node );
+   void  subdivide( const int node, const int depth, const int threads );
+   Split findSplit( const BvhNode& node ) const;
+   int   binOf( const Split& split, const int item ) const;
+
+   const std::vector<float4>* m_minPos;
+   const std::vector<float4>* m_maxPos;
+   std::vector<float4>        m_centroids;
+   std::vector<BvhNode>       m_nodes;
+   std::vector<int>           m_items;
+   std::atomic<int>           m_nodesUsed;
+   std::atomic<int>           m_depth;
+   int                        m_maxLeafSize;
+};
@@ -0,0 +1,622 @@
+/* 
+* Molecular Visualization HTTP Server
+* Copyright (C) 2011-2012 Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* aint with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+*/
+
+
+#include "CpuKernel.h"
+
+#include <math.h>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+#if !defined(CPUKERNEL_NO_SIMD) && (defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__))
+#define CPUKERNEL_SIMD
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+   const int   SIMD_WIDTH  = 4;
+   const float EPSILON     = 1.f;    // Offset of secondary rays, atoms are about 100 units wide
+   const float AMBIENT     = 0.2f;   // Light reaching the surfaces no lamp sees
+   const float TAN_HALF_FOV = 0.6f;  // Vertical field of view, about 62 degrees
+   const float PI          = 3.14159265f;
+   const float MISSED      = 1e30f;
+
+   inline float4 make4( const float x, const float y, const float z )
+   {
+      float4 v = { x, y, z, 0.f };
+      return v;
+   }
+
+   inline float4 add( const float4& a, const float4& b ) { return make4( a.x+b.x, a.y+b.y, a.z+b.z ); }
+   inline float4 sub( const float4& a, const float4& b ) { return make4( a.x-b.x, a.y-b.y, a.z-b.z ); }
+   inline float4 scale( const float4& a, const float s ) { return make4( a.x*s, a.y*s, a.z*s ); }
+   inline float4 mul( const float4& a, const float4& b ) { return make4( a.x*b.x, a.y*b.y, a.z*b.z ); }
+   inline float  dot( const float4& a, const float4& b ) { return a.x*b.x + a.y*b.y + a.z*b.z; }
+   inline float4 cross( const float4& a, const float4& b ) { return make4( a.y*b.z-a.z*b.y, a.z*b.x-a.x*b.z, a.x*b.y-a.y*b.x ); }
+
+   inline float4 normalize( const float4& a )
+   {
+      const float length = sqrtf(dot(a,a));
+      return (length>0.f) ? scale(a,1.f/length) : a;
+   }
+
+   // Rotates around the origin, x then y then z, like the device kernels rotate the camera
+   float4 rotate( const float4& v, const float4& angles )
+   {
+      float4 r = v;
+      if( angles.x != 0.f )
+      {
+         const float c = cosf(angles.x), s = sinf(angles.x);
+         r = make4( r.x, r.y*c - r.z*s, r.y*s + r.z*c );
+      }
+      if( angles.y != 0.f )
+      {
+         const float c = cosf(angles.y), s = sinf(angles.y);
+         r = make4( r.x*c + r.z*s, r.y, -r.x*s + r.z*c );
+      }
+      if( angles.z != 0.f )
+      {
+         const float c = cosf(angles.z), s = sinf(angles.z);
+         r = make4( r.x*c - r.y*s, r.x*s + r.y*c, r.z );
+      }
+      return r;
+   }
+
+   // Random numbers depend on the pixel and the iteration only, so a
+   // picture does not change with the number of threads
+   inline unsigned int hash( unsigned int value )
+   {
+      value = (value ^ 61) ^ (value >> 16);
+      value *= 9;
+      value = value ^ (value >> 4);
+      value *= 0x27d4eb2d;
+      return value ^ (value >> 15);
+   }
+
+   inline float random( unsigned int& seed )
+   {
+      seed ^= seed << 13;
+      seed ^= seed >> 17;
+      seed ^= seed << 5;
+      return static_cast<float>(seed >> 8) / 16777216.f;
+   }
+
+   // Where the ray enters the box, MISSED when it does not before maxT
+   inline float boxDistance( const float* minPos, const float* maxPos, const float4& origin, const float4& inverse, const float maxT )
+   {
+      float t0 = (minPos[0]-origin.x)*inverse.x, t1 = (maxPos[0]-origin.x)*inverse.x;
+      float tmin = (t0<t1) ? t0 : t1, tmax = (t0<t1) ? t1 : t0;
+      t0 = (minPos[1]-origin.y)*inverse.y; t1 = (maxPos[1]-origin.y)*inverse.y;
+      tmin = (t0<t1) ? ((t0>tmin) ? t0 : tmin) : ((t1>tmin) ? t1 : tmin);
+      tmax = (t0<t1) ? ((t1<tmax) ? t1 : tmax) : ((t0<tmax) ? t0 : tmax);
+      t0 = (minPos[2]-origin.z)*inverse.z; t1 = (maxPos[2]-origin.z)*inverse.z;
+      tmin = (t0<t1) ? ((t0>tmin) ? t0 : tmin) : ((t1>tmin) ? t1 : tmin);
+      tmax = (t0<t1) ? ((t1<tmax) ? t1 : tmax) : ((t0<tmax) ? t0 : tmax);
+      return (tmax>=tmin && tmax>0.f && tmin<maxT) ? ((tmin>0.f) ? tmin : 0.f) : MISSED;
+   }
+
+   inline float4 inverseOf( const float4& direction )
+   {
+      return make4( 
+         (direction.x!=0.f) ? 1.f/direction.x : 1e30f,
+         (direction.y!=0.f) ? 1.f/direction.y : 1e30f,
+         (direction.z!=0.f) ? 1.f/direction.z : 1e30f );
+   }
+
+   inline void emptyBounds( float4& minPos, float4& maxPos )
+   {
+      minPos = make4(  1e30f,  1e30f,  1e30f );
+      maxPos = make4( -1e30f, -1e30f, -1e30f );
+   }
+
+   inline void primitiveBounds( const Primitive& primitive, float4& minPos, float4& maxPos )
+   {
+      const float radius = primitive.size.x;
+      const float4& p1 = (primitive.type == ptCylinder) ? primitive.p1 : primitive.p0;
+      minPos = make4( fminf(primitive.p0.x,p1.x)-radius, fminf(primitive.p0.y,p1.y)-radius, fminf(primitive.p0.z,p1.z)-radius );
+      maxPos = make4( fmaxf(primitive.p0.x,p1.x)+radius, fmaxf(primitive.p0.y,p1.y)+radius, fmaxf(primitive.p0.z,p1.z)+radius );
+   }
+}
+
+CpuKernel::CpuKernel( const bool activeLogging, const bool protein, const int threads )
+ : GPUKernel( activeLogging, protein ),
+   m_threads( (threads<1) ? 1 : threads ),
+   m_acceleration(caBvh),
+   m_buildTime(0.0),
+   m_rays(0),
+   m_width(0),
+   m_height(0),
+   m_iteration(0),
+   m_nextRow(0)
+{
+}
+
+CpuKernel::~CpuKernel()
+{
+}
+
+void CpuKernel::initBuffers()
+{
+   GPUKernel::initBuffers();
+   m_accumulation.resize( static_cast<size_t>(m_sceneInfo.width.x)*m_sceneInfo.height.x*3 );
+}
+
+// ----------------------------------------------------------------------
+// Scene
+// ----------------------------------------------------------------------
+void CpuKernel::buildScene()
+{
+   const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+   m_primitives.clear();
+   m_boxes.clear();
+   m_nodes.clear();
+   m_lamps.clear();
+
+   std::vector<int> drawn;
+   const int count = getNbActivePrimitives();
+   m_primitives.reserve(count);
+   drawn.reserve(count);
+   for( int i(0); i<count; ++i )
+   {
+      const Primitive& primitive = *getPrimitive(i);
+      m_primitives.push_back(primitive);
+      if( primitive.materialId<0 || primitive.materialId>=NB_MAX_MATERIALS ) continue;
+
+      // Lamps light the scene, they are neither drawn nor cast shadows
+      if( m_hMaterials[primitive.materialId].innerIllumination.x > 0.f )
+      {
+         m_lamps.push_back(i);
+         continue;
+      }
+
+      // Planes are not supported, the server does not use them
+      if( primitive.type == ptSphere || primitive.type == ptCylinder ) drawn.push_back(i);
+   }
+
+   if( m_acceleration == caBvh )
+   {
+      buildBvh( drawn );
+   }
+   else
+   {
+      buildBoxes( drawn );
+   }
+
+   // Empty lanes have a negative squared radius, rays always miss them
+   for( size_t i(0); i<m_boxes.size(); ++i )
+   {
+      Box& box = m_boxes[i];
+      while( box.spheres.size()%SIMD_WIDTH != 0 )
+      {
+         box.x.push_back(0.f);
+         box.y.push_back(0.f);
+         box.z.push_back(0.f);
+         box.radius2.push_back(-1.f);
+         box.spheres.push_back(-1);
+      }
+   }
+   m_buildTime = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+}
+
+void CpuKernel::addPrimitive( Box& box, const int index ) const
+{
+   const Primitive& primitive = m_primitives[index];
+   float4 minPos, maxPos;
+   primitiveBounds( primitive, minPos, maxPos );
+   box.minPos = make4( fminf(box.minPos.x,minPos.x), fminf(box.minPos.y,minPos.y), fminf(box.minPos.z,minPos.z) );
+   box.maxPos = make4( fmaxf(box.maxPos.x,maxPos.x), fmaxf(box.maxPos.y,maxPos.y), fmaxf(box.maxPos.z,maxPos.z) );
+
+   if( primitive.type == ptSphere )
+   {
+      box.x.push_back( primitive.p0.x );
+      box.y.push_back( primitive.p0.y );
+      box.z.push_back( primitive.p0.z );
+      box.radius2.push_back( primitive.size.x*primitive.size.x );
+      box.spheres.push_back(index);
+   }
+   else
+   {
+      box.cylinders.push_back(index);
+   }
+}
+
+void CpuKernel::buildBoxes( const std::vector<int>& primitives )
+{
+   std::vector<int> boxes; // scene box -> index in m_boxes
+   for( size_t i(0); i<primitives.size(); ++i )
+   {
+      const int sceneBox = getPrimitiveBox(primitives[i]);
+      if( sceneBox<0 ) continue;
+      if( sceneBox>=static_cast<int>(boxes.size()) ) boxes.resize( sceneBox+1, -1 );
+      if( boxes[sceneBox] == -1 )
+      {
+         boxes[sceneBox] = static_cast<int>(m_boxes.size());
+         m_boxes.push_back( Box() );
+         emptyBounds( m_boxes.back().minPos, m_boxes.back().maxPos );
+      }
+      addPrimitive( m_boxes[boxes[sceneBox]], primitives[i] );
+   }
+}
+
+void CpuKernel::buildBvh( const std::vector<int>& primitives )
+{
+   std::vector<float4> minPos(primitives.size()), maxPos(primitives.size());
+   for( size_t i(0); i<primitives.size(); ++i )
+   {
+      primitiveBounds( m_primitives[primitives[i]], minPos[i], maxPos[i] );
+   }
+
+   Bvh bvh;
+   bvh.build( minPos, maxPos, m_threads );
+   m_nodes.swap( bvh.nodes() );
+
+   // Every leaf becomes a box, the leaf then points to it
+   const std::vector<int>& items = bvh.items();
+   for( size_t i(0); i<m_nodes.size(); ++i )
+   {
+      BvhNode& node = m_nodes[i];
+      if( node.count==0 ) continue;
+      m_boxes.push_back( Box() );
+      Box& box = m_boxes.back();
+      emptyBounds( box.minPos, box.maxPos );
+      for( int j(node.leftFirst); j<node.leftFirst+node.count; ++j )
+      {
+         addPrimitive( box, primitives[items[j]] );
+      }
+      node.leftFirst = static_cast<int>(m_boxes.size())-1;
+   }
+}
+
+// ----------------------------------------------------------------------
+// Intersections
+// ----------------------------------------------------------------------
+void CpuKernel::intersectSpheres( const Box& box, const float4& origin, const float4& direction, Hit& hit ) const
+{
+   const size_t count = box.spheres.size();
+#ifdef CPUKERNEL_SIMD
+   const __m128 ox = _mm_set1_ps(origin.x), oy = _mm_set1_ps(origin.y), oz = _mm_set1_ps(origin.z);
+   const __m128 dx = _mm_set1_ps(direction.x), dy = _mm_set1_ps(direction.y), dz = _mm_set1_ps(direction.z);
+   const __m128 epsilon = _mm_set1_ps(EPSILON);
+   for( size_t i(0); i<count; i+=SIMD_WIDTH )
+   {
+      const __m128 cx = _mm_sub_ps( _mm_loadu_ps(&box.x[i]), ox );
+      const __m128 cy = _mm_sub_ps( _mm_loadu_ps(&box.y[i]), oy );
+      const __m128 cz = _mm_sub_ps( _mm_loadu_ps(&box.z[i]), oz );
+      const __m128 b  = _mm_add_ps( _mm_add_ps( _mm_mul_ps(cx,dx), _mm_mul_ps(cy,dy) ), _mm_mul_ps(cz,dz) );
+      const __m128 c  = _mm_sub_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps(cx,cx), _mm_mul_ps(cy,cy) ), _mm_mul_ps(cz,cz) ), _mm_loadu_ps(&box.radius2[i]) );
+      const __m128 discriminant = _mm_sub_ps( _mm_mul_ps(b,b), c );
+      const __m128 root = _mm_sqrt_ps( _mm_max_ps( discriminant, _mm_setzero_ps() ) );
+
+      // Nearest root in front of the ray, the far one when the ray starts inside
+      const __m128 t0 = _mm_sub_ps( b, root );
+      const __m128 t1 = _mm_add_ps( b, root );
+      const __m128 useNear = _mm_cmpgt_ps( t0, epsilon );
+      const __m128 t = _mm_or_ps( _mm_and_ps(useNear,t0), _mm_andnot_ps(useNear,t1) );
+
+      const __m128 mask = _mm_and_ps( 
+         _mm_and_ps( _mm_cmpge_ps( discriminant, _mm_setzero_ps() ), _mm_cmpgt_ps( t, epsilon ) ),
+         _mm_cmplt_ps( t, _mm_set1_ps(hit.t) ) );
+      int lanes = _mm_movemask_ps(mask);
+      if( lanes == 0 ) continue;
+
+      float distances[SIMD_WIDTH];
+      _mm_storeu_ps( distances, t );
+      for( int lane(0); lanes!=0; ++lane, lanes>>=1 )
+      {
+         if( (lanes & 1) && distances[lane]<hit.t )
+         {
+            hit.t = distances[lane];
+            hit.primitive = box.spheres[i+lane];
+         }
+      }
+   }
+#else
+   for( size_t i(0); i<count; ++i )
+   {
+      const float cx = box.x[i]-origin.x, cy = box.y[i]-origin.y, cz = box.z[i]-origin.z;
+      const float b = cx*direction.x + cy*direction.y + cz*direction.z;
+      const float discriminant = b*b - (cx*cx + cy*cy + cz*cz - box.radius2[i]);
+      if( discriminant<0.f ) continue;
+      const float root = sqrtf(discriminant);
+      const float t = (b-root > EPSILON) ? b-root : b+root;
+      if( t>EPSILON && t<hit.t )
+      {
+         hit.t = t;
+         hit.primitive = box.spheres[i];
+      }
+   }
+#endif // CPUKERNEL_SIMD
+}
+
+void CpuKernel::intersectCylinder( const int index, const float4& origin, const float4& direction, Hit& hit ) const
+{
+   // Open cylinder between p0 and p1, the atoms at both ends close it
+   const Primitive& primitive = m_primitives[index];
+   float4 axis = sub( primitive.p1, primitive.p0 );
+   const float length = sqrtf(dot(axis,axis));
+   if( length<=0.f ) return;
+   axis = scale( axis, 1.f/length );
+
+   const float4 oc = sub( origin, primitive.p0 );
+   const float  dAxis = dot( direction, axis );
+   const float  ocAxis = dot( oc, axis );
+   const float4 d = sub( direction, scale(axis,dAxis) );
+   const float4 o = sub( oc, scale(axis,ocAxis) );
+
+   const float a = dot(d,d);
+   if( a<1e-12f ) return;
+   const float b = dot(d,o);
+   const float c = dot(o,o) - primitive.size.x*primitive.size.x;
+   const float discriminant = b*b - a*c;
+   if( discriminant<0.f ) return;
+
+   const float root = sqrtf(discriminant);
+   const float roots[2] = { (-b-root)/a, (-b+root)/a };
+   for( int i(0); i<2; ++i )
+   {
+      const float t = roots[i];
+      if( t<=EPSILON || t>=hit.t ) continue;
+      const float h = ocAxis + t*dAxis;
+      if( h<0.f || h>length ) continue;
+      hit.t = t;
+      hit.primitive = index;
+      return;
+   }
+}
+
+float4 CpuKernel::normalAt( const int index, const float4& point ) const
+{
+   const Primitive& primitive = m_primitives[index];
+   if( primitive.type == ptCylinder )
+   {
+      const float4 axis = normalize( sub( primitive.p1, primitive.p0 ) );
+      const float4 v = sub( point, primitive.p0 );
+      return normalize( sub( v, scale( axis, dot(v,axis) ) ) );
+   }
+   return normalize( sub( point, primitive.p0 ) );
+}
+
+bool CpuKernel::intersectBox( const Box& box, const float4& origin, const float4& direction, Hit& hit ) const
+{
+   const float t = hit.t;
+   intersectSpheres( box, origin, direction, hit );
+   for( size_t i(0); i<box.cylinders.size(); ++i )
+   {
+      intersectCylinder( box.cylinders[i], origin, direction, hit );
+   }
+   return hit.t<t;
+}
+
+bool CpuKernel::intersect( const float4& origin, const float4& direction, const float maxT, Hit& hit, const bool anyHit ) const
+{
+   hit.t = maxT;
+   hit.primitive = -1;
+   const float4 inverse = inverseOf(direction);
+   if( m_nodes.empty() )
+   {
+      for( size_t i(0); i<m_boxes.size(); ++i )
+      {
+         const Box& box = m_boxes[i];
+         if( boxDistance( &box.minPos.x, &box.maxPos.x, origin, inverse, hit.t ) == MISSED ) continue;
+         if( intersectBox( box, origin, direction, hit ) && anyHit ) break;
+      }
+   }
+   else
+   {
+      // Nearest child first, the other one waits on the stack with its distance
+      int   stack[Bvh::MAX_DEPTH];
+      float distances[Bvh::MAX_DEPTH];
+      int   top(0);
+      int   node(0);
+      bool  visit = boxDistance( m_nodes[0].minPos, m_nodes[0].maxPos, origin, inverse, hit.t ) != MISSED;
+      while( visit )
+      {
+         const BvhNode& n = m_nodes[node];
+         if( n.count>0 )
+         {
+            if( intersectBox( m_boxes[n.leftFirst], origin, direction, hit ) && anyHit ) break;
+         }
+         else
+         {
+            int nearNode = n.leftFirst, farNode = n.leftFirst+1;
+            float nearT = boxDistance( m_nodes[nearNode].minPos, m_nodes[nearNode].maxPos, origin, inverse, hit.t );
+            float farT  = boxDistance( m_nodes[farNode].minPos, m_nodes[farNode].maxPos, origin, inverse, hit.t );
+            if( farT<nearT )
+            {
+               std::swap( nearNode, farNode );
+               std::swap( nearT, farT );
+            }
+            if( nearT != MISSED )
+            {
+               if( farT != MISSED )
+               {
+                  stack[top] = farNode;
+                  distances[top++] = farT;
+               }
+               node = nearNode;
+               continue;
+            }
+         }
+
+         // Next node on the stack still in front of the nearest hit
+         visit = false;
+         while( top>0 && !visit )
+         {
+            --top;
+            node = stack[top];
+            visit = distances[top]<hit.t;
+         }
+      }
+   }
+   if( hit.primitive<0 ) return false;
+   hit.normal = normalAt( hit.primitive, add( origin, scale(direction,hit.t) ) );
+   return true;
+}
+
+bool CpuKernel::occluded( const float4& origin, const float4& direction, const float maxT ) const
+{
+   Hit hit;
+   return intersect( origin, direction, maxT, hit, true );
+}
+
+// ----------------------------------------------------------------------
+// Shading
+// ----------------------------------------------------------------------
+float4 CpuKernel::shade( const Hit& hit, const float4& origin, const float4& direction, unsigned int& seed, int& rays ) const
+{
+   const Primitive& primitive = m_primitives[hit.primitive];
+   const Material& material = m_hMaterials[primitive.materialId];
+   const float4 point = add( origin, scale(direction,hit.t) );
+   const float4 normal = (dot(hit.normal,direction)>0.f) ? scale(hit.normal,-1.f) : hit.normal;
+   const float4 start = add( point, scale(normal,EPSILON) );
+
+   if( m_postProcessingInfo.type.x == ppe_ambientOcclusion )
+   {
+      // One cosine weighted ray per iteration, the accumulation averages them
+      const float4 tangent = normalize( (fabsf(normal.x)>0.1f) ? cross( make4(0.f,1.f,0.f), normal ) : cross( make4(1.f,0.f,0.f), normal ) );
+      const float4 bitangent = cross( normal, tangent );
+      const float u = random(seed), phi = 2.f*PI*random(seed);
+      const float r = sqrtf(u);
+      const float4 ray = add( add( scale(tangent,r*cosf(phi)), scale(bitangent,r*sinf(phi)) ), scale(normal,sqrtf(1.f-u)) );
+      const float reach = (m_postProcessingInfo.param2.x>0.f) ? m_postProcessingInfo.param2.x : m_sceneInfo.viewDistance.x;
+      ++rays;
+      return occluded( start, ray, reach ) ? make4(0.f,0.f,0.f) : material.color;
+   }
+
+   float4 diffuse = make4( AMBIENT, AMBIENT, AMBIENT );
+   float4 specular = make4( 0.f, 0.f, 0.f );
+   for( size_t i(0); i<m_lamps.size(); ++i )
+   {
+      const Primitive& lamp = m_primitives[m_lamps[i]];
+      const Material& lampMaterial = m_hMaterials[lamp.materialId];
+
+      // A different point of the lamp every iteration gives soft shadows
+      float4 target = lamp.p0;
+      if( m_iteration>0 )
+      {
+         const float z = 1.f-2.f*random(seed), phi = 2.f*PI*random(seed);
+         const float r = sqrtf(fmaxf(0.f,1.f-z*z));
+         target = add( target, scale( make4( r*cosf(phi), r*sinf(phi), z ), lamp.size.x ) );
+      }
+      const float4 toLamp = sub( target, point );
+      const float distance = sqrtf(dot(toLamp,toLamp));
+      const float4 light = scale( toLamp, 1.f/distance );
+      const float lambert = dot( normal, light );
+      if( lambert<=0.f ) continue;
+
+      const bool shadow = m_sceneInfo.shadowsEnabled.x && (++rays, occluded( start, light, distance ));
+      const float4 lampColor = scale( lampMaterial.color, lampMaterial.innerIllumination.x );
+      diffuse = add( diffuse, scale( lampColor, shadow ? lambert*(1.f-m_sceneInfo.shadowIntensity.x) : lambert ) );
+
+      if( !shadow && material.specular.x>0.f )
+      {
+         const float4 reflected = sub( scale(normal,2.f*lambert), light );
+         const float highlight = -dot( reflected, direction );
+         if( highlight>0.f ) specular = add( specular, scale( lampColor, material.specular.x*powf(highlight,material.specular.y) ) );
+      }
+   }
+   return add( mul( material.color, diffuse ), specular );
+}
+
+// ----------------------------------------------------------------------
+// Rendering
+// ----------------------------------------------------------------------
+int CpuKernel::renderPixel( const int x, const int y, float* color ) const
+{
+   unsigned int seed = hash( static_cast<unsigned int>(y*m_width+x) ^ hash(static_cast<unsigned int>(m_iteration)+1) );
+   seed = (seed==0) ? 1 : seed;
+
+   // The first iteration samples the centre of the pixel, the next ones spread over it
+   const float jitterX = (m_iteration>0) ? random(seed) : 0.5f;
+   const float jitterY = (m_iteration>0) ? random(seed) : 0.5f;
+
+   // The screen is the plane of the target, facing the camera along z
+   const float4 forward = sub( m_viewDir, m_viewPos );
+   const float pixel = 2.f*sqrtf(dot(forward,forward))*TAN_HALF_FOV/m_height;
+   const float4 onScreen = add( m_viewDir, make4( (x+jitterX-m_width*0.5f)*pixel, (m_height*0.5f-y-jitterY)*pixel, 0.f ) );
+   const float4 origin = rotate( m_viewPos, m_angles );
+   const float4 direction = normalize( rotate( sub(onScreen,m_viewPos), m_angles ) );
+
+   Hit hit;
+   int rays(1);
+   const float4 result = intersect( origin, direction, m_sceneInfo.viewDistance.x, hit ) ?
+      shade( hit, origin, direction, seed, rays ) : m_sceneInfo.backgroundColor;
+   color[0] = result.x;
+   color[1] = result.y;
+   color[2] = result.z;
+   return rays;
+}
+
+void CpuKernel::renderRows()
+{
+   uint64_t rays(0);
+   for( int y(m_nextRow++); y<m_height; y=m_nextRow++ )
+   {
+      float* row = &m_accumulation[static_cast<size_t>(y)*m_width*3];
+      for( int x(0); x<m_width; ++x )
+      {
+         float color[3];
+         rays += renderPixel( x, y, color );
+         float* accumulated = row+x*3;
+         for( int c(0); c<3; ++c )
+         {
+            accumulated[c] = (m_iteration==0) ? color[c] : accumulated[c] + (color[c]-accumulated[c])/(m_iteration+1);
+         }
+      }
+   }
+   m_rays += rays;
+}
+
+void CpuKernel::render_begin( const float timer )
+{
+   m_width     = m_sceneInfo.width.x;
+   m_height    = m_sceneInfo.height.x;
+   m_iteration = m_sceneInfo.pathTracingIteration.x;
+   if( m_width<=0 || m_height<=0 ) return;
+
+   // A new picture starts at iteration 0, the scene may have moved since the last one
+   if( m_iteration==0 ) buildScene();
+   const size_t values = static_cast<size_t>(m_width)*m_height*3;
+   if( m_accumulation.size()<values ) m_accumulation.resize(values);
+
+   m_nextRow = 0;
+   std::vector<std::thread> threads;
+   for( int i(1); i<m_threads && i<m_height; ++i )
+   {
+      threads.push_back( std::thread( &CpuKernel::renderRows, this ) );
+   }
+   renderRows();
+   for( size_t i(0); i<threads.size(); ++i ) threads[i].join();
+}
+
+void CpuKernel::render_end( char* bitmap )
+{
+   const size_t values = static_cast<size_t>(m_width)*m_height*3;
+   for( size_t i(0); i<values; ++i )
+   {
+      const float value = m_accumulation[i]*255.f;
+      bitmap[i] = static_cast<char>( (value<0.f) ? 0 : ((value>255.f) ? 255 : static_cast<int>(value)) );
+   }
+}
@@ -0,0 +1,129 @@
+/* 
+* Molecular Visualization HTTP Server
+* Copyright (C) 2011-2012 Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* aint with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+*/
+
+
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "../../../RaytracingEngine/tags/version-00.02.00/Consts.h"
+#include "../../../RaytracingEngine/tags/version-00.02.00/GPUKernel.h"
+
+#include "Bvh.h"
+
+// Acceleration structure over the primitives
+enum CpuAcceleration
+{
+   caBoxes, // the boxes the PDB reader binned the atoms into
+   caBvh    // a bounding volume hierarchy built for every picture
+};
+
+// ----------------------------------------------------------------------
+// Path tracer running on the host, for servers without a CUDA device.
+// It takes the scene through the GPUKernel interface like the device
+// kernels do (PDB reader, materials, camera, scene and post processing
+// info) and renders the part of it the server uses: spheres and
+// cylinders, lamps with soft shadows, ambient occlusion, and path
+// tracing accumulation over pathTracingIteration. Rows are shared
+// between threads, and spheres are intersected four at a time with SSE.
+// Rays go through a BVH by default, the scene boxes are kept to compare
+// ----------------------------------------------------------------------
+class CpuKernel : public GPUKernel
+{
+public:
+   CpuKernel( const bool activeLogging, const bool protein, const int threads );
+   ~CpuKernel();
+
+   virtual void initBuffers();
+
+   // Renders one iteration into the accumulation buffer
+   virtual void render_begin( const float timer );
+   // Writes the accumulated picture as RGB bytes
+   virtual void render_end( char* bitmap );
+
+   int threads() const { return m_threads; }
+
+   void setAcceleration( const CpuAcceleration acceleration ) { m_acceleration = acceleration; }
+   CpuAcceleration acceleration() const { return m_acceleration; }
+
+   // Seconds spent building the acceleration structure of the current picture
+   double buildTime() const { return m_buildTime; }
+   // Leaves and inner nodes, 0 for the scene boxes
+   size_t nodes() const { return m_nodes.size(); }
+   // Primary, shadow and occlusion rays traced since the last reset
+   uint64_t rays() const { return m_rays; }
+   void resetRays() { m_rays = 0; }
+
+private:
+   // Primitives of a BVH leaf or of a scene box, spheres laid out for
+   // SIMD and padded with empty lanes
+   struct Box
+   {
+      float4              minPos;
+      float4              maxPos;
+      std::vector<float>  x, y, z, radius2;
+      std::vector<int>    spheres;
+      std::vector<int>    cylinders;
+   };
+
+   struct Hit
+   {
+      float  t;
+      int    primitive;
+      float4 normal;
+   };
+
+   void buildScene();
+   void buildBoxes( const std::vector<int>& primitives );
+   void buildBvh( const std::vector<int>& primitives );
+   void addPrimitive( Box& box, const int index ) const;
+   void renderRows();
+   int  renderPixel( const int x, const int y, float* color ) const;
+
+   // Nearest hit, or any hit for shadows
+   bool intersect( const float4& origin, const float4& direction, const float maxT, Hit& hit, const bool anyHit = false ) const;
+   bool intersectBox( const Box& box, const float4& origin, const float4& direction, Hit& hit ) const;
+   bool occluded( const float4& origin, const float4& direction, const float maxT ) const;
+   void intersectSpheres( const Box& box, const float4& origin, const float4& direction, Hit& hit ) const;
+   void intersectCylinder( const int index, const float4& origin, const float4& direction, Hit& hit ) const;
+   float4 normalAt( const int index, const float4& point ) const;
+   float4 shade( const Hit& hit, const float4& origin, const float4& direction, unsigned int& seed, int& rays ) const;
+
+private:
+   int                    m_threads;
+   CpuAcceleration        m_acceleration;
+   std::vector<Primitive> m_primitives;
+   std::vector<Box>       m_boxes;
+   std::vector<BvhNode>   m_nodes;        // leaves point to m_boxes
+   double                 m_buildTime;
+   std::atomic<uint64_t>  m_rays;
+   std::vector<int>       m_lamps;
+   std::vector<float>     m_accumulation; // RGB, averaged over the iterations
+   int                    m_width;
+   int                    m_height;
+   int                    m_iteration;
+   std::atomic<int>       m_nextRow;
+};
@@ -34,6 +34,11 @@
 #include <math.h>
 #include <stdint.h>
 #include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <thread>
+#include <atomic>
+#include <algorithm>
 
 #include "../../../RaytracingEngine/tags/version-00.02.00/Consts.h"
 #include "../../../RaytracingEngine/tags/version-00.02.00/PDBReader.h"
@@ -42,16 +47,62 @@
 #include "wininet.h" // for clearing URL cache DeleteUrlCacheEntry
 #pragma comment(lib, "wininet.lib") // for clearing URL cache DeleteUrlCacheEntry
 
-extern bool jo_write_jpg(const char *filename, const void *data, int width, int height, int comp, int quality);
+#include "JpegEncoder.h"
+#include "JpegDecoder.h"
+#include "Base64.h"
+#include "RenderContextPool.h"
+#include "CpuKernel.h"
+#include "MoleculeCache.h"
+#include "MoleculeFile.h"
+#include "PdbParser.h"
+#include "PdbFetcher.h"
+#include "ResponseCache.h"
+#include "RenderRequest.h"
+#include "RenderWorkers.h"
 
 // Requests
 std::map<std::string,std::string> gRequests;
 
 // ----------------------------------------------------------------------
-// Kernel
+// Render contexts
 // ----------------------------------------------------------------------
-typedef CudaKernel GPUKERNEL;
-GPUKERNEL* gpuKernel(nullptr);
+RenderContextPool gRenderContexts;
+RenderBackend     gRenderBackend(rbCuda);
+int               gNbRenderContexts(1);
+unsigned int      gMaxImageSize(2048); // Largest width and height a context can render
+
+// ----------------------------------------------------------------------
+// Render workers, one per render context. Outstanding work is bounded
+// in millions of pixels x iterations, a size=4&quality=20 request is 84
+// ----------------------------------------------------------------------
+RenderWorkers gRenderWorkers;
+int           gRenderBudget(512);
+int           gClientRenderBudget(128);
+
+// Jobs queued or rendering, by canonical request. Identical requests
+// arriving meanwhile wait for the same picture. Event loop only
+std::map<std::string, RenderJob*> gPendingJobs;
+size_t                            gCoalescedRequests(0);
+
+// Jobs waiting for their PDB file to download before they are submitted,
+// by PDB file name. They are in gPendingJobs too. Event loop only
+std::multimap<std::string, RenderJob*> gParkedJobs;
+
+// ----------------------------------------------------------------------
+// PDB files missing from ../Pdb, downloaded from the mirror
+// ----------------------------------------------------------------------
+PdbFetcher gPdbFetcher;
+int        gFetchThreads(4);
+
+// ----------------------------------------------------------------------
+// Molecules already built, by molecule, structure, scheme and sizes
+// ----------------------------------------------------------------------
+MoleculeCache gMoleculeCache(256*1024*1024);
+
+// ----------------------------------------------------------------------
+// Encoded pictures by canonical request
+// ----------------------------------------------------------------------
+ResponseCache gResponseCache(128*1024*1024);
 
 // ----------------------------------------------------------------------
 // Stats
@@ -59,16 +110,47 @@ GPUKERNEL* gpuKernel(nullptr);
 int gNbCalls(0);
 
 // ----------------------------------------------------------------------
-// Molecules
+// JPEG encoding
+// ----------------------------------------------------------------------
+// Threads per encode, 0 until main shares the cores among the render workers:
+// every worker encodes at the same time, and each encode starts its own threads
+int gJpegThreads(0);
+
+int defaultJpegThreads( const int workers )
+{
+   const int cores = static_cast<int>(std::thread::hardware_concurrency());
+   return std::max( cores/std::max( workers, 1 ), 1 );
+}
+
+// ----------------------------------------------------------------------
+// Molecules, read from the catalog before the event loop starts
 // ----------------------------------------------------------------------
-size_t gCurrentProtein(0);
 std::vector<std::string> gProteinNames;
+std::string              gCatalogFile("molecules.txt");
+
+// ----------------------------------------------------------------------
+// Prewarm: at startup, the catalog is downloaded and its molecules built
+// (and, with pmPictures, their default pictures rendered) on a thread of
+// its own. /ready answers 503 until it is done
+// ----------------------------------------------------------------------
+enum PrewarmMode
+{
+   pmNone,
+   pmMolecules,
+   pmPictures
+};
+PrewarmMode       gPrewarmMode(pmMolecules);
+int               gPrewarmThreads(static_cast<int>(std::thread::hardware_concurrency()));
+std::thread       gPrewarmThread;
+std::atomic<int>  gPrewarmedMolecules(0);
+std::atomic<int>  gPrewarmedPictures(0);
+std::atomic<int>  gPrewarmFailures(0);
+std::atomic<bool> gReady(false);
 
 // ----------------------------------------------------------------------
 // Scene
 // ----------------------------------------------------------------------
-unsigned int gWindowWidth  = 512;
-unsigned int gWindowHeight = gWindowWidth;
+unsigned int gDefaultImageSize = 512; // Width and height when the request gives no size
 unsigned int gWindowDepth  = 4;
 
 float4 gBkGrey  = {0.5f, 0.5f, 0.5f, 0.f};
@@ -78,8 +160,8 @@ int4  misc = {otJPEG,0,0,1};
 
 SceneInfo gSceneInfo = 
 { 
-   gWindowWidth,               // width
-   gWindowHeight,              // height
+   gDefaultImageSize,          // width
+   gDefaultImageSize,          // height
    true,                       // shadowsEnabled
    10,                         // nbRayIterations
    3.f,                        // transparentColor
@@ -108,10 +190,7 @@ int    gBox(0);
 float4 gRotationCenter = { 0.f, 0.f, 0.f, 0.f };
 
 // Scene description and behavior
-int gNbBoxes      = 0;
-int gNbPrimitives = 0;
 int gNbLamps      = 0;
-int gNbMaterials  = 0;
 
 // Camera information
 float4 gViewPos    = { 0.f, 0.f, -15000.f, 0.f };
@@ -129,56 +208,13 @@ PostProcessingInfo gPostProcessingInfo =
    60 
 };
 
-// ----------------------------------------------------------------------
-// Utils
-// ----------------------------------------------------------------------
-void saturateFloat4(float4& value, const float min, const float max )
-{
-   value.x = (value.x < min) ? min : value.x;
-   value.y = (value.y < min) ? min : value.y;
-   value.z = (value.z < min) ? min : value.z;
-   value.x = (value.x > max) ? max : value.x;
-   value.y = (value.y > max) ? max : value.y;
-   value.z = (value.z > max) ? max : value.z;
-}
-
-float4 readFloat4(const std::string value)
-{
-   float4 result = {0.f,0.f,0.f,0.f};
-   std::string element;
-   int i(0);
-   for( int j(0); j<value.length(); ++j)
-   {
-      if( value[j] == ',' )
-      {
-         switch( i )
-         {
-         case 0: result.x = static_cast<float>(atof(element.c_str())); break;
-         case 1: result.y = static_cast<float>(atof(element.c_str())); break;
-         case 2: result.z = static_cast<float>(atof(element.c_str())); break;
-         }
-         element = "";
-         i++;
-      }
-      else
-      {
-         element += value[j];
-      }
-   }
-   if( element.length() != 0 )
-   {
-      result.z = static_cast<float>(atof(element.c_str()));
-   }
-   return result;
-}
-
 /*
 ________________________________________________________________________________
 
 Create Random Materials
 ________________________________________________________________________________
 */
-void createRandomMaterials()
+void createRandomMaterials( GPUKERNEL& kernel )
 {
    float4 specular;
    // Materials
@@ -203,9 +239,6 @@ void createRandomMaterials()
       float noise = 0.f;
       bool  procedural = false;
 
-      r = 0.5f+rand()%40/100.f;
-      g = 0.5f+rand()%40/100.f;
-      b = 0.5f+rand()%40/100.f;
       // Proteins
       switch( i%10 )
       {
@@ -237,9 +270,9 @@ void createRandomMaterials()
       case 99: r = 1.0f; g = 1.0f; b = 1.0f; innerIllumination = 1.f; break;
       }
 
-      gNbMaterials = gpuKernel->addMaterial();
-      gpuKernel->setMaterial( 
-         gNbMaterials,
+      int material = kernel.addMaterial();
+      kernel.setMaterial( 
+         material,
          r, g, b, noise,
          reflection, 
          refraction,
@@ -251,25 +284,58 @@ void createRandomMaterials()
    }
 }
 
+// ----------------------------------------------------------------------
+// Builds the molecule from the PDB file into the kernel, keeps it in the
+// cache and writes its binary file for the next cache misses. Returns
+// false when the file has no atom (not a PDB file), nothing is kept then
+// ----------------------------------------------------------------------
+bool readMolecule( GPUKERNEL& kernel, const MoleculeKey& key, const std::string& fileName, float4& size )
+{
+   PDBReader prbReader;
+   size = prbReader.loadAtomsFromFile(
+      fileName, kernel, 10, gNbMaxBoxes,
+      static_cast<GeometryType>(key.structureType), 
+      key.atomSize, key.stickSize, key.scheme );
+
+   const int count = kernel.getNbActivePrimitives();
+   if( count == 0 ) return false;
+   std::shared_ptr<const CachedMolecule> molecule = captureMolecule( kernel, count, size );
+   gMoleculeCache.insert( key, molecule );
+   saveMoleculeFile( moleculeFileName( fileName, key ), key, fileName, *molecule );
+   return true;
+}
+
 // ----------------------------------------------------------------------
 // Create 3D Scene
 // ----------------------------------------------------------------------
-float4 createScene( const std::string& fileName, const int structureType, const int scheme, const PostProcessingInfo& postProcessingInfo )
+// Returns false when the molecule has no atom, the scene is left empty
+bool createScene( GPUKERNEL& kernel, const std::string& moleculeName, const std::string& fileName, const int structureType, const int scheme, const PostProcessingInfo& postProcessingInfo, float4& size, int& nbBoxes )
 {
    // 3D Scene
-   gpuKernel->setCamera( gViewPos, gViewDir, gViewAngles );
+   kernel.setCamera( gViewPos, gViewDir, gViewAngles );
 
-   // Lamp
-   gNbPrimitives = gpuKernel->addPrimitive( ptSphere );
-   gpuKernel->setPrimitive( gNbPrimitives, 0, 20000.f, 14000.f, -50000.f, 500.f, 0.f, 0.f, 99, 1 , 1);
+   // Molecule, from the cache, from its binary file, or from the PDB file
+   MoleculeKey key = { moleculeName, structureType, scheme, gDefaultAtomSize, gDefaultStickSize };
+   std::shared_ptr<const CachedMolecule> molecule = gMoleculeCache.find(key);
+   if( !molecule )
+   {
+      molecule = loadMoleculeFile( moleculeFileName( fileName, key ), key, fileName );
+      if( molecule ) gMoleculeCache.insert( key, molecule );
+   }
+   if( molecule )
+   {
+      uploadMolecule( kernel, *molecule );
+      size = molecule->size;
+   }
+   else if( !readMolecule( kernel, key, fileName, size ) )
+   {
+      return false;
+   }
 
-   // PDB
-   PDBReader prbReader;
-   float4 size = prbReader.loadAtomsFromFile(
-      fileName, *gpuKernel, 10, gNbMaxBoxes,
-      static_cast<GeometryType>(structureType), 
-      gDefaultAtomSize, gDefaultStickSize, scheme );
-   gNbBoxes = gpuKernel->getNbActiveBoxes();
+   // Lamp
+   int lamp = kernel.addPrimitive( ptSphere );
+   kernel.setPrimitive( lamp, 0, 20000.f, 14000.f, -50000.f, 500.f, 0.f, 0.f, 99, 1 , 1);
+   nbBoxes = kernel.getNbActiveBoxes();
 
    float roomSize = fabs(size.x);
    roomSize = (fabs(size.y)>roomSize) ? fabs(size.y) : roomSize;
@@ -281,89 +347,130 @@ float4 createScene( const std::string& fileName, const int structureType, const
    if( postProcessingInfo.type.x != ppe_ambientOcclusion )
    {
       // Ground
-      gNbPrimitives = gpuKernel->addPrimitive( ptXYPlane );  gpuKernel->setPrimitive( 
-         gNbPrimitives, gNbBoxes+1,      
+      int ground = kernel.addPrimitive( ptXYPlane );  kernel.setPrimitive( 
+         ground, nbBoxes+1,      
          0.f, 0.f, roomSize*0.6f, 
          gSceneInfo.viewDistance.x, gSceneInfo.viewDistance.x, 0.f, 
          83, 1, 1); 
    }
 #endif // 0
 
-   gNbBoxes = gpuKernel->compactBoxes();
-   return size;
+   nbBoxes = kernel.compactBoxes();
+   return true;
 }
 
+// ----------------------------------------------------------------------
+// Reads the catalog, one PDB ID per line, # starts a comment. Without the
+// file, the server falls back to the molecules it always offered
+// ----------------------------------------------------------------------
 void initializeMolecules()
 {
-   // Proteins vector
-	gProteinNames.push_back("3VM9");
-   gProteinNames.push_back("1BNA");
-   gProteinNames.push_back("3SUI");
-   gProteinNames.push_back("1ACY");
-   gProteinNames.push_back("3VHS");
-	gProteinNames.push_back("4FMC");
-	gProteinNames.push_back("3TGW");
-	gProteinNames.push_back("4FI3");
-	gProteinNames.push_back("3VJM");
-	gProteinNames.push_back("4FME");
-	gProteinNames.push_back("3U7D");
-   gProteinNames.push_back("3U2Z");
-	gProteinNames.push_back("3UA5");
-	gProteinNames.push_back("3VKL");
-	gProteinNames.push_back("3VKM");
-}
-
-static char encoding_table[] = {'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H',
-                                'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',
-                                'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X',
-                                'Y', 'Z', 'a', 'b', 'c', 'd', 'e', 'f',
-                                'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n',
-                                'o', 'p', 'q', 'r', 's', 't', 'u', 'v',
-                                'w', 'x', 'y', 'z', '0', '1', '2', '3',
-                                '4', '5', '6', '7', '8', '9', '+', '/'};
-static char *decoding_table = nullptr;
-static int mod_table[] = {0, 2, 1};
-
-char *base64_encode(const unsigned char *data,
-                    size_t input_length,
-                    size_t *output_length) 
-{
-    *output_length = (size_t) (4.0 * ceil((double) input_length / 3.0));
-
-    char *encoded_data = (char*)malloc(*output_length+1);
-    if (encoded_data == NULL) return NULL;
-
-    for (int i = 0, j = 0; i < input_length;) {
-
-        uint32_t octet_a = i < input_length ? data[i++] : 0;
-        uint32_t octet_b = i < input_length ? data[i++] : 0;
-        uint32_t octet_c = i < input_length ? data[i++] : 0;
-
-        uint32_t triple = (octet_a << 0x10) + (octet_b << 0x08) + octet_c;
-
-        encoded_data[j++] = encoding_table[(triple >> 3 * 6) & 0x3F];
-        encoded_data[j++] = encoding_table[(triple >> 2 * 6) & 0x3F];
-        encoded_data[j++] = encoding_table[(triple >> 1 * 6) & 0x3F];
-        encoded_data[j++] = encoding_table[(triple >> 0 * 6) & 0x3F];
-    }
-
-    for (int i = 0; i < mod_table[input_length % 3]; i++)
-    {
-        encoded_data[*output_length - 1 - i] = '=';
-    }
-
-    encoded_data[*output_length] = 0;
-    return encoded_data;
-}
-
-char* convertToBMP( char* buffer )
+   std::ifstream catalog( gCatalogFile.c_str() );
+   std::string line;
+   while( std::getline( catalog, line ) )
+   {
+      const size_t comment = line.find('#');
+      std::istringstream ids( line.substr(0, comment) );
+      std::string id;
+      while( ids >> id )
+      {
+         id = canonicalMoleculeId( id );
+         if( std::find( gProteinNames.begin(), gProteinNames.end(), id ) == gProteinNames.end() ) gProteinNames.push_back( id );
+      }
+   }
+   if( !gProteinNames.empty() ) return;
+
+   std::cout << "Catalog " << gCatalogFile << " not found or empty, using the built-in molecules" << std::endl;
+   const char* builtIn[] = { "3VM9", "1BNA", "3SUI", "1ACY", "3VHS", "4FMC", "3TGW", "4FI3", "3VJM", "4FME", "3U7D", "3U2Z", "3UA5", "3VKL", "3VKM" };
+   gProteinNames.assign( builtIn, builtIn+sizeof(builtIn)/sizeof(builtIn[0]) );
+}
+
+// Streams base64 text straight into the response
+static void writeToRequest( void* context, const char* data, const size_t size )
+{
+   static_cast<Lacewing::Webserver::Request*>(context)->Write( data, static_cast<int>(size) );
+}
+
+// ----------------------------------------------------------------------
+// Response body: raw JPEG, or a base64 data URI
+// ----------------------------------------------------------------------
+void writeImage( Lacewing::Webserver::Request& request, const CachedImage& image, const bool binaryResponse )
+{
+   if( binaryResponse )
+   {
+      // Raw bytes. Lacewing buffers the body and sets Content-Length from it
+      request.SetMimeType("image/jpeg");
+      request.Write( (const char*)image.jpeg.data(), static_cast<int>(image.jpeg.size()) );
+   }
+   else
+   {
+      request << "data:image/jpg;base64,";
+      base64EncodeStream( image.jpeg.data(), image.jpeg.size(), writeToRequest, &request );
+   }
+}
+
+// How the render went, see CachedImage
+void addRenderHeaders( Lacewing::Webserver::Request& request, const CachedImage& image )
+{
+   request.AddHeader("Access-Control-Expose-Headers", "X-Iteration, X-Iterations, X-Render-Iterations, X-Render-Noise");
+   if( image.iterations > 0 )
+   {
+      std::ostringstream iterations;
+      iterations << image.iterations;
+      request.AddHeader("X-Render-Iterations", iterations.str().c_str());
+   }
+   if( image.noise >= 0.f )
+   {
+      std::ostringstream noise;
+      noise << std::setprecision(3) << image.noise;
+      request.AddHeader("X-Render-Noise", noise.str().c_str());
+   }
+}
+
+// ----------------------------------------------------------------------
+// Writes the picture, or a 304 when the client already has this version
+// ----------------------------------------------------------------------
+void sendImage( Lacewing::Webserver::Request& request, const CachedImage& image, const bool binaryResponse )
+{
+   request.AddHeader("Access-Control-Allow-Origin", "*"); // Needed by Chrome!!
+
+   // The raw and base64 bodies are different representations, each gets its own tag
+   const std::string etag = binaryResponse ? image.etag : image.etag.substr(0, image.etag.length()-1) + "-b64\"";
+   request.AddHeader("ETag", etag.c_str());
+   request.AddHeader("Cache-Control", "public, max-age=86400");
+   addRenderHeaders( request, image );
+   const char* ifNoneMatch = request.Header("If-None-Match");
+   if( ifNoneMatch != nullptr && (strstr(ifNoneMatch, etag.c_str()) != nullptr || strcmp(ifNoneMatch, "*") == 0) )
+   {
+      request.Status(304, "Not Modified");
+      return;
+   }
+   writeImage( request, image, binaryResponse );
+}
+
+// ----------------------------------------------------------------------
+// Writes a picture as it converges, iteration out of iterations. The
+// client polls /preview with after=iteration until both are equal
+// ----------------------------------------------------------------------
+void sendPreview( Lacewing::Webserver::Request& request, const CachedImage& image, const bool binaryResponse, const int iteration, const int iterations )
+{
+   std::ostringstream iterationStr, iterationsStr;
+   iterationStr << iteration;
+   iterationsStr << iterations;
+   request.AddHeader("Access-Control-Allow-Origin", "*"); // Needed by Chrome!!
+   request.AddHeader("Cache-Control", "no-store");
+   request.AddHeader("X-Iteration", iterationStr.str().c_str());
+   request.AddHeader("X-Iterations", iterationsStr.str().c_str());
+   addRenderHeaders( request, image );
+   writeImage( request, image, binaryResponse );
+}
+
+char* convertToBMP( char* buffer, const int w, const int h )
 {
 	unsigned char bmpfileheader[14] = {'B','M', 0,0,0,0, 0,0, 0,0, 54,0,  0,0};
 	unsigned char bmpinfoheader[40] = {40,0,0,0, 0,0,0,0, 0,0,0,0,  1,0, 24,0};
 	unsigned char bmppad[3] = {0,0,0};
 
-   int w = gWindowWidth;
-	int h = gWindowHeight;
 	int filesize = 54 + gWindowDepth*w*h;
 
 	bmpfileheader[ 2] = (unsigned char)(filesize    );
@@ -388,29 +495,473 @@ char* convertToBMP( char* buffer )
    return result;
 }
 
-// 
-void onGet(Lacewing::Webserver &Webserver, Lacewing::Webserver::Request &request)
+// ----------------------------------------------------------------------
+// A preview on its way from a worker to the event loop
+// ----------------------------------------------------------------------
+struct RenderPreview
+{
+   RenderJob*                         job;
+   std::shared_ptr<const CachedImage> image;
+   int                                iteration;
+};
+
+// Answers the clients waiting for a preview. Runs on the event loop
+void completePreview( RenderPreview* preview )
+{
+   RenderJob* job = preview->job;
+   job->preview = preview->image;
+   job->previewIteration = preview->iteration;
+   for( size_t i(0); i<job->previewRequests.size(); ++i )
+   {
+      if( job->previewRequests[i].request == nullptr ) continue;
+      Lacewing::Webserver::Request& request = *job->previewRequests[i].request;
+      request.Tag = nullptr;
+      sendPreview( request, *job->preview, job->previewRequests[i].binaryResponse, job->previewIteration, job->renderRequest.quality );
+      request.Finish();
+   }
+   job->previewRequests.clear();
+   delete preview;
+}
+
+// Encodes the image as it is after iteration iterations, quickly rather than well
+void publishPreview( RenderJob& job, const char* image, const int width, const int height, const int iteration )
+{
+   unsigned char* buffer = nullptr;
+   int bufferLength = 0;
+   jo_jpg_options jpegOptions = {};
+   jpegOptions.quality = 75;
+   jpegOptions.threads = gJpegThreads;
+   jpegOptions.subsampling = JO_SUBSAMPLING_420;
+   if( !jo_write_jpg_to_mem_ex(&buffer,&bufferLength,image,width,height,3,&jpegOptions) )
+   {
+      // No preview this time, the clients wait for the next one
+      free(buffer);
+      return;
+   }
+
+   RenderPreview* preview = new RenderPreview;
+   preview->job       = &job;
+   preview->image     = makeCachedImage( buffer, bufferLength, iteration );
+   preview->iteration = iteration;
+   free(buffer);
+   gRenderWorkers.post( (void*)completePreview, preview );
+}
+
+// ----------------------------------------------------------------------
+// RMS difference, in 8 bit levels, between the image and the samples of
+// the previous iteration, which are then replaced. Negative the first
+// time. One pixel in NOISE_SAMPLING is enough to see the noise go down
+// ----------------------------------------------------------------------
+static const size_t NOISE_SAMPLING = 4;
+
+float measureNoise( const char* image, const size_t pixels, std::vector<unsigned char>& previous )
+{
+   const unsigned char* current = reinterpret_cast<const unsigned char*>(image);
+   const size_t samples = pixels/NOISE_SAMPLING;
+   if( previous.size() != samples*3 )
+   {
+      previous.resize( samples*3 );
+      for( size_t i(0); i<samples; ++i ) memcpy( &previous[i*3], current+i*NOISE_SAMPLING*3, 3 );
+      return -1.f;
+   }
+
+   double sum(0.0);
+   for( size_t i(0); i<samples; ++i )
+   {
+      for( int c(0); c<3; ++c )
+      {
+         const double difference = static_cast<double>(current[i*NOISE_SAMPLING*3+c])-previous[i*3+c];
+         sum += difference*difference;
+         previous[i*3+c] = current[i*NOISE_SAMPLING*3+c];
+      }
+   }
+   return (samples == 0) ? 0.f : static_cast<float>(sqrt(sum/(samples*3)));
+}
+
+// ----------------------------------------------------------------------
+// Path traces the current scene into image and returns the iterations
+// done, 0 when the job was cancelled. For a single view, as opposed to
+// a turntable frame:
+// - with previews, the image is published after iterations 1, 2, 4, 8...
+//   so that the client sees it converge
+// - with a deadline or noise target, the loop stops as soon as one is
+//   reached, and noise gets the change the last iteration made
+// ----------------------------------------------------------------------
+int renderFrame( GPUKERNEL& kernel, SceneInfo& sceneInfo, const PostProcessingInfo& postProcessingInfo, 
+                 const float4& cameraOrigin, const float4& cameraTarget, const float4& cameraAngles, char* image, 
+                 RenderJob& job, const bool singleView, float& noise )
 {
+   const RenderRequest& renderRequest = job.renderRequest;
+   const bool adaptive = singleView && renderRequest.adaptive();
+   std::vector<unsigned char> previous;
+   noise = -1.f;
+
+   int iteration(0);
+   while( iteration<sceneInfo.maxPathTracingIterations.x )
+   {
+      if( job.cancelled ) return 0;
+      const std::chrono::steady_clock::time_point iterationStart = std::chrono::steady_clock::now();
+      sceneInfo.pathTracingIteration.x = iteration;
+      kernel.setPostProcessingInfo( postProcessingInfo );
+      kernel.setSceneInfo( sceneInfo );
+      kernel.setCamera( cameraOrigin, cameraTarget, cameraAngles );
+      kernel.render_begin(0.f);
+      kernel.render_end(image);
+      ++iteration;
+
+      if( singleView && job.previews && iteration<sceneInfo.maxPathTracingIterations.x && (iteration & (iteration-1)) == 0 )
+      {
+         publishPreview( job, image, sceneInfo.width.x, sceneInfo.height.x, iteration );
+      }
+
+      if( adaptive )
+      {
+         // Converged?
+         noise = measureNoise( image, static_cast<size_t>(sceneInfo.width.x)*sceneInfo.height.x, previous );
+         if( renderRequest.noiseTarget > 0.f && noise >= 0.f && noise <= renderRequest.noiseTarget ) break;
+
+         // Would one more iteration, as long as the last one, miss the deadline?
+         if( renderRequest.deadline > 0 )
+         {
+            const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            const double elapsed = std::chrono::duration<double, std::milli>(now-job.startedAt).count();
+            const double iterationTime = std::chrono::duration<double, std::milli>(now-iterationStart).count();
+            if( elapsed+iterationTime > renderRequest.deadline ) break;
+         }
+      }
+   }
+   return iteration;
+}
+
+// ----------------------------------------------------------------------
+// Renders and encodes the picture of a job. Runs on a render worker: it
+// only touches the job, its render context and the thread safe caches
+// ----------------------------------------------------------------------
+void renderJob( RenderJob& job )
+{
+   if( job.cancelled ) return;
+
+   // onGet only looked in memory, the disk tier is read here, off the event loop
+   job.image = gResponseCache.findOnDisk( job.cacheKey );
+   if( job.image ) return;
+
+   const RenderRequest& renderRequest = job.renderRequest;
    float4 cameraOrigin = gViewPos;
    float4 cameraTarget = gViewDir;
    float4 cameraAngles = gViewAngles;
 
-   float4 moleculeRotationAngles = {static_cast<float>(rand()%360),static_cast<float>(rand()%360),0.f,0.f};
-
-   int structureType = rand()%5;
-   int imageSize = 0;
-   std::string moleculeId(gProteinNames[gCurrentProtein]);
-   int scheme=rand()%3;
    SceneInfo sceneInfo(gSceneInfo);
+   sceneInfo.width.x  = renderRequest.width;
+   sceneInfo.height.x = renderRequest.height;
+   sceneInfo.maxPathTracingIterations.x = renderRequest.quality;
+   sceneInfo.backgroundColor = renderRequest.backgroundColor;
    PostProcessingInfo postProcessingInfo(gPostProcessingInfo);
-   //postProcessingInfo.type.x = (rand()%3==0) ? 2 : 0;
+   postProcessingInfo.type.x = renderRequest.postProcessing;
+   float4 moleculeRotationAngles = renderRequest.rotation;
+   moleculeRotationAngles.x = moleculeRotationAngles.x/180.f*static_cast<float>(M_PI);
+   moleculeRotationAngles.y = moleculeRotationAngles.y/180.f*static_cast<float>(M_PI);
+   moleculeRotationAngles.z = moleculeRotationAngles.z/180.f*static_cast<float>(M_PI);
+   const std::string& moleculeId = renderRequest.molecule;
+
+   // --------------------------------------------------------------------------------
+   // PDB File management. The file is there: a job whose file had to be downloaded
+   // was only submitted once the download was over, see releaseParkedJobs
+   // --------------------------------------------------------------------------------
+   const std::string fileName( gPdbFetcher.fileName( moleculeId ) );
+   const std::string moleculeName( moleculeId + ".pdb" );
+
+   // --------------------------------------------------------------------------------
+   // Create 3D Scene
+   // --------------------------------------------------------------------------------
+   // Contexts are sized for gMaxImageSize, larger requests are clamped
+   sceneInfo.width.x  = (sceneInfo.width.x  > static_cast<int>(gRenderContexts.maxWidth()))  ? gRenderContexts.maxWidth()  : sceneInfo.width.x;
+   sceneInfo.height.x = (sceneInfo.height.x > static_cast<int>(gRenderContexts.maxHeight())) ? gRenderContexts.maxHeight() : sceneInfo.height.x;
+   RenderContextLease context( gRenderContexts );
+   int nbBoxes(0);
+   GPUKERNEL& kernel = *context->kernel;
+   char* image = &context->image[0];
+   {
+      memset( image, 0, sceneInfo.width.x*sceneInfo.height.x*gWindowDepth );
+      sceneInfo.pathTracingIteration.x = 0;
+      kernel.setSceneInfo( sceneInfo );
+
+      // Bkground Color
+      kernel.setMaterial( 83, sceneInfo.backgroundColor.x, sceneInfo.backgroundColor.y, sceneInfo.backgroundColor.z, 0.f,
+         0.f, 0.f, false, false, 0, 0.f, NO_TEXTURE, 0.5f, 100.f, 0.f, 0.f );
+
+
+      float4 size;
+      if( !createScene( kernel, moleculeName, fileName, renderRequest.structureType, renderRequest.scheme, postProcessingInfo, size, nbBoxes ) )
+      {
+         job.error = "The molecule has no atoms";
+         return;
+      }
+      job.primitives = kernel.getNbActivePrimitives();
+      cameraTarget.z = -size.z*250.f;
+      cameraOrigin.z = cameraTarget.z-4000.f;
+
+      // Post processing effects
+      postProcessingInfo.param1.x = -cameraTarget.z;
+      postProcessingInfo.param2.x = (postProcessingInfo.type.x==0) ? 
+         sceneInfo.maxPathTracingIterations.x*10.f : 5000.f;
+      postProcessingInfo.param3.x = (postProcessingInfo.type.x != 2 ) ? 40+sceneInfo.maxPathTracingIterations.x*5 : 16;
+
+      // Shadows
+      sceneInfo.shadowsEnabled.x = (postProcessingInfo.type.x != 2);
+
+      // Background color
+      sceneInfo.backgroundColor = (postProcessingInfo.type.x == 2 ) ? gBkBlack : sceneInfo.backgroundColor;
+
+      // Rendering process, timed for the cost model
+      const std::chrono::steady_clock::time_point renderStart = std::chrono::steady_clock::now();
+      char* picture = image;
+      int iterations = sceneInfo.maxPathTracingIterations.x;
+      float noise = -1.f;
+      int pictureWidth  = sceneInfo.width.x;
+      int pictureHeight = sceneInfo.height.x;
+      std::vector<char> spriteSheet;
+      if( renderRequest.views.empty() )
+      {
+         kernel.rotatePrimitives( gRotationCenter, moleculeRotationAngles, 10, nbBoxes );
+         iterations = renderFrame( kernel, sceneInfo, postProcessingInfo, cameraOrigin, cameraTarget, cameraAngles, image, job, true, noise );
+         if( iterations == 0 ) return;
+      }
+      else
+      {
+         // Turntable: the scene is built once, every view only puts the molecule
+         // back where the reader left it and rotates it
+         const int nbViews = static_cast<int>(renderRequest.views.size());
+         const int columns = static_cast<int>(ceil(sqrt(static_cast<double>(nbViews))));
+         const int rows    = (nbViews+columns-1)/columns;
+         const int frameRowBytes = sceneInfo.width.x*3;
+         pictureWidth  = columns*sceneInfo.width.x;
+         pictureHeight = rows*sceneInfo.height.x;
+         spriteSheet.resize( static_cast<size_t>(pictureWidth)*pictureHeight*3 );
+         picture = &spriteSheet[0];
+
+         std::vector<float4> p0(job.primitives), p1(job.primitives);
+         for( int i(0); i<job.primitives; ++i )
+         {
+            p0[i] = kernel.getPrimitive(i)->p0;
+            p1[i] = kernel.getPrimitive(i)->p1;
+         }
+         for( int view(0); view<nbViews; ++view )
+         {
+            for( int i(0); i<job.primitives; ++i )
+            {
+               kernel.getPrimitive(i)->p0 = p0[i];
+               kernel.getPrimitive(i)->p1 = p1[i];
+            }
+            float4 angles = renderRequest.views[view];
+            angles.x = angles.x/180.f*static_cast<float>(M_PI);
+            angles.y = angles.y/180.f*static_cast<float>(M_PI);
+            angles.z = angles.z/180.f*static_cast<float>(M_PI);
+            kernel.rotatePrimitives( gRotationCenter, angles, 10, nbBoxes );
+            if( renderFrame( kernel, sceneInfo, postProcessingInfo, cameraOrigin, cameraTarget, cameraAngles, image, job, false, noise ) == 0 ) return;
+
+            const int left = (view%columns)*sceneInfo.width.x;
+            const int top  = (view/columns)*sceneInfo.height.x;
+            for( int y(0); y<sceneInfo.height.x; ++y )
+            {
+               memcpy( picture+(static_cast<size_t>(top+y)*pictureWidth+left)*3, image+static_cast<size_t>(y)*frameRowBytes, frameRowBytes );
+            }
+         }
+      }
+
+      job.renderTime = std::chrono::duration<double>(std::chrono::steady_clock::now()-renderStart).count();
+
+      // Encode straight into memory, the image never touches the disk
+      unsigned char* buffer = nullptr;
+      int bufferLength = 0;
+      jo_jpg_options jpegOptions = {};
+      jpegOptions.quality = 100;
+      jpegOptions.threads = gJpegThreads;
+      jpegOptions.subsampling = renderRequest.jpegSubsampling;
+      jpegOptions.optimizeHuffman = renderRequest.jpegOptimize;
+      jpegOptions.progressive = renderRequest.jpegProgressive;
+      if( !jo_write_jpg_to_mem_ex(&buffer,&bufferLength,picture,pictureWidth,pictureHeight,3,&jpegOptions) || bufferLength == 0 )
+      {
+         free(buffer);
+         job.error = "The picture could not be encoded, please try again";
+         return;
+      }
+
+      job.image = makeCachedImage( buffer, bufferLength, iterations, noise );
+      free(buffer);
+      gResponseCache.insert( job.cacheKey, job.image );
+   }
+}
+
+// ----------------------------------------------------------------------
+// Writes the response of a rendered job. Runs on the event loop
+// ----------------------------------------------------------------------
+void completeJob( RenderJob* job )
+{
+   // A cancelled job may have been replaced by a new one for the same picture
+   std::map<std::string, RenderJob*>::iterator pending = gPendingJobs.find( job->cacheKey );
+   if( pending != gPendingJobs.end() && pending->second == job ) gPendingJobs.erase( pending );
+
+   for( size_t i(0); i<job->previewRequests.size(); ++i )
+   {
+      if( job->previewRequests[i].request == nullptr ) continue;
+      Lacewing::Webserver::Request& request = *job->previewRequests[i].request;
+      request.Tag = nullptr;
+      if( job->image )
+      {
+         sendPreview( request, *job->image, job->previewRequests[i].binaryResponse, job->renderRequest.quality, job->renderRequest.quality );
+      }
+      else
+      {
+         request << job->error.c_str();
+      }
+      request.Finish();
+   }
+   for( size_t i(0); i<job->requests.size(); ++i )
+   {
+      if( job->requests[i].request == nullptr ) continue;
+      Lacewing::Webserver::Request& request = *job->requests[i].request;
+      request.Tag = nullptr;
+      if( job->image )
+      {
+         sendImage( request, *job->image, job->requests[i].binaryResponse );
+      }
+      else
+      {
+         request << job->error.c_str();
+      }
+      request.Finish();
+   }
+   delete job;
+}
+
+// ----------------------------------------------------------------------
+// Over budget: the request is shed now rather than let the queue grow
+// ----------------------------------------------------------------------
+void sendBusy( Lacewing::Webserver::Request& request )
+{
+   std::ostringstream retryAfter;
+   retryAfter << gRenderWorkers.retryAfter();
+   request.Status(503, "Service Unavailable");
+   request.AddHeader("Retry-After", retryAfter.str().c_str());
+   request.AddHeader("Access-Control-Allow-Origin", "*");
+   request << "Server busy, please try again later";
+}
+
+// Answers the requests of a job the workers refused
+void rejectJob( RenderJob* job )
+{
+   std::map<std::string, RenderJob*>::iterator pending = gPendingJobs.find( job->cacheKey );
+   if( pending != gPendingJobs.end() && pending->second == job ) gPendingJobs.erase( pending );
+
+   for( size_t i(0); i<job->previewRequests.size(); ++i )
+   {
+      if( job->previewRequests[i].request == nullptr ) continue;
+      job->previewRequests[i].request->Tag = nullptr;
+      sendBusy( *job->previewRequests[i].request );
+      job->previewRequests[i].request->Finish();
+   }
+   for( size_t i(0); i<job->requests.size(); ++i )
+   {
+      if( job->requests[i].request == nullptr ) continue;
+      job->requests[i].request->Tag = nullptr;
+      sendBusy( *job->requests[i].request );
+      job->requests[i].request->Finish();
+   }
+   delete job;
+}
+
+// The text sent back when the PDB file of a request cannot be had, nullptr if it is there
+const char* pdbFetchError( const PdbFetchResult result )
+{
+   switch( result )
+   {
+   case pfNotFound: return "Unknown molecule";
+   case pfFailed:   return "The molecule could not be downloaded, please try again";
+   default:         return nullptr;
+   }
+}
+
+// ----------------------------------------------------------------------
+// A download is over: the jobs parked for it are submitted, or answered
+// with the error. Posted to the event loop by onPdbFetched
+// ----------------------------------------------------------------------
+struct PdbFetched
+{
+   std::string    fileName;
+   PdbFetchResult result;
+};
+
+void releaseParkedJobs( PdbFetched* fetched )
+{
+   std::vector<RenderJob*> jobs;
+   std::pair<std::multimap<std::string, RenderJob*>::iterator, std::multimap<std::string, RenderJob*>::iterator> parked = gParkedJobs.equal_range( fetched->fileName );
+   for( std::multimap<std::string, RenderJob*>::iterator it = parked.first; it != parked.second; ++it ) jobs.push_back( it->second );
+   gParkedJobs.erase( parked.first, parked.second );
+
+   const char* error = pdbFetchError( fetched->result );
+   for( size_t i(0); i<jobs.size(); ++i )
+   {
+      RenderJob* job = jobs[i];
+      if( job->cancelled )
+      {
+         completeJob( job );
+      }
+      else if( error != nullptr )
+      {
+         job->error = error;
+         completeJob( job );
+      }
+      else if( !gRenderWorkers.submit( job ) )
+      {
+         rejectJob( job );
+      }
+   }
+   delete fetched;
+}
+
+// Called on a download thread
+void onPdbFetched( void* context, const std::string& molecule, const PdbFetchResult result )
+{
+   PdbFetched* fetched = new PdbFetched;
+   fetched->fileName = gPdbFetcher.fileName( molecule );
+   fetched->result = result;
+   gRenderWorkers.post( (void*)releaseParkedJobs, fetched );
+}
+
+// The client does not wait for the picture anymore. When it was the last
+// one, the job is cancelled and the rest of the render skipped
+void onDisconnect(Lacewing::Webserver &Webserver, Lacewing::Webserver::Request &request)
+{
+   RenderJob* job = static_cast<RenderJob*>(request.Tag);
+   if( job == nullptr ) return;
+   bool waited(false);
+   for( size_t i(0); i<job->requests.size(); ++i )
+   {
+      if( job->requests[i].request == &request ) job->requests[i].request = nullptr;
+      waited = waited || ( job->requests[i].request != nullptr );
+   }
+   for( size_t i(0); i<job->previewRequests.size(); ++i )
+   {
+      if( job->previewRequests[i].request == &request ) job->previewRequests[i].request = nullptr;
+      waited = waited || ( job->previewRequests[i].request != nullptr );
+   }
+   if( !waited ) job->cancelled = true;
+}
+
+// 
+void onGet(Lacewing::Webserver &Webserver, Lacewing::Webserver::Request &request)
+{
+   RenderRequest renderRequest( gSceneInfo );
 
    // --------------------------------------------------------------------------------
    // Default values
    // --------------------------------------------------------------------------------
    
-   if (!strcmp(request.URL(), "get"))
+   const bool turntable = ( strcmp(request.URL(), "turntable") == 0 );
+   const bool preview   = ( strcmp(request.URL(), "preview") == 0 );
+   if (!strcmp(request.URL(), "get") || turntable || preview)
    {
+      int previewAfter(0);
       std::string requestStr;
       try
       {
@@ -424,83 +975,14 @@ void onGet(Lacewing::Webserver &Webserver, Lacewing::Webserver::Request &request
             requestStr += p->Name();
             requestStr += "=";
             requestStr += p->Value();
-            if( strcmp(p->Name(),"molecule")==0 )
-            {
-               // --------------------------------------------------------------------------------
-               // Molecule
-               // --------------------------------------------------------------------------------
-               moleculeId = p->Value();
-            }
-            else if ( strcmp(p->Name(),"rotation") == 0 )
-            {
-               // --------------------------------------------------------------------------------
-               // rotation angles
-               // --------------------------------------------------------------------------------
-               moleculeRotationAngles = readFloat4(p->Value());
-               moleculeRotationAngles.x = moleculeRotationAngles.x/180.f*static_cast<float>(M_PI);
-               moleculeRotationAngles.y = moleculeRotationAngles.y/180.f*static_cast<float>(M_PI);
-               moleculeRotationAngles.z = moleculeRotationAngles.z/180.f*static_cast<float>(M_PI);
-            }
-            else if ( strcmp(p->Name(),"bkcolor") == 0 )
+            if( strcmp(p->Name(),"after")==0 )
             {
-               // --------------------------------------------------------------------------------
-               // Backgroud color
-               // --------------------------------------------------------------------------------
-               sceneInfo.backgroundColor = readFloat4(p->Value());
-               sceneInfo.backgroundColor.x /= 255.f;
-               sceneInfo.backgroundColor.y /= 255.f;
-               sceneInfo.backgroundColor.z /= 255.f;
-               saturateFloat4(sceneInfo.backgroundColor,0.f,255.f);
+               // Iterations in the preview the client already has
+               previewAfter = atoi(p->Value());
             }
-            else if ( strcmp(p->Name(),"structure") == 0 )
-            {
-               // --------------------------------------------------------------------------------
-               // structure
-               // --------------------------------------------------------------------------------
-               structureType = atoi(p->Value());
-               if( structureType<0 || structureType>4 ) structureType = 0;
-            }
-            else if ( strcmp(p->Name(),"scheme") == 0 )
-            {
-               // --------------------------------------------------------------------------------
-               // scheme
-               // --------------------------------------------------------------------------------
-               scheme = atoi(p->Value());
-               if( scheme<0 || scheme>2 ) scheme = 0;
-            }
-            else if ( strcmp(p->Name(),"quality") == 0 )
-            {
-               // --------------------------------------------------------------------------------
-               // Quality
-               // --------------------------------------------------------------------------------
-               sceneInfo.maxPathTracingIterations.x = atoi(p->Value());
-               sceneInfo.maxPathTracingIterations.x = (sceneInfo.maxPathTracingIterations.x>20) ? 20 : sceneInfo.maxPathTracingIterations.x;
-            }
-            else if ( strcmp(p->Name(),"size") == 0 )
-            {
-               // --------------------------------------------------------------------------------
-               // Image Size
-               // --------------------------------------------------------------------------------
-               imageSize = atoi(p->Value());
-               switch( imageSize ) 
-               {
-               default: gWindowWidth=768;  gWindowHeight=768;
-               case  1: gWindowWidth=1024; gWindowHeight=1024; break;
-               case  2: gWindowWidth=1600; gWindowHeight=1600; break;
-               case  3: gWindowWidth=1920; gWindowHeight=1920; break;
-               case  4: gWindowWidth=2048; gWindowHeight=2048; break;
-               }
-               sceneInfo.width.x  = gWindowWidth;
-               sceneInfo.height.x = gWindowHeight;
-            }
-            else if ( strcmp(p->Name(),"postprocessing") == 0 )
+            else
             {
-               // --------------------------------------------------------------------------------
-               // structure
-               // --------------------------------------------------------------------------------
-               int postProcessing = atoi(p->Value());
-               if( postProcessing<0 || postProcessing>2 ) postProcessing = 0;
-               postProcessingInfo.type.x = postProcessing;
+               renderRequest.set( p->Name(), p->Value() );
             }
 
             p = p->Next();
@@ -509,207 +991,685 @@ void onGet(Lacewing::Webserver &Webserver, Lacewing::Webserver::Request &request
          std::cout << requestStr << std::endl;
 
          // --------------------------------------------------------------------------------
-         // PDB File management
+         // Missing parameters get their defaults, the request now names exactly one picture
          // --------------------------------------------------------------------------------
-         std::string fileName("../Pdb/");
-         std::string moleculeName;
-         moleculeName += ( moleculeId.length() == 0 ) ? gProteinNames[gCurrentProtein] : moleculeId;
-         moleculeName += ".pdb";
-
-         fileName += moleculeName;
-
-         // Check file existence
-         std::ifstream file( fileName.c_str() );
-         if( file.is_open() )
+         renderRequest.resolve( gProteinNames );
+         if( turntable ) renderRequest.makeTurntable();
+         const std::string cacheKey = renderRequest.canonicalKey();
+         // Memory only: a picture cached on disk is read by a worker, as if it was rendered
+         std::shared_ptr<const CachedImage> cached = gResponseCache.findInMemory( cacheKey );
+
+         std::map<std::string, RenderJob*>::iterator pending = gPendingJobs.find( cacheKey );
+         RenderJob* job = ( pending != gPendingJobs.end() && !pending->second->cancelled ) ? pending->second : nullptr;
+         if( cached && preview )
+         {
+            sendPreview( request, *cached, renderRequest.binaryResponse, renderRequest.quality, renderRequest.quality );
+         }
+         else if( cached )
          {
-            file.close();
+            sendImage( request, *cached, renderRequest.binaryResponse );
+         }
+         else if( preview && job != nullptr && job->previewIteration > previewAfter )
+         {
+            // A preview newer than the client's is already there
+            sendPreview( request, *job->preview, renderRequest.binaryResponse, job->previewIteration, renderRequest.quality );
          }
          else
          {
-            // If file is not in the cache, download it
-
-            std::string url("http://www.rcsb.org/pdb/files/");
-            url += moleculeName;
-            HINTERNET IntOpen = ::InternetOpen("Sample", LOCAL_INTERNET_ACCESS, NULL, 0, 0);
-            HINTERNET handle = ::InternetOpenUrl(IntOpen, url.c_str(), NULL, NULL, NULL, NULL);
-
-            if( handle )
+            if( job != nullptr )
+            {
+               // The same picture is already queued or rendering, this request gets it too
+               gCoalescedRequests++;
+            }
+            else
             {
-               std::ofstream myfile(fileName);
-               if (myfile.is_open())
+               // Rendered by a worker, the response is finished from completeJob
+               job = new RenderJob( renderRequest, cacheKey, request.GetAddress().ToString() );
+               std::shared_future<PdbFetchResult> fetched = gPdbFetcher.fetch( renderRequest.molecule );
+               const bool downloading = ( fetched.wait_for( std::chrono::seconds(0) ) != std::future_status::ready );
+               const char* error = downloading ? nullptr : pdbFetchError( fetched.get() );
+               if( error != nullptr )
                {
-                  request << "<p align=center>PDB File was not in the cache and had to be downloaded from <a href=http://www.rcsb.org>Protein Data Bank</a></p>";
-                  char buffer[2];
-                  DWORD dwRead=0;
-                  while(::InternetReadFile(handle, buffer, sizeof(buffer)-1, &dwRead) == TRUE)
-                  {
-                     if ( dwRead == 0) 
-                        break;
-                     myfile << buffer;
-                  }
-                  myfile.close();
+                  delete job;
+                  job = nullptr;
+                  request << error;
+               }
+               else if( downloading )
+               {
+                  // No worker waits for the download, the job is submitted by releaseParkedJobs
+                  gParkedJobs.insert( std::make_pair( gPdbFetcher.fileName( renderRequest.molecule ), job ) );
+                  gPendingJobs[cacheKey] = job;
+               }
+               else if( gRenderWorkers.submit( job ) )
+               {
+                  gPendingJobs[cacheKey] = job;
+               }
+               else
+               {
+                  delete job;
+                  job = nullptr;
+                  sendBusy( request );
                }
             }
-            else
+            if( job != nullptr )
             {
-               // TODO!!!!
-               request << "<p align=center>Unknown molecule</p>";
+               if( preview )
+               {
+                  // Answered by the next preview, or the final picture
+                  job->previews = true;
+                  job->attachPreview( request, renderRequest.binaryResponse );
+               }
+               else
+               {
+                  job->attach( request, renderRequest.binaryResponse );
+               }
+               request.Tag = job;
+               request.DisableAutoFinish();
             }
-            ::InternetCloseHandle(handle);   
          }
+      }
+      catch(...)
+      {
+         request << "An exception occured :-( Please try again";
+      }
+      gRequests[request.GetAddress().ToString()] = requestStr;
+      gNbCalls++;
+   }
+   else if( strcmp(request.URL(), "help") == 0 )
+   {
+      // Parameters of /get, /preview and /turntable
+      request << "<body>";
+      request << "<p align=\"center\"><b>Syntax:</b> /get?molecule=XXXX[&scheme=0|1|2][&structure=0|1|2|3|4][&rotation=float,float,float][&quality=integer][&size=1|2|3|4]</p>";
+      request << "<p align=\"center\">molecule=XXXX PDB ID of the molecule, the first of the list below by default. Molecules:";
+      for( size_t i(0); i<gProteinNames.size(); ++i ) request << " " << gProteinNames[i].c_str();
+      request << "</p>";
+      request << "<p align=\"center\">scheme=[0|1|2] 0: Standard, 1: Chain, 2: Residue</p>";
+      request << "<p align=\"center\">structure=[0|1|2|3|4] 0: Real size atoms, 1: Fixed size atoms, 2: Sticks, 3: Sticks and atoms, 4: Backbone</p>";
+      request << "<p align=\"center\">rotation=[x,y,z] Rotates the molecule by x, y and z degrees</p>";
+      request << "<p align=\"center\">quality=[1-20] Path tracing iterations, " << gTotalPathTracingIterations << " by default. The higher the better, and slower</p>";
+      request << "<p align=\"center\">size=[1|2|3|4] 1024, 1600, 1920 or 2048 pixels square, 768 for any other value and " << gDefaultImageSize << " without it</p>";
+      request << "<p align=\"center\">bkcolor=[r,g,b] Background color, 0 to 255 each (example: bkcolor=255,0,127)</p>";
+      request << "<p align=\"center\">postprocessing=[0|1|2] 0: None, 1: Depth of field, 2: Ambient occlusion</p>";
+      request << "<p align=\"center\">subsampling=[444|422|420] JPEG chroma subsampling, 420 by default</p>";
+      request << "<p align=\"center\">optimize=[0|1] 1: Huffman tables optimized for the image, smaller and slower to encode</p>";
+      request << "<p align=\"center\">progressive=[0|1] 1: Progressive JPEG, a coarse image is displayed first and refined as the rest arrives</p>";
+      request << "<p align=\"center\">format=[base64|jpeg] base64: data URI (default), jpeg: binary image/jpeg</p>";
+      request << "<p align=\"center\">deadline=milliseconds and noise=float stop the rendering once the time is up or an iteration changes the image by less than noise (RMS, 8 bit levels). quality is then the most iterations, 20 by default. X-Render-Iterations and X-Render-Noise tell what was achieved</p>";
+      request << "<p align=\"center\">seed=integer Picks the molecule, rotation, structure and scheme left out of the request. Without it they default to the first molecule, 0,0,0, 0 and 0</p>";
+      request << "<p align=\"center\">/preview takes the same parameters plus after=integer and returns the picture once more than after iterations are done. X-Iteration and X-Iterations tell how far it is, poll again with after=X-Iteration until they are equal</p>";
+      request << "<p align=\"center\">/turntable takes the same parameters plus frames=integer (12 by default), to=[x,y,z] (rotation+0,360,0 by default) or rotations=x,y,z;x,y,z;... and returns all the views in one sprite sheet, ceil(sqrt(frames)) columns wide</p>";
+      request << "<p align=\"center\">/ready answers 200 once the molecules are loaded, 503 before</p>";
+      request << "<p align=\"center\"><b>Example:</b> /get?postprocessing=0&bkcolor=120,120,120&quality=10&rotation=0,0,0&molecule=1BNA</p>";
+      request << "<p align=\"center\">Help: <a href=\"http://cudaopencl.blogspot.com\">http://cudaopencl.blogspot.com</a></p>";
+      request << "<p align=\"center\"><a href=\"http://www.molecular-visualization.com\">http://www.molecular-visualization.com</a></p>";
+      request << "</body>";
+   }
+   else if( strcmp(request.URL(), "ready") == 0 )
+   {
+      // For load balancers: traffic is welcome once the catalog is warm
+      request.AddHeader("Access-Control-Allow-Origin", "*");
+      request.AddHeader("Cache-Control", "no-cache");
+      if( gReady )
+      {
+         request << "ready";
+      }
+      else
+      {
+         request.Status(503, "Service Unavailable");
+         request.AddHeader("Retry-After", "1");
+         request << "warming up, " << gPrewarmedMolecules.load()+gPrewarmFailures.load() << "/" << gProteinNames.size() << " molecules";
+      }
+   }
+   else
+   {
+      request << "<a href=\"help\">Parameters</a><br/>";
+      request << gNbCalls << " calls so far<br/>";
+      request << (gReady ? "Ready" : "Warming up") << ": " << gPrewarmedMolecules.load() << "/" << gProteinNames.size() << " catalog molecules built, " 
+              << gPrewarmedPictures.load() << " default pictures rendered, " << gPrewarmFailures.load() << " molecules failed<br/>";
+      request << gRenderContexts.available() << "/" << gRenderContexts.size() << " render contexts available<br/>";
+      RenderWorkers::Stats workerStats = gRenderWorkers.stats();
+      request << workerStats.busy << "/" << gRenderWorkers.size() << " render workers busy, " << workerStats.queued << " requests queued, " 
+              << workerStats.outstandingCost/1000000 << "/" << workerStats.budget/1000000 << " M pixel iterations outstanding<br/>";
+      request << gPendingJobs.size() << " pictures queued or rendering, " << gParkedJobs.size() << " of them waiting for their PDB file, " << gCoalescedRequests << " requests served by a picture already on its way<br/>";
+      const PdbFetcher::Stats fetches = gPdbFetcher.stats();
+      request << fetches.downloads << " PDB files downloaded (" << fetches.bytes/1024 << " KB), " << fetches.pending << " downloading, " 
+              << fetches.deduplicated << " requests waited on a download already started, " 
+              << fetches.notFound << " unknown molecules, " << fetches.failures << " failed downloads<br/>";
+      request << "Render queue: " << workerStats.admitted << " admitted, " << workerStats.rejected << " rejected, " 
+              << static_cast<int>(workerStats.averageWait*1000.0) << " ms average wait, " << static_cast<int>(workerStats.maxWait*1000.0) << " ms max wait, " 
+              << static_cast<int>(workerStats.outstandingSeconds) << " s of predicted work<br/>";
+      request << "Cost model: " << workerStats.measuredRenders << " renders measured, " 
+              << workerStats.rate*1e9 << " ns per pixel x iteration x log2(primitives)<br/>";
+      MoleculeCache::Stats moleculeStats = gMoleculeCache.stats();
+      ResponseCache::Stats responseStats = gResponseCache.stats();
+      request << "Response cache: " << responseStats.memory.hits << " memory hits, " << responseStats.diskHits << " disk hits, " 
+              << responseStats.memory.misses-responseStats.diskHits << " misses, " << responseStats.memory.evictions << " evictions, " 
+              << responseStats.memory.entries << " pictures, " << responseStats.memory.bytes/1024 << "/" << responseStats.memory.budget/1024 << " KB<br/>";
+      request << "Molecule cache: " << moleculeStats.hits << " hits, " << moleculeStats.misses << " misses, " 
+              << moleculeStats.evictions << " evictions, " << moleculeStats.entries << " molecules, " 
+              << moleculeStats.bytes/1024 << "/" << moleculeStats.budget/1024 << " KB<br/>";
+      std::map<std::string,std::string>::const_iterator iter = gRequests.begin();
+      while( iter != gRequests.end() )
+      {
+         request << (*iter).second.c_str() << "<br/>";
+         ++iter;
+      }
+   }
+}
 
-         // --------------------------------------------------------------------------------
-         // Create 3D Scene
-         // --------------------------------------------------------------------------------
-         size_t len(gWindowWidth*gWindowHeight*gWindowDepth);
-	      char* image = new char[len];
-         if( image != nullptr )
+// ----------------------------------------------------------------------
+// RGB picture for the encoder benchmark and self test: smooth shading
+// with some path tracing grain, always the same
+// ----------------------------------------------------------------------
+void makeTestPicture( const int width, const int height, std::vector<unsigned char>& picture )
+{
+   picture.resize( static_cast<size_t>(width)*height*3 );
+   unsigned int noise(1);
+   for( size_t i(0); i<picture.size(); ++i )
+   {
+      noise = noise*1664525u+1013904223u;
+      const size_t x = (i/3)%width;
+      const size_t y = (i/3)/width;
+      picture[i] = static_cast<unsigned char>( (x*(i%3+1)+y)*255/(4*width) + (noise>>28) );
+   }
+}
+
+// ----------------------------------------------------------------------
+// Checks that pictures entropy coded in parallel bands, separated by
+// restart markers, decode to exactly what the one thread encoder gives.
+// Returns false if any of them does not
+// ----------------------------------------------------------------------
+bool selfTest()
+{
+   const int threads = (gJpegThreads>4) ? gJpegThreads : 4;
+   const int sizes[][2] = { { 768, 768 }, { 1000, 600 }, { 2048, 2048 } };
+   const int subsamplings[] = { JO_SUBSAMPLING_444, JO_SUBSAMPLING_422, JO_SUBSAMPLING_420 };
+   int failures(0);
+   for( size_t s(0); s<sizeof(sizes)/sizeof(sizes[0]); ++s )
+   {
+      const int width  = sizes[s][0];
+      const int height = sizes[s][1];
+      std::vector<unsigned char> picture;
+      makeTestPicture( width, height, picture );
+      for( size_t u(0); u<sizeof(subsamplings)/sizeof(subsamplings[0]); ++u )
+      {
+         for( int optimize(0); optimize<2; ++optimize )
          {
-            long renderingTime = GetTickCount();
-            memset( image, 0, len );
-            gpuKernel = new GPUKERNEL(false, true);
-            gSceneInfo.pathTracingIteration.x = 0;
-            gpuKernel->setSceneInfo( sceneInfo );
-            gpuKernel->initBuffers();
+            for( int restartRows(0); restartRows<2; ++restartRows )
+            {
+               jo_jpg_options jpegOptions = {};
+               jpegOptions.quality = 100;
+               jpegOptions.subsampling = subsamplings[u];
+               jpegOptions.optimizeHuffman = (optimize != 0);
+               jpegOptions.threads = 1;
+               unsigned char* single = nullptr;
+               int singleLength(0);
+               const bool singleEncoded = jo_write_jpg_to_mem_ex(&single,&singleLength,&picture[0],width,height,3,&jpegOptions);
+
+               // Default bands (two per thread), then one MCU row per restart interval
+               jpegOptions.threads = threads;
+               jpegOptions.restartRows = restartRows;
+               unsigned char* banded = nullptr;
+               int bandedLength(0);
+               const bool bandedEncoded = jo_write_jpg_to_mem_ex(&banded,&bandedLength,&picture[0],width,height,3,&jpegOptions);
+
+               JpegCoefficients expected;
+               JpegCoefficients actual;
+               const bool passed = singleEncoded && bandedEncoded &&
+                  decodeJpegCoefficients( single, singleLength, expected ) && expected.restarts == 0 &&
+                  decodeJpegCoefficients( banded, bandedLength, actual ) && actual.restarts > 0 &&
+                  sameJpegCoefficients( expected, actual );
+               free(single);
+               free(banded);
+
+               std::ostringstream dimensions;
+               dimensions << width << "x" << height;
+               std::cout << std::left << std::setw(10) << dimensions.str()
+                         << "subsampling " << u << ", optimize " << optimize << ", " << threads << " threads, " 
+                         << actual.restarts << " restarts: " << (passed ? "passed" : "FAILED") << std::endl;
+               if( !passed ) ++failures;
+            }
+         }
+      }
+   }
+   std::cout << (failures ? "JPEG self test FAILED" : "JPEG self test passed") << std::endl;
+   return failures == 0;
+}
 
-            createRandomMaterials();
+// ----------------------------------------------------------------------
+// Encodes a picture at every size the server renders, on one thread and
+// on gJpegThreads. Built with JO_JPEG_BYTE_WRITER, the same table gives
+// the times of the byte per call Huffman writer the encoder started with
+// ----------------------------------------------------------------------
+void benchmarkJpeg()
+{
+#ifdef JO_JPEG_BYTE_WRITER
+   std::cout << "JPEG encoder, byte writer, quality 100, 4:2:0" << std::endl;
+#else
+   std::cout << "JPEG encoder, word writer, quality 100, 4:2:0" << std::endl;
+#endif // JO_JPEG_BYTE_WRITER
+   std::cout << "Size      KB        1 thread (ms)  " << std::setw(2) << gJpegThreads << " threads (ms)  MB/s on 1 thread" << std::endl;
+   const int sizes[] = { 768, 1024, 1600, 1920, 2048 };
+   for( size_t s(0); s<sizeof(sizes)/sizeof(sizes[0]); ++s )
+   {
+      const int size = sizes[s];
+      std::vector<unsigned char> picture;
+      makeTestPicture( size, size, picture );
 
-            // Bkground Color
-            gpuKernel->setMaterial( 83, sceneInfo.backgroundColor.x, sceneInfo.backgroundColor.y, sceneInfo.backgroundColor.z, 0.f,
-               0.f, 0.f, false, false, 0, 0.f, NO_TEXTURE, 0.5f, 100.f, 0.f, 0.f );
+      int bytes(0);
+      double seconds[2] = { 0.0, 0.0 };
+      for( int t(0); t<2; ++t )
+      {
+         jo_jpg_options jpegOptions = {};
+         jpegOptions.quality = 100;
+         jpegOptions.threads = (t==0) ? 1 : gJpegThreads;
+         jpegOptions.subsampling = JO_SUBSAMPLING_420;
+         for( int run(0); run<5; ++run )
+         {
+            unsigned char* buffer = nullptr;
+            const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            if( !jo_write_jpg_to_mem_ex(&buffer,&bytes,&picture[0],size,size,3,&jpegOptions) ) bytes = 0;
+            const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+            free(buffer);
+            seconds[t] = (run==0 || elapsed<seconds[t]) ? elapsed : seconds[t];
+         }
+      }
+      std::ostringstream dimensions;
+      dimensions << size << "x" << size;
+      std::cout << std::left << std::setw(10) << dimensions.str()
+                << std::setw(10) << bytes/1024
+                << std::setw(15) << std::fixed << std::setprecision(1) << seconds[0]*1000.0
+                << std::setw(16) << seconds[1]*1000.0
+                << std::setprecision(0) << picture.size()/seconds[0]/(1024.0*1024.0) << std::endl;
+   }
+}
 
+// ----------------------------------------------------------------------
+// Encodes pictures, parses the standard molecules, then builds them on
+// the CPU backend and traces them through the scene boxes and the BVH
+// ----------------------------------------------------------------------
+void benchmark()
+{
+   benchmarkJpeg();
 
-            float4 size = createScene( fileName, structureType, scheme, postProcessingInfo );
-            cameraTarget.z = -size.z*250.f;
-            cameraOrigin.z = cameraTarget.z-4000.f;
+   const int size = 512;
+   const int iterations = 4;
+   CpuKernel kernel( false, true, static_cast<int>(std::thread::hardware_concurrency()) );
+   SceneInfo sceneInfo(gSceneInfo);
+   sceneInfo.width.x  = size;
+   sceneInfo.height.x = size;
+   sceneInfo.pathTracingIteration.x = 0;
+   kernel.setSceneInfo( sceneInfo );
+   kernel.initBuffers();
+   std::vector<char> image( size*size*gWindowDepth );
+
+   // PDB parser, best of 5 runs
+   std::cout << "Molecule  MB        Atoms     Bonds     Parse (ms)  MB/s      Matoms/s" << std::endl;
+   for( size_t i(0); i<gProteinNames.size(); ++i )
+   {
+      const std::string fileName( gPdbFetcher.fileName( gProteinNames[i] ) );
+      PdbAtoms atoms;
+      double seconds(0.0);
+      for( int run(0); run<5; ++run )
+      {
+         const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+         if( !parsePdbFile( fileName, atoms, static_cast<int>(std::thread::hardware_concurrency()) ) ) break;
+         const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+         seconds = (run==0 || elapsed<seconds) ? elapsed : seconds;
+      }
+      if( seconds<=0.0 ) continue;
+      std::ifstream file( fileName.c_str(), std::ios::binary|std::ios::ate );
+      const double megabytes = static_cast<double>(file.tellg())/(1024.0*1024.0);
+      std::cout << std::left << std::setw(10) << gProteinNames[i] 
+                << std::setw(10) << std::fixed << std::setprecision(2) << megabytes
+                << std::setw(10) << atoms.size()
+                << std::setw(10) << atoms.bondFrom.size()
+                << std::setw(12) << std::setprecision(2) << seconds*1000.0
+                << std::setw(10) << std::setprecision(0) << megabytes/seconds
+                << std::setprecision(2) << atoms.size()/seconds/1000000.0 << std::endl;
+   }
 
-            // Post processing effects
-            postProcessingInfo.param1.x = -cameraTarget.z;
-            postProcessingInfo.param2.x = (postProcessingInfo.type.x==0) ? 
-               sceneInfo.maxPathTracingIterations.x*10.f : 5000.f;
-            postProcessingInfo.param3.x = (postProcessingInfo.type.x != 2 ) ? 40+sceneInfo.maxPathTracingIterations.x*5 : 16;
+   std::cout << "Molecule  Primitives  Structure  Nodes    Build (ms)  Mrays/s" << std::endl;
+   for( size_t i(0); i<gProteinNames.size(); ++i )
+   {
+      const std::string moleculeName( gProteinNames[i] + ".pdb" );
+      const std::string fileName( gPdbFetcher.fileName( gProteinNames[i] ) );
+      std::ifstream file( fileName.c_str() );
+      if( !file.is_open() )
+      {
+         std::cout << std::left << std::setw(10) << gProteinNames[i] << fileName << " not found" << std::endl;
+         continue;
+      }
+      file.close();
+
+      kernel.resetAll();
+      createRandomMaterials( kernel );
+      int nbBoxes(0);
+      PostProcessingInfo postProcessingInfo(gPostProcessingInfo);
+      float4 moleculeSize;
+      if( !createScene( kernel, moleculeName, fileName, gtAtoms, 0, postProcessingInfo, moleculeSize, nbBoxes ) )
+      {
+         std::cout << std::left << std::setw(10) << gProteinNames[i] << fileName << " has no atoms" << std::endl;
+         continue;
+      }
+      float4 cameraTarget = gViewDir;
+      float4 cameraOrigin = gViewPos;
+      cameraTarget.z = -moleculeSize.z*250.f;
+      cameraOrigin.z = cameraTarget.z-4000.f;
 
-            // Shadows
-            sceneInfo.shadowsEnabled.x = (postProcessingInfo.type.x != 2);
+      const CpuAcceleration accelerations[2] = { caBoxes, caBvh };
+      for( int a(0); a<2; ++a )
+      {
+         kernel.setAcceleration( accelerations[a] );
+         kernel.resetRays();
+         const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+         for( int iteration(0); iteration<iterations; ++iteration )
+         {
+            sceneInfo.pathTracingIteration.x = iteration;
+            kernel.setPostProcessingInfo( postProcessingInfo );
+            kernel.setSceneInfo( sceneInfo );
+            kernel.setCamera( cameraOrigin, cameraTarget, gViewAngles );
+            kernel.render_begin(0.f);
+            kernel.render_end( &image[0] );
+         }
+         const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count() - kernel.buildTime();
+         std::cout << std::left << std::setw(10) << gProteinNames[i] 
+                   << std::setw(12) << kernel.getNbActivePrimitives()
+                   << std::setw(11) << ((accelerations[a]==caBvh) ? "BVH" : "Boxes")
+                   << std::setw(9) << kernel.nodes()
+                   << std::setw(12) << std::fixed << std::setprecision(1) << kernel.buildTime()*1000.0
+                   << std::setprecision(2) << ((seconds>0.0) ? kernel.rays()/seconds/1000000.0 : 0.0) << std::endl;
+      }
+   }
+}
 
-            // Rotation
-            gpuKernel->rotatePrimitives( gRotationCenter, moleculeRotationAngles, 10, gNbBoxes );
+// ----------------------------------------------------------------------
+// Writes the binary files of the standard molecules, for every structure
+// and scheme, so that no request has to parse their PDB files
+// ----------------------------------------------------------------------
+void compileMolecules()
+{
+   // The kernel only holds the scene, nothing is rendered
+   CpuKernel kernel( false, true, 1 );
+   kernel.setSceneInfo( gSceneInfo );
+   kernel.initBuffers();
 
-            // Background color
-            sceneInfo.backgroundColor = (postProcessingInfo.type.x == 2 ) ? gBkBlack : sceneInfo.backgroundColor;
+   for( size_t i(0); i<gProteinNames.size(); ++i )
+   {
+      const std::string moleculeName( gProteinNames[i] + ".pdb" );
+      const std::string fileName( gPdbFetcher.fileName( gProteinNames[i] ) );
+      std::ifstream file( fileName.c_str() );
+      if( !file.is_open() )
+      {
+         std::cout << std::left << std::setw(10) << gProteinNames[i] << fileName << " not found" << std::endl;
+         continue;
+      }
+      file.close();
 
-            // Rendering process
-            for( int i(0); i<sceneInfo.maxPathTracingIterations.x; ++i)
+      bool hasAtoms(true);
+      for( int structureType(gtAtoms); structureType<=gtBackbone && hasAtoms; ++structureType )
+      {
+         for( int scheme(0); scheme<=2 && hasAtoms; ++scheme )
+         {
+            MoleculeKey key = { moleculeName, structureType, scheme, gDefaultAtomSize, gDefaultStickSize };
+            if( loadMoleculeFile( moleculeFileName( fileName, key ), key, fileName ) ) continue;
+            kernel.resetAll();
+            createRandomMaterials( kernel );
+            float4 size;
+            hasAtoms = readMolecule( kernel, key, fileName, size );
+            if( !hasAtoms )
             {
-               sceneInfo.pathTracingIteration.x = i;
-               gpuKernel->setPostProcessingInfo( postProcessingInfo );
-               gpuKernel->setSceneInfo( sceneInfo );
-               gpuKernel->setCamera( cameraOrigin, cameraTarget, cameraAngles );
-               gpuKernel->render_begin(0.f);
-               gpuKernel->render_end((char*)image);
+               std::cout << std::left << std::setw(10) << gProteinNames[i] << fileName << " has no atoms" << std::endl;
+               continue;
             }
+            std::cout << std::left << std::setw(10) << gProteinNames[i] << moleculeFileName( fileName, key ) 
+                      << ", " << kernel.getNbActivePrimitives() << " primitives" << std::endl;
+         }
+      }
+   }
+}
 
+// ----------------------------------------------------------------------
+// Builds the default structure and scheme of one catalog molecule into
+// the molecule cache, from its binary file when it was compiled before
+// ----------------------------------------------------------------------
+bool prewarmMolecule( GPUKERNEL& kernel, const std::string& moleculeId )
+{
+   if( pdbFetchError( gPdbFetcher.fetch( moleculeId ).get() ) != nullptr ) return false;
+
+   const std::string moleculeName( moleculeId + ".pdb" );
+   const std::string fileName( gPdbFetcher.fileName( moleculeId ) );
+   MoleculeKey key = { moleculeName, gtAtoms, 0, gDefaultAtomSize, gDefaultStickSize };
+   if( gMoleculeCache.find( key ) ) return true;
+   std::shared_ptr<const CachedMolecule> molecule = loadMoleculeFile( moleculeFileName( fileName, key ), key, fileName );
+   if( molecule )
+   {
+      gMoleculeCache.insert( key, molecule );
+      return true;
+   }
+   kernel.resetAll();
+   createRandomMaterials( kernel );
+   float4 size;
+   return readMolecule( kernel, key, fileName, size );
+}
 
-            std::string jpgName = moleculeId + ".jpg";
-            size_t len;
-            char* buffer = nullptr;
-            long bufferLength;
-            jo_write_jpg(jpgName.c_str(),image,sceneInfo.width.x,sceneInfo.height.x,3,100);
-            FILE * pFile;
-            size_t result;
-
-            pFile = fopen ( jpgName.c_str(), "rb" );
-            if (pFile!=NULL) 
-            {
-               // obtain file size:
-               fseek (pFile , 0 , SEEK_END);
-               bufferLength = ftell (pFile);
-               rewind (pFile);
-
-               // allocate memory to contain the whole file:
-               buffer = new char[bufferLength];
+// Catalog molecules taken in turn by the prewarm threads
+void prewarmMolecules( std::atomic<size_t>* next )
+{
+   // The kernel only holds the scene, nothing is rendered
+   CpuKernel kernel( false, true, 1 );
+   kernel.setSceneInfo( gSceneInfo );
+   kernel.initBuffers();
+   for( size_t i = (*next)++; i<gProteinNames.size(); i = (*next)++ )
+   {
+      if( prewarmMolecule( kernel, gProteinNames[i] ) ) ++gPrewarmedMolecules; else ++gPrewarmFailures;
+   }
+}
 
-               // copy the file into the buffer:
-               result = fread (buffer,1,bufferLength,pFile);
-               if (result != bufferLength) 
-               {
-                  //fputs ("Reading error",stderr); exit (3);
-               }
+// Default pictures, what /get?molecule=<ID> returns, rendered straight
+// into the response cache on the render contexts
+void prewarmPictures( std::atomic<size_t>* next )
+{
+   for( size_t i = (*next)++; i<gProteinNames.size(); i = (*next)++ )
+   {
+      RenderRequest renderRequest( gSceneInfo );
+      renderRequest.set( "molecule", gProteinNames[i].c_str() );
+      renderRequest.resolve( gProteinNames );
+      const std::string cacheKey = renderRequest.canonicalKey();
+      // renderJob expects the PDB file, this thread can wait for it
+      if( pdbFetchError( gPdbFetcher.fetch( gProteinNames[i] ).get() ) != nullptr ) continue;
+      if( !gResponseCache.find( cacheKey ) )
+      {
+         RenderJob job( renderRequest, cacheKey, "prewarm" );
+         job.queuedAt = job.startedAt = std::chrono::steady_clock::now();
+         renderJob( job );
+         if( !job.image ) continue;
+      }
+      ++gPrewarmedPictures;
+   }
+}
 
-               /* the whole file is now loaded in the memory buffer. */
+// ----------------------------------------------------------------------
+// Prewarm thread. Every download is started first, they run on the
+// fetcher's threads while the first molecules are built
+// ----------------------------------------------------------------------
+void prewarm()
+{
+   const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+   for( size_t i(0); i<gProteinNames.size(); ++i ) gPdbFetcher.fetch( gProteinNames[i] );
 
-               // terminate
-               fclose (pFile);
-            }
+   std::atomic<size_t> next(0);
+   std::vector<std::thread> threads;
+   const size_t nbThreads = std::min( static_cast<size_t>(std::max( gPrewarmThreads, 1 )), gProteinNames.size() );
+   for( size_t i(0); i<nbThreads; ++i ) threads.push_back( std::thread( prewarmMolecules, &next ) );
+   for( size_t i(0); i<threads.size(); ++i ) threads[i].join();
+   threads.clear();
 
-#if 0
-            request << "<body>";
-            request << "<p align=\"center\"><b>Molecule:</b>" << moleculeId.c_str() << "</p>";
-            request << "<p align=\"center\"><img border=5 bgcolor=#000000 src=\"data:image/jpg;base64,";
-            request << base64_encode( (const unsigned char*)buffer, bufferLength, &len );
-            request << "\"/></p>";
-            request << "<p align=\"center\">Copyright(C) Cyrille Favreau</p>";
-            renderingTime = GetTickCount()-renderingTime;
-            request << "<p align=\"center\">Rendering time: " << renderingTime << " milliseconds on nVidia GTX 480</p>";
-            /*
-            request << "<p align=\"center\">molecule=XXXX 4 capital letters identifiying the molecule. The list bellow is  the only one you can use for now).<br/>";
-            request << "<p align=\"center\">scheme=[0|1|2] 0: Standard, 1: Chain, 2: Residue<br/>";
-            request << "<p align=\"center\">structure=[0|1|2|3] 0: Real size atoms, 1: Fixed size atoms, 2: Sticks, 3: Sticks and atoms<br/>";
-            request << "<p align=\"center\">rotation=[x,y,z] Rotates the molecule according to x,y and z. Note that x,y,and z are real numbers specifying degrees of rotation for each axe.<br/>";
-            request << "<p align=\"center\">quality=[1-100] Identifies the number of iterations to process. The higher the better, and slower...<br/>";
-            request << "<p align=\"center\">bkcolor=[r,g,b] Specifies the red, green and blue values for background color(example: bkcolor=255,0,127)<br/>";
-            request << "<p align=\"center\">postprocessing=[0|1|2] 0: None, 1: Depth of field, 2: Ambient occlusion</p>";
-            request << "<p align=\"center\">Syntax: http://molecular-visualization.no-ip.org/get?molecule=XXXX[&scheme=0|1|2][&structure=0|1|2|3][&rotation=float,float,\<float\>][&quality=integer]<br/>";
-            request << "<p align=\"center\">Example: http://molecular-visualization.no-ip.org/get?postprocessing=0&bkcolor=120,120,120&quality=1000&rotation=0,0,0&molecule=2M1L</p>";
-            */
-            request << "<p align=\"center\">Help: <a href=\"http://cudaopencl.blogspot.com\">http://cudaopencl.blogspot.com</a></p>";
-            request << "<p align=\"center\"><a href=\"http://www.molecular-visualization.com\">http://www.molecular-visualization.com</a></p>";
-            request << "</body>";
-            delete [] buffer;
-#else
-            request << "data:image/jpg;base64,";
-            request << base64_encode( (const unsigned char*)buffer, bufferLength, &len );
-            request.AddHeader("Access-Control-Allow-Origin", "*"); // Needed by Chrome!!
-            delete [] buffer;
-#endif // 0
+   if( gPrewarmMode == pmPictures )
+   {
+      // More threads than contexts would only wait for a lease
+      next = 0;
+      const size_t nbRenderers = std::min( static_cast<size_t>(gRenderContexts.size()), gProteinNames.size() );
+      for( size_t i(0); i<nbRenderers; ++i ) threads.push_back( std::thread( prewarmPictures, &next ) );
+      for( size_t i(0); i<threads.size(); ++i ) threads[i].join();
+   }
 
-            delete gpuKernel;
-            delete image;
-         }
+   gReady = true;
+   std::cout << "Prewarm             : " << gPrewarmedMolecules.load() << " molecules";
+   if( gPrewarmMode == pmPictures ) std::cout << ", " << gPrewarmedPictures.load() << " pictures";
+   std::cout << ", " << gPrewarmFailures.load() << " failed, in " 
+             << std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count() << " s, ready" << std::endl;
+}
 
-         gCurrentProtein++;
-         gCurrentProtein = gCurrentProtein%gProteinNames.size();
+int main(int argc, char * argv[])
+{
+   // Command line
+   bool runBenchmark(false);
+   bool runCompile(false);
+   bool runSelfTest(false);
+   for( int i(1); i<argc; ++i )
+   {
+      if( strcmp(argv[i],"-benchmark")==0 )
+      {
+         // Times the JPEG encoder, then the PDB parser and the CPU acceleration structures on the standard molecules, then exits
+         runBenchmark = true;
       }
-      catch(...)
+      else if( strcmp(argv[i],"-selftest")==0 )
       {
-         request << "An exception occured :-( Please try again";
+         // Checks the JPEG encoder, then exits with 1 if it failed
+         runSelfTest = true;
       }
-      gRequests[request.GetAddress().ToString()] = requestStr;
-      gNbCalls++;
-   }
-   else
-   {
-      request << gNbCalls << " calls so far<br/>";
-      std::map<std::string,std::string>::const_iterator iter = gRequests.begin();
-      while( iter != gRequests.end() )
+      else if( strcmp(argv[i],"-compile")==0 )
       {
-         request << (*iter).second.c_str() << "<br/>";
-         ++iter;
+         // Writes the binary files of the standard molecules, then exits
+         runCompile = true;
+      }
+      else if( strcmp(argv[i],"-jpegthreads")==0 && i+1<argc )
+      {
+         // Threads used to encode one image, 1 encodes on the calling thread. The cores over the render contexts by default
+         gJpegThreads = atoi(argv[++i]);
+      }
+      else if( strcmp(argv[i],"-contexts")==0 && i+1<argc )
+      {
+         // Render contexts created at startup, i.e. requests rendered at the same time
+         gNbRenderContexts = atoi(argv[++i]);
+         gNbRenderContexts = (gNbRenderContexts<1) ? 1 : gNbRenderContexts;
+      }
+      else if( strcmp(argv[i],"-backend")==0 && i+1<argc )
+      {
+         // cuda, or cpu for servers without a CUDA device
+         ++i;
+         gRenderBackend = (strcmp(argv[i],"cpu")==0) ? rbCpu : rbCuda;
+      }
+      else if( strcmp(argv[i],"-maxsize")==0 && i+1<argc )
+      {
+         // Largest image width and height, the buffers of every context are allocated for it
+         gMaxImageSize = atoi(argv[++i]);
+         gMaxImageSize = (gMaxImageSize<64) ? 64 : gMaxImageSize;
+      }
+      else if( strcmp(argv[i],"-renderbudget")==0 && i+1<argc )
+      {
+         // Millions of pixels x iterations queued or rendering before requests are turned away
+         gRenderBudget = atoi(argv[++i]);
+         gRenderBudget = (gRenderBudget<1) ? 1 : gRenderBudget;
+      }
+      else if( strcmp(argv[i],"-clientbudget")==0 && i+1<argc )
+      {
+         // Same, for the requests of one address
+         gClientRenderBudget = atoi(argv[++i]);
+         gClientRenderBudget = (gClientRenderBudget<1) ? 1 : gClientRenderBudget;
+      }
+      else if( strcmp(argv[i],"-pdbmirror")==0 && i+1<argc )
+      {
+         // Base URL PDB files are downloaded from, the file name (1BNA.pdb) is appended
+         gPdbFetcher.setMirror( argv[++i] );
+      }
+      else if( strcmp(argv[i],"-fetchthreads")==0 && i+1<argc )
+      {
+         // PDB files downloaded at the same time
+         gFetchThreads = atoi(argv[++i]);
+         gFetchThreads = (gFetchThreads<1) ? 1 : gFetchThreads;
+      }
+      else if( strcmp(argv[i],"-catalog")==0 && i+1<argc )
+      {
+         // Molecules offered, one PDB ID per line
+         gCatalogFile = argv[++i];
+      }
+      else if( strcmp(argv[i],"-prewarm")==0 && i+1<argc )
+      {
+         // none, molecules (default) or pictures: what is ready before /ready says so
+         ++i;
+         if( strcmp(argv[i],"none")==0 ) gPrewarmMode = pmNone;
+         else if( strcmp(argv[i],"pictures")==0 ) gPrewarmMode = pmPictures;
+         else gPrewarmMode = pmMolecules;
+      }
+      else if( strcmp(argv[i],"-prewarmthreads")==0 && i+1<argc )
+      {
+         // Molecules built at the same time while prewarming
+         gPrewarmThreads = atoi(argv[++i]);
+         gPrewarmThreads = (gPrewarmThreads<1) ? 1 : gPrewarmThreads;
+      }
+      else if( strcmp(argv[i],"-moleculecache")==0 && i+1<argc )
+      {
+         // Megabytes of built molecules kept in memory
+         gMoleculeCache.setBudget( static_cast<size_t>(atoi(argv[++i]))*1024*1024 );
+      }
+      else if( strcmp(argv[i],"-imagecache")==0 && i+1<argc )
+      {
+         // Megabytes of encoded pictures kept in memory
+         gResponseCache.setBudget( static_cast<size_t>(atoi(argv[++i]))*1024*1024 );
+      }
+      else if( strcmp(argv[i],"-imagecachedir")==0 && i+1<argc )
+      {
+         // Directory keeping encoded pictures across restarts
+         gResponseCache.setDirectory( argv[++i] );
       }
    }
-}
+   // Alone in the process, the benchmark and the self test have every core
+   if( gJpegThreads < 1 && ( runSelfTest || runBenchmark || runCompile ) ) gJpegThreads = defaultJpegThreads( 1 );
+   if( runSelfTest )
+   {
+      return selfTest() ? 0 : 1;
+   }
+   if( runBenchmark || runCompile )
+   {
+      initializeMolecules();
+      if( runCompile ) compileMolecules();
+      if( runBenchmark ) benchmark();
+      return 0;
+   }
+   gRenderContexts.initialize( gNbRenderContexts, gMaxImageSize, gMaxImageSize, gWindowDepth, gSceneInfo, createRandomMaterials, gRenderBackend );
+   // One render worker per context
+   if( gJpegThreads < 1 ) gJpegThreads = defaultJpegThreads( gRenderContexts.size() );
+   std::cout << "JPEG encoder threads: " << gJpegThreads << " per render worker" << std::endl;
+   std::cout << "Render contexts     : " << gRenderContexts.size() << " x " << gMaxImageSize << "x" << gMaxImageSize 
+             << ", " << gRenderContexts.imageBytes()/(1024*1024) << " MB host frame buffer each, "
+             << ((gRenderContexts.backend()==rbCpu) ? "CPU" : "CUDA") << " backend" << std::endl;
+   std::cout << "Render budget       : " << gRenderBudget << " M pixel iterations, " << gClientRenderBudget << " per client" << std::endl;
+   std::cout << "Molecule cache      : " << gMoleculeCache.stats().budget/(1024*1024) << " MB" << std::endl;
+   std::cout << "PDB mirror          : " << gPdbFetcher.mirror() << ", " << gFetchThreads << " downloads at a time" << std::endl;
+   std::cout << "Response cache      : " << gResponseCache.stats().memory.budget/(1024*1024) << " MB" << std::endl;
+
+   initializeMolecules();
+   static const char* prewarmModes[] = { "none", "molecules", "pictures" };
+   std::cout << "Catalog             : " << gProteinNames.size() << " molecules, prewarm " << prewarmModes[gPrewarmMode]
+             << ", " << gPrewarmThreads << " threads" << std::endl;
 
-int main(int argc, char * argv[])
-{
    Lacewing::EventPump EventPump;
    Lacewing::Webserver Webserver(EventPump);
 
    Webserver.onGet(onGet);
+   Webserver.onDisconnect(onDisconnect);
+   gRenderWorkers.setBudget( static_cast<uint64_t>(gRenderBudget)*1000000, static_cast<uint64_t>(gClientRenderBudget)*1000000 );
+   gRenderWorkers.start( gRenderContexts.size(), EventPump, renderJob, completeJob );
+   // After the workers: the callback posts to their event pump
+   gPdbFetcher.setCallback( onPdbFetched, nullptr );
+   gPdbFetcher.start( gFetchThreads );
+   if( gPrewarmMode == pmNone ) gReady = true; else gPrewarmThread = std::thread( prewarm );
    Webserver.Host(8083);    
 
-   initializeMolecules();
-
    EventPump.StartEventLoop();
 
+   if( gPrewarmThread.joinable() ) gPrewarmThread.join();
    return 0;
 }
@@ -0,0 +1,276 @@
+/* 
+* Molecular Visualization HTTP Server
+* Copyright (C) 2011-2012 Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* aint with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+*/
+
+#include "JpegDecoder.h"
+
+#include <string.h>
+
+namespace
+{
+   // Canonical Huffman table, decoded a bit at a time (JPEG annex F.2.2.3)
+   struct HuffmanTable
+   {
+      int minCode[17];
+      int maxCode[17]; // -1 when no code has that length
+      int valuePtr[17];
+      unsigned char values[256];
+      bool defined;
+   };
+
+   // Entropy coded data, with the 0 stuffed after 0xFF removed. Running
+   // into a marker is an error: a valid scan never needs its bits
+   struct BitReader
+   {
+      const unsigned char* p;
+      const unsigned char* end;
+      unsigned int bits;
+      int count;
+      bool failed;
+
+      int bit()
+      {
+         if( count == 0 )
+         {
+            if( p >= end || (p[0] == 0xFF && (p+1 >= end || p[1] != 0)) )
+            {
+               failed = true;
+               return 0;
+            }
+            bits = *p;
+            p += (p[0] == 0xFF) ? 2 : 1;
+            count = 8;
+         }
+         --count;
+         return (bits >> count) & 1;
+      }
+
+      int receive( const int length )
+      {
+         int value(0);
+         for( int i(0); i<length; ++i ) value = (value << 1) | bit();
+         return value;
+      }
+   };
+
+   int extend( const int value, const int length )
+   {
+      return ( length > 0 && value < (1 << (length-1)) ) ? value - (1 << length) + 1 : value;
+   }
+
+   int decodeSymbol( BitReader& reader, const HuffmanTable& table )
+   {
+      int code(0);
+      for( int length(1); length<=16; ++length )
+      {
+         code = (code << 1) | reader.bit();
+         if( code <= table.maxCode[length] ) return table.values[table.valuePtr[length] + code - table.minCode[length]];
+      }
+      reader.failed = true;
+      return 0;
+   }
+
+   bool readHuffmanTable( const unsigned char*& p, const unsigned char* end, HuffmanTable& table )
+   {
+      if( end-p < 17 ) return false;
+      const unsigned char* counts = p+1;
+      int total(0);
+      for( int length(1); length<=16; ++length ) total += counts[length-1];
+      if( total > 256 || end-p < 17+total ) return false;
+      memcpy( table.values, p+17, total );
+      int code(0);
+      int index(0);
+      for( int length(1); length<=16; ++length )
+      {
+         table.valuePtr[length] = index;
+         table.minCode[length]  = code;
+         table.maxCode[length]  = counts[length-1] ? code+counts[length-1]-1 : -1;
+         code  = (code+counts[length-1]) << 1;
+         index += counts[length-1];
+      }
+      table.defined = true;
+      p += 17+total;
+      return true;
+   }
+}
+
+bool decodeJpegCoefficients( const unsigned char* data, const size_t size, JpegCoefficients& coefficients )
+{
+   coefficients = JpegCoefficients();
+   const unsigned char* end = data+size;
+   if( size < 4 || data[0] != 0xFF || data[1] != 0xD8 ) return false;
+   const unsigned char* p = data+2;
+
+   HuffmanTable tables[2][4]; // DC, AC
+   memset( tables, 0, sizeof(tables) );
+   int componentIds[4] = { 0, 0, 0, 0 };
+   int dcTable[4] = { 0, 0, 0, 0 };
+   int acTable[4] = { 0, 0, 0, 0 };
+
+   for(;;)
+   {
+      if( end-p < 4 || p[0] != 0xFF ) return false;
+      const unsigned char marker = p[1];
+      const int length = (p[2] << 8) | p[3];
+      const unsigned char* segment = p+4;
+      const unsigned char* segmentEnd = p+2+length;
+      if( length < 2 || segmentEnd > end ) return false;
+
+      if( marker == 0xDB )
+      {
+         // Quantization tables, stored in zigzag order like the coefficients
+         while( segment < segmentEnd )
+         {
+            const int precision = segment[0] >> 4;
+            const int id = segment[0] & 3;
+            const int bytes = precision ? 128 : 64;
+            if( segmentEnd-segment < 1+bytes ) return false;
+            for( int i(0); i<64; ++i )
+            {
+               coefficients.quant[id][i] = precision ? static_cast<unsigned short>((segment[1+2*i] << 8) | segment[2+2*i]) : segment[1+i];
+            }
+            segment += 1+bytes;
+         }
+      }
+      else if( marker == 0xC0 || marker == 0xC1 )
+      {
+         if( length < 8 ) return false;
+         coefficients.height     = (segment[1] << 8) | segment[2];
+         coefficients.width      = (segment[3] << 8) | segment[4];
+         coefficients.components = segment[5];
+         if( coefficients.components < 1 || coefficients.components > 4 || length < 8+3*coefficients.components ) return false;
+         for( int c(0); c<coefficients.components; ++c )
+         {
+            componentIds[c]              = segment[6+3*c];
+            coefficients.hSampling[c]    = segment[7+3*c] >> 4;
+            coefficients.vSampling[c]    = segment[7+3*c] & 15;
+            coefficients.quantTable[c]   = segment[8+3*c] & 3;
+            if( coefficients.hSampling[c] < 1 || coefficients.vSampling[c] < 1 ) return false;
+         }
+      }
+      else if( marker == 0xC4 )
+      {
+         while( segment < segmentEnd )
+         {
+            const int type = segment[0] >> 4;
+            const int id = segment[0] & 3;
+            if( type > 1 || !readHuffmanTable( segment, segmentEnd, tables[type][id] ) ) return false;
+         }
+      }
+      else if( marker == 0xDD )
+      {
+         if( length < 4 ) return false;
+         coefficients.restartInterval = (segment[0] << 8) | segment[1];
+      }
+      else if( marker == 0xDA )
+      {
+         break;
+      }
+      else if( (marker & 0xF0) == 0xC0 && marker != 0xC4 && marker != 0xC8 && marker != 0xCC )
+      {
+         // Progressive, lossless, arithmetic coded
+         return false;
+      }
+      p = segmentEnd;
+   }
+
+   // Start of scan: only the interleaved scan of every component is supported
+   const unsigned char* sos = p+4;
+   const int scanComponents = sos[0];
+   if( coefficients.components == 0 || scanComponents != coefficients.components || end-sos < 4+2*scanComponents ) return false;
+   for( int i(0); i<scanComponents; ++i )
+   {
+      if( sos[1+2*i] != componentIds[i] ) return false;
+      dcTable[i] = (sos[2+2*i] >> 4) & 3;
+      acTable[i] = sos[2+2*i] & 3;
+      if( !tables[0][dcTable[i]].defined || !tables[1][acTable[i]].defined ) return false;
+   }
+   p += 2+((p[2] << 8) | p[3]);
+
+   int hMax(1);
+   int vMax(1);
+   int blocksPerMcu(0);
+   for( int c(0); c<coefficients.components; ++c )
+   {
+      hMax = (coefficients.hSampling[c] > hMax) ? coefficients.hSampling[c] : hMax;
+      vMax = (coefficients.vSampling[c] > vMax) ? coefficients.vSampling[c] : vMax;
+      blocksPerMcu += coefficients.hSampling[c]*coefficients.vSampling[c];
+   }
+   const int mcus = ((coefficients.width+8*hMax-1)/(8*hMax)) * ((coefficients.height+8*vMax-1)/(8*vMax));
+   coefficients.blocks.assign( static_cast<size_t>(mcus)*blocksPerMcu*64, 0 );
+
+   BitReader reader = { p, end, 0, 0, false };
+   int predictors[4] = { 0, 0, 0, 0 };
+   short* block = coefficients.blocks.empty() ? nullptr : &coefficients.blocks[0];
+   for( int mcu(0); mcu<mcus; ++mcu )
+   {
+      if( coefficients.restartInterval > 0 && mcu > 0 && mcu%coefficients.restartInterval == 0 )
+      {
+         // Restart: byte aligned RSTn, n counting modulo 8, and the DC predictions start over
+         reader.count = 0;
+         if( end-reader.p < 2 || reader.p[0] != 0xFF || reader.p[1] != 0xD0+(coefficients.restarts & 7) ) return false;
+         reader.p += 2;
+         coefficients.restarts++;
+         memset( predictors, 0, sizeof(predictors) );
+      }
+      for( int c(0); c<coefficients.components; ++c )
+      {
+         for( int b(0); b<coefficients.hSampling[c]*coefficients.vSampling[c]; ++b, block += 64 )
+         {
+            const int dcLength = decodeSymbol( reader, tables[0][dcTable[c]] );
+            if( dcLength > 16 ) return false;
+            predictors[c] += extend( reader.receive( dcLength ), dcLength );
+            block[0] = static_cast<short>(predictors[c]);
+            for( int k(1); k<64; ++k )
+            {
+               const int symbol = decodeSymbol( reader, tables[1][acTable[c]] );
+               const int run = symbol >> 4;
+               const int acLength = symbol & 15;
+               if( acLength == 0 )
+               {
+                  if( run != 15 ) break; // end of block
+                  k += 15;
+                  continue;
+               }
+               k += run;
+               if( k > 63 ) return false;
+               block[k] = static_cast<short>( extend( reader.receive( acLength ), acLength ) );
+            }
+            if( reader.failed ) return false;
+         }
+      }
+   }
+
+   // The last byte is padded with 1s, the end of image marker follows it
+   return end-reader.p >= 2 && reader.p[0] == 0xFF && reader.p[1] == 0xD9;
+}
+
+bool sameJpegCoefficients( const JpegCoefficients& a, const JpegCoefficients& b )
+{
+   if( a.width != b.width || a.height != b.height || a.components != b.components || a.blocks != b.blocks ) return false;
+   for( int c(0); c<a.components; ++c )
+   {
+      if( a.hSampling[c] != b.hSampling[c] || a.vSampling[c] != b.vSampling[c] ) return false;
+      if( memcmp( a.quant[a.quantTable[c]], b.quant[b.quantTable[c]], sizeof(a.quant[0]) ) != 0 ) return false;
+   }
+   return true;
+}
@@ -0,0 +1,58 @@
+/* 
+* Molecular Visualization HTTP Server
+* Copyright (C) 2011-2012 Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* aint with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+*/
+
+
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+// ----------------------------------------------------------------------
+// Entropy decoder for baseline JPEG files (SOF0, one interleaved scan,
+// optional restart intervals). It stops at the quantized coefficients:
+// two files with the same quantization tables and coefficients decode
+// to the same pixels with any decoder. Used by -selftest to check the
+// encoder, not on the request path
+// ----------------------------------------------------------------------
+struct JpegCoefficients
+{
+   int width;
+   int height;
+   int components;
+   int hSampling[4];
+   int vSampling[4];
+   int quantTable[4];
+   unsigned short quant[4][64];
+   int restartInterval; // MCUs, 0 for none
+   int restarts;        // RSTn markers met
+   std::vector<short> blocks; // every 8x8 block in file order, zigzag order, DC not differential
+
+   JpegCoefficients()
+    : width(0), height(0), components(0), hSampling(), vSampling(), quantTable(), quant(), restartInterval(0), restarts(0) {}
+};
+
+// Returns false when the file is not a baseline JPEG or is damaged
+bool decodeJpegCoefficients( const unsigned char* data, const size_t size, JpegCoefficients& coefficients );
+
+// Same tables, same sampling, same coefficients
+bool sameJpegCoefficients( const JpegCoefficients& a, const JpegCoefficients& b );
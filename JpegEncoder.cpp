@@ -2,10 +2,17 @@
  *
  * Quick Notes:
  * 	Based on a javascript jpeg writer
- * 	JPEG baseline (no JPEG progressive)
+ * 	JPEG baseline, or progressive with jo_jpg_options::progressive
  * 	Supports 1, 3 or 4 component input. (luminance, RGB or RGBX)
  *
  * Latest revisions:
+ *	1.59 (2026-17-10) Progressive mode (jo_jpg_options::progressive): DC successive approximation and spectral selection scans, with per scan Huffman tables.
+ *	1.58 (2026-17-10) Optional two pass mode with optimized Huffman tables per image (jo_jpg_options::optimizeHuffman).
+ *	1.57 (2026-17-10) 4:2:2 and 4:2:0 chroma subsampling via jo_jpg_options::subsampling.
+ *	1.56 (2026-17-10) Added jo_jpg_options and the _ex entry points. Optional restart intervals, and parallel entropy coding of bands of MCU rows, on threads started for each pass.
+ *	1.55 (2026-17-10) SSE2 and AVX kernels for color conversion, DCT and quantization, selected at runtime. Output is unchanged.
+ *	1.54 (2026-17-10) Entropy coder writes 32 bit words from a 64 bit accumulator into a staging buffer, instead of putc per byte. Output is unchanged.
+ *	1.53 (2026-17-10) Added jo_write_jpg_to_func and jo_write_jpg_to_mem for encoding without touching the filesystem. jo_write_jpg is now a wrapper over them.
  *	1.52 (2012-22-11) Added support for specifying Luminance, RGB, or RGBA via comp(onents) argument (1, 3 and 4 respectively). 
  *	1.51 (2012-19-11) Fixed some warnings
  *	1.50 (2012-18-11) MT safe. Simplified. Optimized. Reduced memory requirements. Zero allocations. No namespace polution. Approx 340 lines code.
@@ -16,6 +23,9 @@
  * Basic usage:
  *	char *foo = new char[128*128*4]; // 4 component. RGBX format, where X is unused 
  *	jo_write_jpg("foo.jpg", foo, 128, 128, 4, 90); // comp can be 1, 3, or 4. Lum, RGB, or RGBX respectively.
+ *
+ *	unsigned char *jpg; int jpgSize;
+ *	if(jo_write_jpg_to_mem(&jpg, &jpgSize, foo, 128, 128, 4, 90)) { ...; free(jpg); } // same, but into a malloc()ed buffer
  * 	
  * */
 
@@ -26,9 +36,37 @@
 // or create jo_jpeg.h, #define JO_JPEG_HEADER_FILE_ONLY, and
 // then include jo_jpeg.c from it.
 
+// Receives the encoded stream in consecutive chunks
+typedef void jo_write_func(void *context, const void *data, int size);
+
 // Returns false on failure
 extern bool jo_write_jpg(const char *filename, const void *data, int width, int height, int comp, int quality);
 
+// Same as jo_write_jpg, but hands the encoded bytes to func instead of writing a file.
+// Returns false on failure
+extern bool jo_write_jpg_to_func(jo_write_func *func, void *context, const void *data, int width, int height, int comp, int quality);
+
+// Same as jo_write_jpg, but encodes into a buffer allocated with malloc(). 
+// On success *out must be released with free(). Returns false on failure
+extern bool jo_write_jpg_to_mem(unsigned char **out, int *outSize, const void *data, int width, int height, int comp, int quality);
+
+// Encoder settings for the _ex entry points. Zero initialize for the defaults: jo_jpg_options opts = {};
+struct jo_jpg_options {
+	int quality;     // 1-100, 0 = 90
+	int threads;     // > 1 entropy codes bands of MCU rows in parallel, separated by restart markers. Threads are started and joined for each pass
+	int restartRows; // MCU rows per restart interval. 0 = none, or two bands per thread when threaded
+	int subsampling; // JO_SUBSAMPLING_*
+	bool optimizeHuffman; // per image Huffman tables, built from a first pass over the quantized coefficients
+	bool progressive;     // progressive JPEG (SOF2). Always builds its own tables, and has no restart intervals
+};
+
+// Chroma subsampling modes, 4:2:2 halves the chroma horizontally and 4:2:0 in both directions
+enum { JO_SUBSAMPLING_444 = 0, JO_SUBSAMPLING_422 = 1, JO_SUBSAMPLING_420 = 2 };
+
+// Same as jo_write_jpg_to_func/jo_write_jpg_to_mem, with the settings above. Returns false on failure
+extern bool jo_write_jpg_to_func_ex(jo_write_func *func, void *context, const void *data, int width, int height, int comp, const jo_jpg_options *options);
+extern bool jo_write_jpg_to_mem_ex(unsigned char **out, int *outSize, const void *data, int width, int height, int comp, const jo_jpg_options *options);
+
 #endif // JO_INCLUDE_JPEG_H
 
 #ifndef JO_JPEG_HEADER_FILE_ONLY
@@ -39,22 +77,173 @@ extern bool jo_write_jpg(const char *filename, const void *data, int width, int
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <vector>
+#include <thread>
+#include <atomic>
+
+// SSE2/AVX kernels for the per block work, picked at runtime. Define JO_JPEG_NO_SIMD to build the scalar code only.
+#if !defined(JO_JPEG_NO_SIMD) && (defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__))
+#define JO_JPEG_SIMD 1
+#include <emmintrin.h>
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define JO_TARGET_AVX
+#else
+#define JO_TARGET_AVX __attribute__((target("avx")))
+#endif
+#endif
 
 static const unsigned char s_jo_ZigZag[] = { 0,1,5,6,14,15,27,28,2,4,7,13,16,26,29,42,3,8,12,17,25,30,41,43,9,11,18,24,31,40,44,53,10,19,23,32,39,45,52,54,20,22,33,38,46,51,55,60,21,34,37,47,50,56,59,61,35,36,48,49,57,58,62,63 };
 
-static void jo_writeBits(FILE *fp, int &bitBuf, int &bitCnt, const unsigned short *bs) {
-	bitCnt += bs[1];
-	bitBuf |= bs[0] << (24 - bitCnt);
-	while(bitCnt >= 8) {
-		unsigned char c = (bitBuf >> 16) & 255;
-		putc(c, fp);
+// Output is staged in a contiguous buffer and handed to the write callback a block at a time.
+// Entropy coded bits are gathered in a 64 bit accumulator and leave it 32 bits at a time.
+struct jo_stream {
+	jo_write_func *func;
+	void *context;
+	unsigned long long bitBuf; // pending bits, right aligned
+	int bitCnt;
+	unsigned char *cur, *end;
+	unsigned char buf[16*1024];
+};
+
+static void jo_initStream(jo_stream *s, jo_write_func *func, void *context) {
+	s->func = func;
+	s->context = context;
+	s->bitBuf = 0;
+	s->bitCnt = 0;
+	s->cur = s->buf;
+	s->end = s->buf + sizeof(s->buf);
+}
+
+static void jo_flush(jo_stream *s) {
+	if(s->cur != s->buf) {
+		s->func(s->context, s->buf, (int)(s->cur - s->buf));
+		s->cur = s->buf;
+	}
+}
+
+static void jo_write(jo_stream *s, const void *data, int size) {
+	const unsigned char *p = (const unsigned char *)data;
+	while(size > 0) {
+		if(s->cur == s->end) {
+			jo_flush(s);
+		}
+		int n = (int)(s->end - s->cur) < size ? (int)(s->end - s->cur) : size;
+		memcpy(s->cur, p, n);
+		s->cur += n;
+		p += n;
+		size -= n;
+	}
+}
+
+static void jo_putc(jo_stream *s, unsigned char c) {
+	if(s->cur == s->end) {
+		jo_flush(s);
+	}
+	*s->cur++ = c;
+}
+
+#ifdef JO_JPEG_BYTE_WRITER
+// The 1.52 writer, kept to measure the word writer against: every byte goes out through a
+// call of its own, as it did through putc. Define JO_JPEG_BYTE_WRITER to build with it
+static void jo_writeByte(jo_stream *s, unsigned char c) {
+	jo_flush(s);
+	s->func(s->context, &c, 1);
+}
+
+static void jo_writeBits(jo_stream *s, const unsigned short *bs) {
+	s->bitBuf = (s->bitBuf << bs[1]) | bs[0];
+	s->bitCnt += bs[1];
+	while(s->bitCnt >= 8) {
+		s->bitCnt -= 8;
+		unsigned char c = (unsigned char)(s->bitBuf >> s->bitCnt);
+		jo_writeByte(s, c);
+		if(c == 255) {
+			jo_writeByte(s, 0);
+		}
+	}
+}
+#else
+// Emits a 32 bit word of entropy coded data, stuffing a 0 after every 0xFF byte
+static void jo_writeWord(jo_stream *s, unsigned int w) {
+	if(s->end - s->cur < 8) {
+		jo_flush(s);
+	}
+	unsigned char *p = s->cur;
+	p[0] = (unsigned char)(w >> 24);
+	p[1] = (unsigned char)(w >> 16);
+	p[2] = (unsigned char)(w >> 8);
+	p[3] = (unsigned char)w;
+	// Fast path: no byte of the word is 0xFF (standard "has zero byte" test on ~w)
+	if(!((~w - 0x01010101u) & w & 0x80808080u)) {
+		s->cur = p + 4;
+		return;
+	}
+	for(int i = 24; i >= 0; i -= 8) {
+		unsigned char c = (unsigned char)(w >> i);
+		*p++ = c;
+		if(c == 255) {
+			*p++ = 0;
+		}
+	}
+	s->cur = p;
+}
+
+static void jo_writeBits(jo_stream *s, const unsigned short *bs) {
+	s->bitBuf = (s->bitBuf << bs[1]) | bs[0];
+	s->bitCnt += bs[1];
+	if(s->bitCnt >= 32) {
+		s->bitCnt -= 32;
+		jo_writeWord(s, (unsigned int)(s->bitBuf >> s->bitCnt));
+	}
+}
+#endif
+
+// Pads the entropy coded data with 1s up to a byte boundary and writes out what is left
+static void jo_flushBits(jo_stream *s) {
+	static const unsigned short fillBits[] = {0x7F, 7};
+	jo_writeBits(s, fillBits);
+	while(s->bitCnt >= 8) {
+		s->bitCnt -= 8;
+		unsigned char c = (unsigned char)(s->bitBuf >> s->bitCnt);
+		jo_putc(s, c);
 		if(c == 255) {
-			putc(0, fp);
+			jo_putc(s, 0);
+		}
+	}
+	s->bitBuf = 0;
+	s->bitCnt = 0;
+}
+
+struct jo_memBuffer {
+	unsigned char *data;
+	int size, capacity;
+	bool failed;
+};
+
+static void jo_writeMem(void *context, const void *data, int size) {
+	jo_memBuffer *mem = (jo_memBuffer *)context;
+	if(mem->failed) {
+		return;
+	}
+	if(mem->size + size > mem->capacity) {
+		int capacity = mem->capacity ? mem->capacity : 64*1024;
+		while(capacity < mem->size + size) {
+			capacity *= 2;
 		}
-		bitBuf <<= 8;
-		bitCnt -= 8;
+		unsigned char *grown = (unsigned char *)realloc(mem->data, capacity);
+		if(!grown) {
+			mem->failed = true;
+			return;
+		}
+		mem->data = grown;
+		mem->capacity = capacity;
 	}
+	memcpy(mem->data + mem->size, data, size);
+	mem->size += size;
 }
 
 static void jo_DCT(float &d0, float &d1, float &d2, float &d3, float &d4, float &d5, float &d6, float &d7) {
@@ -110,10 +299,18 @@ static void jo_calcBits(int val, unsigned short bits[2]) {
 	bits[0] = val & ((1<<bits[1])-1);
 }
 
-static int jo_processDU(FILE *fp, int &bitBuf, int &bitCnt, float *CDU, float *fdtbl, int DC, const unsigned short HTDC[256][2], const unsigned short HTAC[256][2]) {
-	const unsigned short EOB[2] = { HTAC[0x00][0], HTAC[0x00][1] };
-	const unsigned short M16zeroes[2] = { HTAC[0xF0][0], HTAC[0xF0][1] };
+// Color conversion of 64 pixels
+static void jo_colorConvert_scalar(const float *R, const float *G, const float *B, float *YDU, float *UDU, float *VDU) {
+	for(int i = 0; i < 64; ++i) {
+		float r = R[i], g = G[i], b = B[i];
+		YDU[i]=+0.29900f*r+0.58700f*g+0.11400f*b-128;
+		UDU[i]=-0.16874f*r-0.33126f*g+0.50000f*b;
+		VDU[i]=+0.50000f*r-0.41869f*g-0.08131f*b;
+	}
+}
 
+// DCT, quantize/descale and zigzag of one 8x8 block. CDU is used as scratch space
+static void jo_fdctQuant_scalar(float *CDU, const float *fdtbl, int *DU) {
 	// DCT rows
 	for(int dataOff=0; dataOff<64; dataOff+=8) {
 		jo_DCT(CDU[dataOff], CDU[dataOff+1], CDU[dataOff+2], CDU[dataOff+3], CDU[dataOff+4], CDU[dataOff+5], CDU[dataOff+6], CDU[dataOff+7]);
@@ -123,21 +320,258 @@ static int jo_processDU(FILE *fp, int &bitBuf, int &bitCnt, float *CDU, float *f
 		jo_DCT(CDU[dataOff], CDU[dataOff+8], CDU[dataOff+16], CDU[dataOff+24], CDU[dataOff+32], CDU[dataOff+40], CDU[dataOff+48], CDU[dataOff+56]);
 	}
 	// Quantize/descale/zigzag the coefficients
-	int DU[64];
 	for(int i=0; i<64; ++i) {
 		float v = CDU[i]*fdtbl[i];
 		DU[s_jo_ZigZag[i]] = (int)(v < 0 ? ceilf(v - 0.5f) : floorf(v + 0.5f));
 	}
+}
+
+#ifdef JO_JPEG_SIMD
+// The vector kernels do the same float operations in the same order as the scalar ones, so the output is identical.
+
+static void jo_colorConvert_sse2(const float *R, const float *G, const float *B, float *YDU, float *UDU, float *VDU) {
+	const __m128 yr = _mm_set1_ps(0.29900f), yg = _mm_set1_ps(0.58700f), yb = _mm_set1_ps(0.11400f), c128 = _mm_set1_ps(128.f);
+	const __m128 ur = _mm_set1_ps(-0.16874f), ug = _mm_set1_ps(0.33126f), ub = _mm_set1_ps(0.50000f);
+	const __m128 vr = _mm_set1_ps(0.50000f), vg = _mm_set1_ps(0.41869f), vb = _mm_set1_ps(0.08131f);
+	for(int i = 0; i < 64; i += 4) {
+		__m128 r = _mm_loadu_ps(R+i), g = _mm_loadu_ps(G+i), b = _mm_loadu_ps(B+i);
+		_mm_storeu_ps(YDU+i, _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(yr, r), _mm_mul_ps(yg, g)), _mm_mul_ps(yb, b)), c128));
+		_mm_storeu_ps(UDU+i, _mm_add_ps(_mm_sub_ps(_mm_mul_ps(ur, r), _mm_mul_ps(ug, g)), _mm_mul_ps(ub, b)));
+		_mm_storeu_ps(VDU+i, _mm_sub_ps(_mm_sub_ps(_mm_mul_ps(vr, r), _mm_mul_ps(vg, g)), _mm_mul_ps(vb, b)));
+	}
+}
+
+// jo_DCT on 4 lanes
+static void jo_DCT_sse2(__m128 &d0, __m128 &d1, __m128 &d2, __m128 &d3, __m128 &d4, __m128 &d5, __m128 &d6, __m128 &d7) {
+	__m128 tmp0 = _mm_add_ps(d0, d7);
+	__m128 tmp7 = _mm_sub_ps(d0, d7);
+	__m128 tmp1 = _mm_add_ps(d1, d6);
+	__m128 tmp6 = _mm_sub_ps(d1, d6);
+	__m128 tmp2 = _mm_add_ps(d2, d5);
+	__m128 tmp5 = _mm_sub_ps(d2, d5);
+	__m128 tmp3 = _mm_add_ps(d3, d4);
+	__m128 tmp4 = _mm_sub_ps(d3, d4);
+
+	// Even part
+	__m128 tmp10 = _mm_add_ps(tmp0, tmp3);
+	__m128 tmp13 = _mm_sub_ps(tmp0, tmp3);
+	__m128 tmp11 = _mm_add_ps(tmp1, tmp2);
+	__m128 tmp12 = _mm_sub_ps(tmp1, tmp2);
+
+	d0 = _mm_add_ps(tmp10, tmp11);
+	d4 = _mm_sub_ps(tmp10, tmp11);
+
+	__m128 z1 = _mm_mul_ps(_mm_add_ps(tmp12, tmp13), _mm_set1_ps(0.707106781f));
+	d2 = _mm_add_ps(tmp13, z1);
+	d6 = _mm_sub_ps(tmp13, z1);
+
+	// Odd part
+	tmp10 = _mm_add_ps(tmp4, tmp5);
+	tmp11 = _mm_add_ps(tmp5, tmp6);
+	tmp12 = _mm_add_ps(tmp6, tmp7);
+
+	__m128 z5 = _mm_mul_ps(_mm_sub_ps(tmp10, tmp12), _mm_set1_ps(0.382683433f));
+	__m128 z2 = _mm_add_ps(_mm_mul_ps(tmp10, _mm_set1_ps(0.541196100f)), z5);
+	__m128 z4 = _mm_add_ps(_mm_mul_ps(tmp12, _mm_set1_ps(1.306562965f)), z5);
+	__m128 z3 = _mm_mul_ps(tmp11, _mm_set1_ps(0.707106781f));
+
+	__m128 z11 = _mm_add_ps(tmp7, z3);
+	__m128 z13 = _mm_sub_ps(tmp7, z3);
+
+	d5 = _mm_add_ps(z13, z2);
+	d3 = _mm_sub_ps(z13, z2);
+	d1 = _mm_add_ps(z11, z4);
+	d7 = _mm_sub_ps(z11, z4);
+}
+
+// Rounds half away from zero like the scalar ceilf/floorf pair: truncate |v|+0.5, then restore the sign
+static __m128i jo_quantize_sse2(__m128 c, const float *fdtbl) {
+	__m128 v = _mm_mul_ps(c, _mm_loadu_ps(fdtbl));
+	__m128i sign = _mm_srai_epi32(_mm_castps_si128(v), 31);
+	__m128i q = _mm_cvttps_epi32(_mm_add_ps(_mm_andnot_ps(_mm_set1_ps(-0.f), v), _mm_set1_ps(0.5f)));
+	return _mm_sub_epi32(_mm_xor_si128(q, sign), sign);
+}
+
+static void jo_fdctQuant_sse2(float *CDU, const float *fdtbl, int *DU) {
+	// Each row is held as two halves, columns 0-3 in l and 4-7 in h
+	__m128 l[8], h[8];
+	for(int i = 0; i < 8; ++i) {
+		l[i] = _mm_loadu_ps(CDU+i*8);
+		h[i] = _mm_loadu_ps(CDU+i*8+4);
+	}
+	// DCT rows, 4 rows at a time after transposing them into columns
+	for(int i = 0; i < 8; i += 4) {
+		_MM_TRANSPOSE4_PS(l[i], l[i+1], l[i+2], l[i+3]);
+		_MM_TRANSPOSE4_PS(h[i], h[i+1], h[i+2], h[i+3]);
+		jo_DCT_sse2(l[i], l[i+1], l[i+2], l[i+3], h[i], h[i+1], h[i+2], h[i+3]);
+		_MM_TRANSPOSE4_PS(l[i], l[i+1], l[i+2], l[i+3]);
+		_MM_TRANSPOSE4_PS(h[i], h[i+1], h[i+2], h[i+3]);
+	}
+	// DCT columns
+	jo_DCT_sse2(l[0], l[1], l[2], l[3], l[4], l[5], l[6], l[7]);
+	jo_DCT_sse2(h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7]);
+	// Quantize/descale/zigzag the coefficients
+	int Q[64];
+	for(int i = 0; i < 8; ++i) {
+		_mm_storeu_si128((__m128i *)(Q+i*8), jo_quantize_sse2(l[i], fdtbl+i*8));
+		_mm_storeu_si128((__m128i *)(Q+i*8+4), jo_quantize_sse2(h[i], fdtbl+i*8+4));
+	}
+	for(int i = 0; i < 64; ++i) {
+		DU[s_jo_ZigZag[i]] = Q[i];
+	}
+}
+
+JO_TARGET_AVX static void jo_colorConvert_avx(const float *R, const float *G, const float *B, float *YDU, float *UDU, float *VDU) {
+	const __m256 yr = _mm256_set1_ps(0.29900f), yg = _mm256_set1_ps(0.58700f), yb = _mm256_set1_ps(0.11400f), c128 = _mm256_set1_ps(128.f);
+	const __m256 ur = _mm256_set1_ps(-0.16874f), ug = _mm256_set1_ps(0.33126f), ub = _mm256_set1_ps(0.50000f);
+	const __m256 vr = _mm256_set1_ps(0.50000f), vg = _mm256_set1_ps(0.41869f), vb = _mm256_set1_ps(0.08131f);
+	for(int i = 0; i < 64; i += 8) {
+		__m256 r = _mm256_loadu_ps(R+i), g = _mm256_loadu_ps(G+i), b = _mm256_loadu_ps(B+i);
+		_mm256_storeu_ps(YDU+i, _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(yr, r), _mm256_mul_ps(yg, g)), _mm256_mul_ps(yb, b)), c128));
+		_mm256_storeu_ps(UDU+i, _mm256_add_ps(_mm256_sub_ps(_mm256_mul_ps(ur, r), _mm256_mul_ps(ug, g)), _mm256_mul_ps(ub, b)));
+		_mm256_storeu_ps(VDU+i, _mm256_sub_ps(_mm256_sub_ps(_mm256_mul_ps(vr, r), _mm256_mul_ps(vg, g)), _mm256_mul_ps(vb, b)));
+	}
+}
+
+// jo_DCT on 8 lanes
+JO_TARGET_AVX static void jo_DCT_avx(__m256 *d) {
+	__m256 tmp0 = _mm256_add_ps(d[0], d[7]);
+	__m256 tmp7 = _mm256_sub_ps(d[0], d[7]);
+	__m256 tmp1 = _mm256_add_ps(d[1], d[6]);
+	__m256 tmp6 = _mm256_sub_ps(d[1], d[6]);
+	__m256 tmp2 = _mm256_add_ps(d[2], d[5]);
+	__m256 tmp5 = _mm256_sub_ps(d[2], d[5]);
+	__m256 tmp3 = _mm256_add_ps(d[3], d[4]);
+	__m256 tmp4 = _mm256_sub_ps(d[3], d[4]);
+
+	// Even part
+	__m256 tmp10 = _mm256_add_ps(tmp0, tmp3);
+	__m256 tmp13 = _mm256_sub_ps(tmp0, tmp3);
+	__m256 tmp11 = _mm256_add_ps(tmp1, tmp2);
+	__m256 tmp12 = _mm256_sub_ps(tmp1, tmp2);
+
+	d[0] = _mm256_add_ps(tmp10, tmp11);
+	d[4] = _mm256_sub_ps(tmp10, tmp11);
+
+	__m256 z1 = _mm256_mul_ps(_mm256_add_ps(tmp12, tmp13), _mm256_set1_ps(0.707106781f));
+	d[2] = _mm256_add_ps(tmp13, z1);
+	d[6] = _mm256_sub_ps(tmp13, z1);
+
+	// Odd part
+	tmp10 = _mm256_add_ps(tmp4, tmp5);
+	tmp11 = _mm256_add_ps(tmp5, tmp6);
+	tmp12 = _mm256_add_ps(tmp6, tmp7);
+
+	__m256 z5 = _mm256_mul_ps(_mm256_sub_ps(tmp10, tmp12), _mm256_set1_ps(0.382683433f));
+	__m256 z2 = _mm256_add_ps(_mm256_mul_ps(tmp10, _mm256_set1_ps(0.541196100f)), z5);
+	__m256 z4 = _mm256_add_ps(_mm256_mul_ps(tmp12, _mm256_set1_ps(1.306562965f)), z5);
+	__m256 z3 = _mm256_mul_ps(tmp11, _mm256_set1_ps(0.707106781f));
+
+	__m256 z11 = _mm256_add_ps(tmp7, z3);
+	__m256 z13 = _mm256_sub_ps(tmp7, z3);
+
+	d[5] = _mm256_add_ps(z13, z2);
+	d[3] = _mm256_sub_ps(z13, z2);
+	d[1] = _mm256_add_ps(z11, z4);
+	d[7] = _mm256_sub_ps(z11, z4);
+}
+
+JO_TARGET_AVX static void jo_transpose_avx(__m256 *r) {
+	__m256 t0 = _mm256_unpacklo_ps(r[0], r[1]), t1 = _mm256_unpackhi_ps(r[0], r[1]);
+	__m256 t2 = _mm256_unpacklo_ps(r[2], r[3]), t3 = _mm256_unpackhi_ps(r[2], r[3]);
+	__m256 t4 = _mm256_unpacklo_ps(r[4], r[5]), t5 = _mm256_unpackhi_ps(r[4], r[5]);
+	__m256 t6 = _mm256_unpacklo_ps(r[6], r[7]), t7 = _mm256_unpackhi_ps(r[6], r[7]);
+	__m256 s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1,0,1,0)), s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3,2,3,2));
+	__m256 s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1,0,1,0)), s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3,2,3,2));
+	__m256 s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1,0,1,0)), s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3,2,3,2));
+	__m256 s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1,0,1,0)), s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3,2,3,2));
+	r[0] = _mm256_permute2f128_ps(s0, s4, 0x20);
+	r[1] = _mm256_permute2f128_ps(s1, s5, 0x20);
+	r[2] = _mm256_permute2f128_ps(s2, s6, 0x20);
+	r[3] = _mm256_permute2f128_ps(s3, s7, 0x20);
+	r[4] = _mm256_permute2f128_ps(s0, s4, 0x31);
+	r[5] = _mm256_permute2f128_ps(s1, s5, 0x31);
+	r[6] = _mm256_permute2f128_ps(s2, s6, 0x31);
+	r[7] = _mm256_permute2f128_ps(s3, s7, 0x31);
+}
+
+JO_TARGET_AVX static void jo_fdctQuant_avx(float *CDU, const float *fdtbl, int *DU) {
+	__m256 r[8];
+	for(int i = 0; i < 8; ++i) {
+		r[i] = _mm256_loadu_ps(CDU+i*8);
+	}
+	// DCT rows, all 8 at once after transposing them into columns
+	jo_transpose_avx(r);
+	jo_DCT_avx(r);
+	jo_transpose_avx(r);
+	// DCT columns
+	jo_DCT_avx(r);
+	// Quantize/descale/zigzag the coefficients, rounding half away from zero
+	const __m256 signMask = _mm256_set1_ps(-0.f), half = _mm256_set1_ps(0.5f);
+	int Q[64];
+	for(int i = 0; i < 8; ++i) {
+		__m256 v = _mm256_mul_ps(r[i], _mm256_loadu_ps(fdtbl+i*8));
+		__m256 a = _mm256_round_ps(_mm256_add_ps(_mm256_andnot_ps(signMask, v), half), _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+		_mm256_storeu_si256((__m256i *)(Q+i*8), _mm256_cvttps_epi32(_mm256_or_ps(a, _mm256_and_ps(v, signMask))));
+	}
+	for(int i = 0; i < 64; ++i) {
+		DU[s_jo_ZigZag[i]] = Q[i];
+	}
+}
+
+// 0 = scalar, 1 = SSE2, 2 = AVX (including OS support for the YMM state)
+static int jo_cpuLevel() {
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	bool sse2 = (info[3] & (1<<26)) != 0;
+	bool avx = (info[2] & (1<<27)) && (info[2] & (1<<28)) && (_xgetbv(0) & 6) == 6;
+#else
+	__builtin_cpu_init();
+	bool sse2 = __builtin_cpu_supports("sse2") != 0;
+	bool avx = __builtin_cpu_supports("avx") != 0;
+#endif
+	return avx ? 2 : sse2 ? 1 : 0;
+}
+#endif // JO_JPEG_SIMD
+
+typedef void jo_colorConvertFunc(const float *R, const float *G, const float *B, float *YDU, float *UDU, float *VDU);
+typedef void jo_fdctQuantFunc(float *CDU, const float *fdtbl, int *DU);
+
+static jo_colorConvertFunc *s_jo_colorConvert = 0;
+static jo_fdctQuantFunc *s_jo_fdctQuant = 0;
+
+// Picks the kernels for this CPU. Racing callers all store the same values
+static void jo_selectKernels() {
+	if(s_jo_fdctQuant) {
+		return;
+	}
+	jo_colorConvertFunc *colorConvert = jo_colorConvert_scalar;
+	jo_fdctQuantFunc *fdctQuant = jo_fdctQuant_scalar;
+#ifdef JO_JPEG_SIMD
+	switch(jo_cpuLevel()) {
+	case 2: colorConvert = jo_colorConvert_avx; fdctQuant = jo_fdctQuant_avx; break;
+	case 1: colorConvert = jo_colorConvert_sse2; fdctQuant = jo_fdctQuant_sse2; break;
+	}
+#endif
+	s_jo_colorConvert = colorConvert;
+	s_jo_fdctQuant = fdctQuant;
+}
+
+// Entropy codes a quantized block. Returns its DC, the prediction for the next block of the component
+static int jo_encodeDU(jo_stream *fp, const int *DU, int DC, const unsigned short HTDC[256][2], const unsigned short HTAC[256][2]) {
+	const unsigned short EOB[2] = { HTAC[0x00][0], HTAC[0x00][1] };
+	const unsigned short M16zeroes[2] = { HTAC[0xF0][0], HTAC[0xF0][1] };
 
 	// Encode DC
 	int diff = DU[0] - DC; 
 	if (diff == 0) {
-		jo_writeBits(fp, bitBuf, bitCnt, HTDC[0]);
+		jo_writeBits(fp, HTDC[0]);
 	} else {
 		unsigned short bits[2];
 		jo_calcBits(diff, bits);
-		jo_writeBits(fp, bitBuf, bitCnt, HTDC[bits[1]]);
-		jo_writeBits(fp, bitBuf, bitCnt, bits);
+		jo_writeBits(fp, HTDC[bits[1]]);
+		jo_writeBits(fp, bits);
 	}
 	// Encode ACs
 	int end0pos = 63;
@@ -145,7 +579,7 @@ static int jo_processDU(FILE *fp, int &bitBuf, int &bitCnt, float *CDU, float *f
 	}
 	// end0pos = first element in reverse order !=0
 	if(end0pos == 0) {
-		jo_writeBits(fp, bitBuf, bitCnt, EOB);
+		jo_writeBits(fp, EOB);
 		return DU[0];
 	}
 	for(int i = 1; i <= end0pos; ++i) {
@@ -156,21 +590,522 @@ static int jo_processDU(FILE *fp, int &bitBuf, int &bitCnt, float *CDU, float *f
 		if ( nrzeroes >= 16 ) {
 			int lng = nrzeroes>>4;
 			for (int nrmarker=1; nrmarker <= lng; ++nrmarker)
-				jo_writeBits(fp, bitBuf, bitCnt, M16zeroes);
+				jo_writeBits(fp, M16zeroes);
 			nrzeroes &= 15;
 		}
 		unsigned short bits[2];
 		jo_calcBits(DU[i], bits);
-		jo_writeBits(fp, bitBuf, bitCnt, HTAC[(nrzeroes<<4)+bits[1]]);
-		jo_writeBits(fp, bitBuf, bitCnt, bits);
+		jo_writeBits(fp, HTAC[(nrzeroes<<4)+bits[1]]);
+		jo_writeBits(fp, bits);
 	}
 	if(end0pos != 63) {
-		jo_writeBits(fp, bitBuf, bitCnt, EOB);
+		jo_writeBits(fp, EOB);
 	}
 	return DU[0];
 }
 
-bool jo_write_jpg(const char *filename, const void *data, int width, int height, int comp, int quality) {
+// Counts the symbols jo_encodeDU emits for a block instead of writing them
+static int jo_countDU(const int *DU, int DC, unsigned int *dcFreq, unsigned int *acFreq) {
+	unsigned short bits[2];
+	int diff = DU[0] - DC;
+	if (diff == 0) {
+		++dcFreq[0];
+	} else {
+		jo_calcBits(diff, bits);
+		++dcFreq[bits[1]];
+	}
+	int end0pos = 63;
+	for(; (end0pos>0)&&(DU[end0pos]==0); --end0pos) {
+	}
+	if(end0pos == 0) {
+		++acFreq[0x00];
+		return DU[0];
+	}
+	for(int i = 1; i <= end0pos; ++i) {
+		int startpos = i;
+		for (; DU[i]==0 && i<=end0pos; ++i) {
+		}
+		int nrzeroes = i-startpos;
+		if ( nrzeroes >= 16 ) {
+			acFreq[0xF0] += nrzeroes>>4;
+			nrzeroes &= 15;
+		}
+		jo_calcBits(DU[i], bits);
+		++acFreq[(nrzeroes<<4)+bits[1]];
+	}
+	if(end0pos != 63) {
+		++acFreq[0x00];
+	}
+	return DU[0];
+}
+
+// A Huffman table as stored in DHT (code counts per length in bits[1..16], symbols in code order), with its codes
+struct jo_huffTable {
+	unsigned char bits[17];
+	unsigned char vals[256];
+	unsigned short codes[256][2];
+};
+
+// Builds the optimal code for the symbol counts, limited to 16 bit codes (JPEG Annex K.2)
+static void jo_buildHuffTable(const unsigned int *count, jo_huffTable *t) {
+	unsigned int freq[257];
+	int codesize[257], others[257];
+	for(int i = 0; i < 257; ++i) {
+		freq[i] = i < 256 ? count[i] : 1; // symbol 256 reserves the all 1s code point
+		codesize[i] = 0;
+		others[i] = -1;
+	}
+	for(;;) {
+		// Merge the two least frequent trees, ties go to the larger symbol
+		int c1 = -1, c2 = -1;
+		unsigned int v = 0xFFFFFFFF;
+		for(int i = 0; i < 257; ++i) {
+			if(freq[i] && freq[i] <= v) {
+				v = freq[i];
+				c1 = i;
+			}
+		}
+		v = 0xFFFFFFFF;
+		for(int i = 0; i < 257; ++i) {
+			if(freq[i] && freq[i] <= v && i != c1) {
+				v = freq[i];
+				c2 = i;
+			}
+		}
+		if(c2 < 0) {
+			break;
+		}
+		freq[c1] += freq[c2];
+		freq[c2] = 0;
+		for(++codesize[c1]; others[c1] >= 0; ++codesize[c1]) {
+			c1 = others[c1];
+		}
+		others[c1] = c2;
+		for(++codesize[c2]; others[c2] >= 0; ++codesize[c2]) {
+			c2 = others[c2];
+		}
+	}
+	int bits[64] = {0};
+	for(int i = 0; i < 257; ++i) {
+		if(codesize[i]) {
+			++bits[codesize[i]];
+		}
+	}
+	// Move codes longer than 16 bits up the tree
+	for(int i = 63; i > 16; --i) {
+		while(bits[i] > 0) {
+			int j = i - 2;
+			while(bits[j] == 0) {
+				--j;
+			}
+			bits[i] -= 2;
+			bits[i-1]++;
+			bits[j+1] += 2;
+			bits[j]--;
+		}
+	}
+	// Drop the reserved code point, which is one of the longest codes
+	for(int i = 16; i > 0; --i) {
+		if(bits[i]) {
+			bits[i]--;
+			break;
+		}
+	}
+
+	t->bits[0] = 0;
+	for(int i = 1; i <= 16; ++i) {
+		t->bits[i] = (unsigned char)bits[i];
+	}
+	int nbVals = 0;
+	for(int len = 1; len < 64; ++len) {
+		for(int i = 0; i < 256; ++i) {
+			if(codesize[i] == len) {
+				t->vals[nbVals++] = (unsigned char)i;
+			}
+		}
+	}
+	// Canonical codes (JPEG Annex C)
+	memset(t->codes, 0, sizeof(t->codes));
+	for(int len = 1, k = 0, code = 0; len <= 16; ++len, code <<= 1) {
+		for(int n = 0; n < t->bits[len]; ++n, ++k, ++code) {
+			t->codes[t->vals[k]][0] = (unsigned short)code;
+			t->codes[t->vals[k]][1] = (unsigned short)len;
+		}
+	}
+}
+
+// One DHT segment holding nbTables tables. tableInfo is the class (0x00 DC, 0x10 AC) | id of each
+static void jo_writeDHT(jo_stream *fp, int nbTables, const unsigned char *tableInfo, const unsigned char **bits, const unsigned char **vals) {
+	int nbVals[4], length = 2;
+	for(int t = 0; t < nbTables; ++t) {
+		nbVals[t] = 0;
+		for(int i = 1; i <= 16; ++i) {
+			nbVals[t] += bits[t][i];
+		}
+		length += 17 + nbVals[t];
+	}
+	jo_putc(fp, 0xFF);
+	jo_putc(fp, 0xC4);
+	jo_putc(fp, (unsigned char)(length>>8));
+	jo_putc(fp, (unsigned char)(length&0xFF));
+	for(int t = 0; t < nbTables; ++t) {
+		jo_putc(fp, tableInfo[t]);
+		jo_write(fp, bits[t]+1, 16);
+		jo_write(fp, vals[t], nbVals[t]);
+	}
+}
+
+// Symbol counts gathered by the first pass, per band so bands can be counted in parallel
+enum { JO_YDC, JO_YAC, JO_UVDC, JO_UVAC };
+struct jo_bandFreqs {
+	unsigned int freq[4][256];
+};
+
+// What a band of MCU rows needs to be encoded independently of the others
+struct jo_encoder {
+	const unsigned char *imageData;
+	int width, height, comp;
+	int hs, vs; // luminance blocks per MCU, horizontally and vertically
+	int mcusPerRow, bandHeight, nbBands; // bands are the restart intervals, or the whole image
+	float fdtbl_Y[64], fdtbl_UV[64];
+	const unsigned short (*YDC_HT)[2], (*YAC_HT)[2], (*UVDC_HT)[2], (*UVAC_HT)[2];
+	short *coefs; // quantized blocks in coding order, kept between the passes of the two pass mode
+	jo_bandFreqs *freqs;
+	jo_memBuffer *bandOut; // entropy coded bands of the parallel mode
+};
+
+// Fetches the 8x8 pixels at x,y, repeating the last row/column past the edges
+static void jo_loadBlock(const jo_encoder *enc, int x, int y, float *RDU, float *GDU, float *BDU) {
+	const unsigned char *imageData = enc->imageData;
+	int width = enc->width, height = enc->height, comp = enc->comp;
+	int ofsG = comp > 1 ? 1 : 0, ofsB = comp > 1 ? 2 : 0;
+	for(int row = y, pos = 0; row < y+8; ++row) {
+		for(int col = x; col < x+8; ++col, ++pos) {
+			int p = row*width*comp + col*comp;
+			if(row >= height) {
+				p -= width*comp*(row+1 - height);
+			}
+			if(col >= width) {
+				p -= comp*(col+1 - width);
+			}
+
+			RDU[pos] = imageData[p+0];
+			GDU[pos] = imageData[p+ofsG];
+			BDU[pos] = imageData[p+ofsB];
+		}
+	}
+}
+
+// Quantized blocks of the MCU at x,y: the luminance blocks in raster order, then Cb and Cr
+static void jo_quantizeMCU(const jo_encoder *enc, int x, int y, int DU[6][64]) {
+	int hs = enc->hs, vs = enc->vs;
+	float RDU[64], GDU[64], BDU[64];
+	float YDU[64], UDU[64], VDU[64];
+	if(hs == 1 && vs == 1) {
+		jo_loadBlock(enc, x, y, RDU, GDU, BDU);
+		s_jo_colorConvert(RDU, GDU, BDU, YDU, UDU, VDU);
+		s_jo_fdctQuant(YDU, enc->fdtbl_Y, DU[0]);
+		s_jo_fdctQuant(UDU, enc->fdtbl_UV, DU[1]);
+		s_jo_fdctQuant(VDU, enc->fdtbl_UV, DU[2]);
+		return;
+	}
+
+	// Chroma is summed into one block at the reduced resolution
+	float USUM[64] = {0}, VSUM[64] = {0};
+	for(int by = 0; by < vs; ++by) {
+		for(int bx = 0; bx < hs; ++bx) {
+			jo_loadBlock(enc, x + bx*8, y + by*8, RDU, GDU, BDU);
+			s_jo_colorConvert(RDU, GDU, BDU, YDU, UDU, VDU);
+			s_jo_fdctQuant(YDU, enc->fdtbl_Y, DU[by*hs + bx]);
+
+			int ofs = by*(8/vs)*8 + bx*(8/hs);
+			for(int row = 0; row < 8; ++row) {
+				for(int col = 0; col < 8; ++col) {
+					int d = ofs + (row/vs)*8 + col/hs;
+					USUM[d] += UDU[row*8+col];
+					VSUM[d] += VDU[row*8+col];
+				}
+			}
+		}
+	}
+	float scale = 1.f / (hs*vs);
+	for(int i = 0; i < 64; ++i) {
+		USUM[i] *= scale;
+		VSUM[i] *= scale;
+	}
+	s_jo_fdctQuant(USUM, enc->fdtbl_UV, DU[hs*vs]);
+	s_jo_fdctQuant(VSUM, enc->fdtbl_UV, DU[hs*vs+1]);
+}
+
+static void jo_bandRows(const jo_encoder *enc, int band, int &yBegin, int &yEnd) {
+	yBegin = band * enc->bandHeight;
+	yEnd = yBegin + enc->bandHeight < enc->height ? yBegin + enc->bandHeight : enc->height;
+}
+
+// Where the blocks of a band start in enc->coefs
+static size_t jo_bandCoefs(const jo_encoder *enc, int band) {
+	return (size_t)band * (enc->bandHeight / (8*enc->vs)) * enc->mcusPerRow * (enc->hs*enc->vs + 2) * 64;
+}
+
+// First pass of the two pass and progressive modes: quantizes a band into enc->coefs, and counts its baseline symbols when there are enc->freqs
+static void jo_countBand(const jo_encoder *enc, int band) {
+	int yBegin, yEnd;
+	jo_bandRows(enc, band, yBegin, yEnd);
+	int nbBlocks = enc->hs*enc->vs + 2;
+	short *coefs = enc->coefs + jo_bandCoefs(enc, band);
+	unsigned int (*freq)[256] = enc->freqs ? enc->freqs[band].freq : 0;
+	if(freq) {
+		memset(freq, 0, sizeof(enc->freqs[band].freq));
+	}
+	int DC[3] = {0, 0, 0};
+	for(int y = yBegin; y < yEnd; y += 8*enc->vs) {
+		for(int x = 0; x < enc->width; x += 8*enc->hs) {
+			int DU[6][64];
+			jo_quantizeMCU(enc, x, y, DU);
+			for(int b = 0; b < nbBlocks; ++b, coefs += 64) {
+				for(int i = 0; i < 64; ++i) {
+					coefs[i] = (short)DU[b][i];
+				}
+				int c = b < nbBlocks-2 ? 0 : b - (nbBlocks-3);
+				if(freq) {
+					DC[c] = jo_countDU(DU[b], DC[c], freq[c ? JO_UVDC : JO_YDC], freq[c ? JO_UVAC : JO_YAC]);
+				}
+			}
+		}
+	}
+}
+
+// Entropy codes a band, from enc->coefs in the two pass mode, with the DC predictors starting from 0
+static void jo_encodeBand(jo_stream *fp, const jo_encoder *enc, int band) {
+	int yBegin, yEnd;
+	jo_bandRows(enc, band, yBegin, yEnd);
+	int nbBlocks = enc->hs*enc->vs + 2;
+	const short *coefs = enc->coefs ? enc->coefs + jo_bandCoefs(enc, band) : 0;
+	int DC[3] = {0, 0, 0};
+	for(int y = yBegin; y < yEnd; y += 8*enc->vs) {
+		for(int x = 0; x < enc->width; x += 8*enc->hs) {
+			int DU[6][64];
+			if(coefs) {
+				for(int b = 0; b < nbBlocks; ++b, coefs += 64) {
+					for(int i = 0; i < 64; ++i) {
+						DU[b][i] = coefs[i];
+					}
+				}
+			} else {
+				jo_quantizeMCU(enc, x, y, DU);
+			}
+			for(int b = 0; b < nbBlocks; ++b) {
+				if(b < nbBlocks-2) {
+					DC[0] = jo_encodeDU(fp, DU[b], DC[0], enc->YDC_HT, enc->YAC_HT);
+				} else {
+					int c = b - (nbBlocks-3);
+					DC[c] = jo_encodeDU(fp, DU[b], DC[c], enc->UVDC_HT, enc->UVAC_HT);
+				}
+			}
+		}
+	}
+	jo_flushBits(fp);
+}
+
+static void jo_encodeBandToMem(const jo_encoder *enc, int band) {
+	jo_stream *stream = new jo_stream;
+	jo_initStream(stream, jo_writeMem, &enc->bandOut[band]);
+	jo_encodeBand(stream, enc, band);
+	jo_flush(stream);
+	delete stream;
+}
+
+typedef void jo_bandFunc(const jo_encoder *enc, int band);
+
+// Thread body for the parallel mode: takes bands off the shared counter until none are left
+static void jo_bandWorker(const jo_encoder *enc, jo_bandFunc *func, std::atomic<int> *nextBand) {
+	for(int band = (*nextBand)++; band < enc->nbBands; band = (*nextBand)++) {
+		func(enc, band);
+	}
+}
+
+// Runs func for every band on threads-1 threads started for the call, and the calling thread. There is no pool:
+// two-pass and progressive encodes start them twice, so callers size threads for the cores they really have
+static void jo_runBands(const jo_encoder *enc, int threads, jo_bandFunc *func) {
+	std::atomic<int> nextBand(0);
+	std::vector<std::thread> workers;
+	for(int i = 1; i < threads; ++i) {
+		try {
+			workers.push_back(std::thread(jo_bandWorker, enc, func, &nextBand));
+		} catch(...) {
+			break;
+		}
+	}
+	jo_bandWorker(enc, func, &nextBand);
+	for(size_t i = 0; i < workers.size(); ++i) {
+		workers[i].join();
+	}
+}
+
+// A scan of the progressive mode. DC scans cover all the components (interleaved), AC scans a single one
+struct jo_scan {
+	int comp; // 0 Y, 1 Cb, 2 Cr, -1 all
+	int Ss, Se, Ah, Al;
+};
+
+// A coarse DC image first, then the low luminance frequencies, the chrominance, the rest of the luminance and the last DC bit.
+// AC scans are full precision, so there is no AC refinement scan
+static const jo_scan s_jo_scans[] = { {-1,0,0,0,1}, {0,1,5,0,0}, {1,1,63,0,0}, {2,1,63,0,0}, {0,6,63,0,0}, {-1,0,0,1,0} };
+
+// Stored coefficients of block bx,by of a component, in the component's own block grid
+static const short *jo_blockCoefs(const jo_encoder *enc, int c, int bx, int by) {
+	int nbBlocks = enc->hs*enc->vs + 2;
+	if(c) {
+		return enc->coefs + ((size_t)(by*enc->mcusPerRow + bx)*nbBlocks + nbBlocks-3 + c) * 64;
+	}
+	size_t mcu = (size_t)(by/enc->vs)*enc->mcusPerRow + bx/enc->hs;
+	return enc->coefs + (mcu*nbBlocks + (by%enc->vs)*enc->hs + bx%enc->hs) * 64;
+}
+
+// Writes a symbol, or only counts it while the scan is measured (no stream)
+static void jo_putSymbol(jo_stream *fp, unsigned int *freq, const unsigned short (*codes)[2], int symbol) {
+	if(fp) {
+		jo_writeBits(fp, codes[symbol]);
+	} else {
+		++freq[symbol];
+	}
+}
+
+// A run of blocks with no more coefficients in the band: EOBn symbol then the low n bits of the run
+static void jo_flushEOBRun(jo_stream *fp, unsigned int *freq, const unsigned short (*codes)[2], int &eobRun) {
+	if(eobRun == 0) {
+		return;
+	}
+	int nbits = 0;
+	while(eobRun >> (nbits+1)) {
+		++nbits;
+	}
+	jo_putSymbol(fp, freq, codes, nbits << 4);
+	if(fp && nbits) {
+		unsigned short bits[2] = { (unsigned short)(eobRun & ((1<<nbits)-1)), (unsigned short)nbits };
+		jo_writeBits(fp, bits);
+	}
+	eobRun = 0;
+}
+
+// Codes a progressive scan of enc->coefs with tables[0] for luminance and tables[1] for chrominance.
+// Without a stream it counts the symbols into freq[0] and freq[1] instead
+static void jo_encodeScan(jo_stream *fp, const jo_encoder *enc, const jo_scan *scan, unsigned int freq[2][256], const jo_huffTable *tables) {
+	int mcuRows = (enc->height + 8*enc->vs-1) / (8*enc->vs);
+	if(scan->Ss == 0) {
+		// DC, interleaved in MCU order
+		int nbBlocks = enc->hs*enc->vs + 2;
+		size_t nbMCUs = (size_t)mcuRows * enc->mcusPerRow;
+		const short *coefs = enc->coefs;
+		int DC[3] = {0, 0, 0};
+		for(size_t mcu = 0; mcu < nbMCUs; ++mcu) {
+			for(int b = 0; b < nbBlocks; ++b, coefs += 64) {
+				if(scan->Ah) {
+					// Refinement, the next bit of every DC as is
+					if(fp) {
+						unsigned short bit[2] = { (unsigned short)((coefs[0] >> scan->Al) & 1), 1 };
+						jo_writeBits(fp, bit);
+					}
+					continue;
+				}
+				int c = b < nbBlocks-2 ? 0 : b - (nbBlocks-3), t = c ? 1 : 0;
+				int dc = coefs[0] >> scan->Al;
+				int diff = dc - DC[c];
+				DC[c] = dc;
+				unsigned short bits[2] = { 0, 0 };
+				if(diff) {
+					jo_calcBits(diff, bits);
+				}
+				jo_putSymbol(fp, freq[t], fp ? tables[t].codes : 0, bits[1]);
+				if(fp && bits[1]) {
+					jo_writeBits(fp, bits);
+				}
+			}
+		}
+	} else {
+		// AC band Ss..Se of one component, in the raster order of its blocks
+		int c = scan->comp, t = c ? 1 : 0;
+		int blocksX = c ? enc->mcusPerRow : (enc->width+7)/8, blocksY = c ? mcuRows : (enc->height+7)/8;
+		const unsigned short (*codes)[2] = fp ? tables[t].codes : 0;
+		int eobRun = 0;
+		for(int by = 0; by < blocksY; ++by) {
+			for(int bx = 0; bx < blocksX; ++bx) {
+				const short *DU = jo_blockCoefs(enc, c, bx, by);
+				int run = 0;
+				for(int k = scan->Ss; k <= scan->Se; ++k) {
+					if(DU[k] == 0) {
+						++run;
+						continue;
+					}
+					jo_flushEOBRun(fp, freq[t], codes, eobRun);
+					for(; run > 15; run -= 16) {
+						jo_putSymbol(fp, freq[t], codes, 0xF0);
+					}
+					unsigned short bits[2];
+					jo_calcBits(DU[k], bits);
+					jo_putSymbol(fp, freq[t], codes, (run<<4)+bits[1]);
+					if(fp) {
+						jo_writeBits(fp, bits);
+					}
+					run = 0;
+				}
+				if(run > 0 && ++eobRun == 0x7FFF) {
+					jo_flushEOBRun(fp, freq[t], codes, eobRun);
+				}
+			}
+		}
+		jo_flushEOBRun(fp, freq[t], codes, eobRun);
+	}
+	if(fp) {
+		jo_flushBits(fp);
+	}
+}
+
+// Measures a scan, then writes the tables built for it, its SOS header and its data
+static void jo_writeScan(jo_stream *fp, const jo_encoder *enc, const jo_scan *scan) {
+	unsigned int freq[2][256];
+	memset(freq, 0, sizeof(freq));
+	jo_huffTable tables[2];
+	if(scan->Ss != 0 || scan->Ah == 0) { // DC refinement bits are not Huffman coded
+		jo_encodeScan(0, enc, scan, freq, 0);
+		unsigned char tableInfo[2];
+		const unsigned char *bits[2], *vals[2];
+		int nbTables = 0;
+		for(int t = 0; t < 2; ++t) {
+			if(scan->comp < 0 || (scan->comp ? 1 : 0) == t) {
+				jo_buildHuffTable(freq[t], &tables[t]);
+				tableInfo[nbTables] = (unsigned char)((scan->Ss ? 0x10 : 0x00) | t);
+				bits[nbTables] = tables[t].bits;
+				vals[nbTables] = tables[t].vals;
+				++nbTables;
+			}
+		}
+		jo_writeDHT(fp, nbTables, tableInfo, bits, vals);
+	}
+
+	int nbComps = scan->comp < 0 ? 3 : 1;
+	unsigned char sos[14] = { 0xFF, 0xDA, 0, (unsigned char)(6 + 2*nbComps), (unsigned char)nbComps };
+	int length = 5;
+	for(int c = 0; c < 3; ++c) {
+		if(scan->comp < 0 || scan->comp == c) {
+			sos[length++] = (unsigned char)(c+1);
+			sos[length++] = c ? 0x11 : 0x00;
+		}
+	}
+	sos[length++] = (unsigned char)scan->Ss;
+	sos[length++] = (unsigned char)scan->Se;
+	sos[length++] = (unsigned char)((scan->Ah<<4) | scan->Al);
+	jo_write(fp, sos, length);
+	jo_encodeScan(fp, enc, scan, freq, tables);
+}
+
+bool jo_write_jpg_to_func(jo_write_func *func, void *context, const void *data, int width, int height, int comp, int quality) {
+	jo_jpg_options options = {};
+	options.quality = quality;
+	return jo_write_jpg_to_func_ex(func, context, data, width, height, comp, &options);
+}
+
+bool jo_write_jpg_to_func_ex(jo_write_func *func, void *context, const void *data, int width, int height, int comp, const jo_jpg_options *options) {
 	// Constants that don't pollute global namespace
 	static const unsigned char std_dc_luminance_nrcodes[] = {0,0,1,5,1,1,1,1,1,1,0,0,0,0,0,0,0};
 	static const unsigned char std_dc_luminance_values[] = {0,1,2,3,4,5,6,7,8,9,10,11};
@@ -239,15 +1174,31 @@ bool jo_write_jpg(const char *filename, const void *data, int width, int height,
 	static const int UVQT[] = {17,18,24,47,99,99,99,99,18,21,26,66,99,99,99,99,24,26,56,99,99,99,99,99,47,66,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99,99};
 	static const float aasf[] = { 1.0f * 2.828427125f, 1.387039845f * 2.828427125f, 1.306562965f * 2.828427125f, 1.175875602f * 2.828427125f, 1.0f * 2.828427125f, 0.785694958f * 2.828427125f, 0.541196100f * 2.828427125f, 0.275899379f * 2.828427125f };
 
-	if(!data || !filename || !width || !height || comp > 4 || comp < 1 || comp == 2) {
+	if(!data || !func || !options || !width || !height || comp > 4 || comp < 1 || comp == 2) {
 		return false;
 	}
 
-	FILE *fp = fopen(filename, "wb");
-	if(!fp) {
-		return false;
-	}
+	jo_stream stream;
+	jo_stream *fp = &stream;
+	jo_initStream(fp, func, context);
+
+	jo_encoder enc;
+	enc.imageData = (const unsigned char *)data;
+	enc.width = width;
+	enc.height = height;
+	enc.comp = comp;
+	enc.hs = options->subsampling == JO_SUBSAMPLING_422 || options->subsampling == JO_SUBSAMPLING_420 ? 2 : 1;
+	enc.vs = options->subsampling == JO_SUBSAMPLING_420 ? 2 : 1;
+	enc.YDC_HT = YDC_HT;
+	enc.YAC_HT = YAC_HT;
+	enc.UVDC_HT = UVDC_HT;
+	enc.UVAC_HT = UVAC_HT;
+	enc.coefs = 0;
+	enc.freqs = 0;
+	enc.bandOut = 0;
+	float *fdtbl_Y = enc.fdtbl_Y, *fdtbl_UV = enc.fdtbl_UV;
 
+	int quality = options->quality;
 	quality = quality ? quality : 90;
 	quality = quality < 1 ? 1 : quality > 100 ? 100 : quality;
 	quality = quality < 50 ? 5000 / quality : 200 - quality * 2;
@@ -260,7 +1211,6 @@ bool jo_write_jpg(const char *filename, const void *data, int width, int height,
 		UVTable[s_jo_ZigZag[i]] = uvti < 1 ? 1 : uvti > 255 ? 255 : uvti;
 	}
 
-	float fdtbl_Y[64], fdtbl_UV[64];
 	for(int row = 0, k = 0; row < 8; ++row) {
 		for(int col = 0; col < 8; ++col, ++k) {
 			fdtbl_Y[k]  = 1 / (YTable [s_jo_ZigZag[k]] * aasf[row] * aasf[col]);
@@ -268,68 +1218,166 @@ bool jo_write_jpg(const char *filename, const void *data, int width, int height,
 		}
 	}
 
+	// Restart intervals. Each one is entropy coded on its own, which is what lets bands be encoded in parallel
+	int mcuRows = (height + 8*enc.vs-1) / (8*enc.vs), mcusPerRow = (width + 8*enc.hs-1) / (8*enc.hs);
+	int threads = options->threads > 1 ? options->threads : 1;
+	int restartRows = options->restartRows;
+	if(restartRows <= 0 && threads > 1) {
+		restartRows = (mcuRows + threads*2 - 1) / (threads*2);
+	}
+	if(restartRows * mcusPerRow > 65535) {
+		restartRows = 65535 / mcusPerRow;
+	}
+	if(restartRows >= mcuRows) {
+		restartRows = 0;
+	}
+	enc.mcusPerRow = mcusPerRow;
+	enc.bandHeight = (restartRows > 0 ? restartRows : mcuRows) * 8*enc.vs;
+	enc.nbBands = restartRows > 0 ? (mcuRows + restartRows - 1) / restartRows : 1;
+	if(threads > enc.nbBands) {
+		threads = enc.nbBands;
+	}
+
+	jo_selectKernels();
+
+	// Two pass and progressive modes: quantize everything first. The two pass mode counts the symbols
+	// along the way, then builds the tables the image actually needs. Progressive scans measure themselves
+	const bool progressive = options->progressive;
+	const unsigned char *bits[4] = { std_dc_luminance_nrcodes, std_ac_luminance_nrcodes, std_dc_chrominance_nrcodes, std_ac_chrominance_nrcodes };
+	const unsigned char *vals[4] = { std_dc_luminance_values, std_ac_luminance_values, std_dc_chrominance_values, std_ac_chrominance_values };
+	std::vector<short> coefs;
+	std::vector<jo_bandFreqs> freqs;
+	jo_huffTable tables[4];
+	if(options->optimizeHuffman || progressive) {
+		try {
+			coefs.resize((size_t)mcuRows * mcusPerRow * (enc.hs*enc.vs + 2) * 64);
+			if(!progressive) {
+				freqs.resize(enc.nbBands);
+			}
+		} catch(...) {
+			return false;
+		}
+		enc.coefs = &coefs[0];
+		enc.freqs = progressive ? 0 : &freqs[0];
+		jo_runBands(&enc, threads, jo_countBand);
+	}
+	if(enc.freqs) {
+		for(int t = 0; t < 4; ++t) {
+			unsigned int total[256] = {0};
+			for(int band = 0; band < enc.nbBands; ++band) {
+				for(int i = 0; i < 256; ++i) {
+					total[i] += freqs[band].freq[t][i];
+				}
+			}
+			jo_buildHuffTable(total, &tables[t]);
+			bits[t] = tables[t].bits;
+			vals[t] = tables[t].vals;
+		}
+		enc.YDC_HT = tables[JO_YDC].codes;
+		enc.YAC_HT = tables[JO_YAC].codes;
+		enc.UVDC_HT = tables[JO_UVDC].codes;
+		enc.UVAC_HT = tables[JO_UVAC].codes;
+	}
+
 	// Write Headers
 	static const unsigned char head0[] = { 0xFF,0xD8,0xFF,0xE0,0,0x10,'J','F','I','F',0,1,1,0,0,1,0,1,0,0,0xFF,0xDB,0,0x84,0 };
-	fwrite(head0, sizeof(head0), 1, fp);
-	fwrite(YTable, sizeof(YTable), 1, fp);
-	putc(1, fp);
-	fwrite(UVTable, sizeof(UVTable), 1, fp);
-	const unsigned char head1[] = { 0xFF,0xC0,0,0x11,8,height>>8,height&0xFF,width>>8,width&0xFF,3,1,0x11,0,2,0x11,1,3,0x11,1,0xFF,0xC4,0x01,0xA2,0 };
-	fwrite(head1, sizeof(head1), 1, fp);
-	fwrite(std_dc_luminance_nrcodes+1, sizeof(std_dc_luminance_nrcodes)-1, 1, fp);
-	fwrite(std_dc_luminance_values, sizeof(std_dc_luminance_values), 1, fp);
-	putc(0x10, fp); // HTYACinfo
-	fwrite(std_ac_luminance_nrcodes+1, sizeof(std_ac_luminance_nrcodes)-1, 1, fp);
-	fwrite(std_ac_luminance_values, sizeof(std_ac_luminance_values), 1, fp);
-	putc(1, fp); // HTUDCinfo
-	fwrite(std_dc_chrominance_nrcodes+1, sizeof(std_dc_chrominance_nrcodes)-1, 1, fp);
-	fwrite(std_dc_chrominance_values, sizeof(std_dc_chrominance_values), 1, fp);
-	putc(0x11, fp); // HTUACinfo
-	fwrite(std_ac_chrominance_nrcodes+1, sizeof(std_ac_chrominance_nrcodes)-1, 1, fp);
-	fwrite(std_ac_chrominance_values, sizeof(std_ac_chrominance_values), 1, fp);
-	static const unsigned char head2[] = { 0xFF,0xDA,0,0xC,3,1,0,2,0x11,3,0x11,0,0x3F,0 };
-	fwrite(head2, sizeof(head2), 1, fp);
-
-	// Encode 8x8 macroblocks
-	const unsigned char *imageData = (const unsigned char *)data;
-	int DCY=0, DCU=0, DCV=0;
-	int bitBuf=0, bitCnt=0;
-	int ofsG = comp > 1 ? 1 : 0, ofsB = comp > 1 ? 2 : 0;
-	for(int y = 0; y < height; y += 8) {
-		for(int x = 0; x < width; x += 8) {
-			float YDU[64], UDU[64], VDU[64];
-			for(int row = y, pos = 0; row < y+8; ++row) {
-				for(int col = x; col < x+8; ++col, ++pos) {
-					int p = row*width*comp + col*comp;
-					if(row >= height) {
-						p -= width*comp*(row+1 - height);
-					}
-					if(col >= width) {
-						p -= comp*(col+1 - width);
-					}
+	jo_write(fp, head0, sizeof(head0));
+	jo_write(fp, YTable, sizeof(YTable));
+	jo_putc(fp, 1);
+	jo_write(fp, UVTable, sizeof(UVTable));
+	const unsigned char ySampling = (unsigned char)((enc.hs<<4) | enc.vs);
+	const unsigned char head1[] = { 0xFF,(unsigned char)(progressive ? 0xC2 : 0xC0),0,0x11,8,height>>8,height&0xFF,width>>8,width&0xFF,3,1,ySampling,0,2,0x11,1,3,0x11,1 };
+	jo_write(fp, head1, sizeof(head1));
+	if(progressive) {
+		for(size_t i = 0; i < sizeof(s_jo_scans)/sizeof(s_jo_scans[0]); ++i) {
+			jo_writeScan(fp, &enc, &s_jo_scans[i]);
+		}
+	} else {
+		static const unsigned char tableInfo[4] = { 0x00, 0x10, 0x01, 0x11 }; // HTYDCinfo, HTYACinfo, HTUDCinfo, HTUACinfo
+		jo_writeDHT(fp, 4, tableInfo, bits, vals);
+		if(restartRows > 0) {
+			int interval = restartRows * mcusPerRow;
+			const unsigned char dri[] = { 0xFF,0xDD,0,4,(unsigned char)(interval>>8),(unsigned char)(interval&0xFF) };
+			jo_write(fp, dri, sizeof(dri));
+		}
+		static const unsigned char head2[] = { 0xFF,0xDA,0,0xC,3,1,0,2,0x11,3,0x11,0,0x3F,0 };
+		jo_write(fp, head2, sizeof(head2));
 
-					float r = imageData[p+0], g = imageData[p+ofsG], b = imageData[p+ofsB];
-					YDU[pos]=+0.29900f*r+0.58700f*g+0.11400f*b-128;
-					UDU[pos]=-0.16874f*r-0.33126f*g+0.50000f*b;
-					VDU[pos]=+0.50000f*r-0.41869f*g-0.08131f*b;
+		// Encode 8x8 macroblocks
+		if(threads == 1) {
+			for(int band = 0; band < enc.nbBands; ++band) {
+				if(band) {
+					jo_putc(fp, 0xFF);
+					jo_putc(fp, 0xD0 + ((band-1) & 7)); // RSTn
 				}
+				jo_encodeBand(fp, &enc, band);
 			}
+		} else {
+			// Each band goes to its own buffer, then they are stitched together in order
+			jo_memBuffer empty = { 0, 0, 0, false };
+			std::vector<jo_memBuffer> bands(enc.nbBands, empty);
+			enc.bandOut = &bands[0];
+			jo_runBands(&enc, threads, jo_encodeBandToMem);
 
-			DCY = jo_processDU(fp, bitBuf, bitCnt, YDU, fdtbl_Y, DCY, YDC_HT, YAC_HT);
-			DCU = jo_processDU(fp, bitBuf, bitCnt, UDU, fdtbl_UV, DCU, UVDC_HT, UVAC_HT);
-			DCV = jo_processDU(fp, bitBuf, bitCnt, VDU, fdtbl_UV, DCV, UVDC_HT, UVAC_HT);
+			bool failed = false;
+			for(int band = 0; band < enc.nbBands; ++band) {
+				failed |= bands[band].failed;
+				if(!failed) {
+					if(band) {
+						jo_putc(fp, 0xFF);
+						jo_putc(fp, 0xD0 + ((band-1) & 7)); // RSTn
+					}
+					jo_write(fp, bands[band].data, bands[band].size);
+				}
+				free(bands[band].data);
+			}
+			if(failed) {
+				return false;
+			}
 		}
 	}
-	
-	// Do the bit alignment of the EOI marker
-	static const unsigned short fillBits[] = {0x7F, 7};
-	jo_writeBits(fp, bitBuf, bitCnt, fillBits);
 
 	// EOI
-	putc(0xFF, fp);
-	putc(0xD9, fp);
+	jo_putc(fp, 0xFF);
+	jo_putc(fp, 0xD9);
+	jo_flush(fp);
+	return true;
+}
+
+static void jo_writeFile(void *context, const void *data, int size) {
+	fwrite(data, size, 1, (FILE *)context);
+}
+
+bool jo_write_jpg(const char *filename, const void *data, int width, int height, int comp, int quality) {
+	if(!filename) {
+		return false;
+	}
+	FILE *fp = fopen(filename, "wb");
+	if(!fp) {
+		return false;
+	}
+	bool result = jo_write_jpg_to_func(jo_writeFile, fp, data, width, height, comp, quality);
+	fclose(fp);
+	return result;
+}
+
+bool jo_write_jpg_to_mem(unsigned char **out, int *outSize, const void *data, int width, int height, int comp, int quality) {
+	jo_jpg_options options = {};
+	options.quality = quality;
+	return jo_write_jpg_to_mem_ex(out, outSize, data, width, height, comp, &options);
+}
 
-   fclose(fp);
+bool jo_write_jpg_to_mem_ex(unsigned char **out, int *outSize, const void *data, int width, int height, int comp, const jo_jpg_options *options) {
+	if(!out || !outSize) {
+		return false;
+	}
+	jo_memBuffer mem = { 0, 0, 0, false };
+	if(!jo_write_jpg_to_func_ex(jo_writeMem, &mem, data, width, height, comp, options) || mem.failed) {
+		free(mem.data);
+		return false;
+	}
+	*out = mem.data;
+	*outSize = mem.size;
 	return true;
 }
 
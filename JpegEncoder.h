@@ -0,0 +1,10 @@
+/* Header for JpegEncoder.cpp
+ *
+ * Follows the recipe described at the top of JpegEncoder.cpp: only the
+ * declarations are pulled in, the implementation is compiled once from
+ * JpegEncoder.cpp itself.
+ * */
+
+#define JO_JPEG_HEADER_FILE_ONLY
+#include "JpegEncoder.cpp"
+#undef JO_JPEG_HEADER_FILE_ONLY
@@ -0,0 +1,126 @@
+/* 
+* Molecular Visualization HTTP Server
+* Copyright (C) 2011-2012 Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* aint with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+*/
+
+
+#pragma once
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+
+// ----------------------------------------------------------------------
+// Thread safe LRU cache bounded by a byte budget. Value::bytes() gives
+// the size of an entry. Values are shared, so an entry evicted while a
+// request still uses it stays alive until that request is done
+// ----------------------------------------------------------------------
+template<class Key, class Value>
+class LruCache
+{
+public:
+   explicit LruCache( const size_t budget ) : m_budget(budget), m_bytes(0), m_hits(0), m_misses(0), m_evictions(0) {}
+
+   void setBudget( const size_t budget )
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_budget = budget;
+      evict();
+   }
+
+   // Null on a miss
+   std::shared_ptr<const Value> find( const Key& key )
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      typename Index::iterator it = m_index.find(key);
+      if( it == m_index.end() )
+      {
+         ++m_misses;
+         return std::shared_ptr<const Value>();
+      }
+      ++m_hits;
+      m_entries.splice( m_entries.begin(), m_entries, it->second );
+      return it->second->second;
+   }
+
+   // Entries larger than the whole budget are not kept
+   void insert( const Key& key, const std::shared_ptr<const Value>& value )
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if( value->bytes() > m_budget ) return;
+
+      typename Index::iterator it = m_index.find(key);
+      if( it != m_index.end() )
+      {
+         m_bytes -= it->second->second->bytes();
+         m_entries.erase(it->second);
+         m_index.erase(it);
+      }
+      m_entries.push_front( Entry(key, value) );
+      m_index[key] = m_entries.begin();
+      m_bytes += value->bytes();
+      evict();
+   }
+
+   struct Stats
+   {
+      size_t hits;
+      size_t misses;
+      size_t evictions;
+      size_t entries;
+      size_t bytes;
+      size_t budget;
+   };
+
+   Stats stats()
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      Stats stats = { m_hits, m_misses, m_evictions, m_entries.size(), m_bytes, m_budget };
+      return stats;
+   }
+
+private:
+   typedef std::pair<Key, std::shared_ptr<const Value> > Entry;
+   typedef std::list<Entry> Entries;
+   typedef std::map<Key, typename Entries::iterator> Index;
+
+   // Drops the least recently used entries until the budget holds
+   void evict()
+   {
+      while( m_bytes > m_budget && !m_entries.empty() )
+      {
+         m_bytes -= m_entries.back().second->bytes();
+         m_index.erase( m_entries.back().first );
+         m_entries.pop_back();
+         ++m_evictions;
+      }
+   }
+
+   Entries    m_entries; // most recently used first
+   Index      m_index;
+   std::mutex m_mutex;
+   size_t     m_budget;
+   size_t     m_bytes;
+   size_t     m_hits;
+   size_t     m_misses;
+   size_t     m_evictions;
+};
@@ -0,0 +1,110 @@
+/* 
+* Molecular Visualization HTTP Server
+* Copyright (C) 2011-2012 Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* aint with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+*/
+
+
+#include "MappedFile.h"
+
+#include <stdio.h>
+#include <atomic>
+#include <sstream>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif // _WIN32
+
+#ifdef _WIN32
+MappedFile::MappedFile( const std::string& fileName )
+ : m_data(nullptr),
+   m_size(0),
+   m_file(INVALID_HANDLE_VALUE),
+   m_mapping(NULL)
+{
+   m_file = CreateFileA( fileName.c_str(), GENERIC_READ, FILE_SHARE_READ|FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+   if( m_file == INVALID_HANDLE_VALUE ) return;
+   LARGE_INTEGER size;
+   if( !GetFileSizeEx( m_file, &size ) || size.QuadPart == 0 ) return;
+   m_mapping = CreateFileMappingA( m_file, NULL, PAGE_READONLY, 0, 0, NULL );
+   if( m_mapping == NULL ) return;
+   m_data = static_cast<const unsigned char*>( MapViewOfFile( m_mapping, FILE_MAP_READ, 0, 0, 0 ) );
+   m_size = m_data ? static_cast<size_t>(size.QuadPart) : 0;
+}
+
+MappedFile::~MappedFile()
+{
+   if( m_data ) UnmapViewOfFile( m_data );
+   if( m_mapping != NULL ) CloseHandle( m_mapping );
+   if( m_file != INVALID_HANDLE_VALUE ) CloseHandle( m_file );
+}
+#else
+MappedFile::MappedFile( const std::string& fileName )
+ : m_data(nullptr),
+   m_size(0)
+{
+   const int file = open( fileName.c_str(), O_RDONLY );
+   if( file < 0 ) return;
+   struct stat status;
+   if( fstat( file, &status ) == 0 && status.st_size > 0 )
+   {
+      void* data = mmap( nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_PRIVATE, file, 0 );
+      if( data != MAP_FAILED )
+      {
+         madvise( data, static_cast<size_t>(status.st_size), MADV_SEQUENTIAL );
+         m_data = static_cast<const unsigned char*>(data);
+         m_size = static_cast<size_t>(status.st_size);
+      }
+   }
+   close( file );
+}
+
+MappedFile::~MappedFile()
+{
+   if( m_data ) munmap( const_cast<unsigned char*>(m_data), m_size );
+}
+#endif // _WIN32
+
+std::string temporaryFileName( const std::string& fileName )
+{
+   static std::atomic<unsigned int> counter(0);
+   std::ostringstream name;
+#ifdef _WIN32
+   name << fileName << "." << GetCurrentProcessId() << "." << counter++ << ".tmp";
+#else
+   name << fileName << "." << getpid() << "." << counter++ << ".tmp";
+#endif // _WIN32
+   return name.str();
+}
+
+bool replaceFile( const std::string& temporary, const std::string& fileName )
+{
+#ifdef _WIN32
+   const bool replaced = MoveFileExA( temporary.c_str(), fileName.c_str(), MOVEFILE_REPLACE_EXISTING ) != FALSE;
+#else
+   const bool replaced = rename( temporary.c_str(), fileName.c_str() ) == 0;
+#endif // _WIN32
+   if( !replaced ) remove( temporary.c_str() );
+   return replaced;
+}
@@ -0,0 +1,68 @@
+/* 
+* Molecular Visualization HTTP Server
+* Copyright (C) 2011-2012 Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* aint with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+*/
+
+
+#pragma once
+
+#include <string>
+#include <stddef.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif // _WIN32
+
+// ----------------------------------------------------------------------
+// Read only view of a whole file, mapped in memory. Empty when the file
+// cannot be opened or mapped, or is empty
+// ----------------------------------------------------------------------
+class MappedFile
+{
+public:
+   explicit MappedFile( const std::string& fileName );
+   ~MappedFile();
+
+   const unsigned char* data() const { return m_data; }
+   size_t size() const { return m_size; }
+
+private:
+   MappedFile( const MappedFile& );
+   MappedFile& operator=( const MappedFile& );
+
+   const unsigned char* m_data;
+   size_t               m_size;
+#ifdef _WIN32
+   HANDLE               m_file;
+   HANDLE               m_mapping;
+#endif // _WIN32
+};
+
+// ----------------------------------------------------------------------
+// Files shared by threads and processes are written aside, under a name
+// no other writer uses, then renamed over the old one in a single step:
+// readers see the old file or the new one, and concurrent writers of the
+// same file never write into each other's
+// ----------------------------------------------------------------------
+std::string temporaryFileName( const std::string& fileName );
+
+// Renames temporary to fileName, replacing it. On failure temporary is deleted
+bool replaceFile( const std::string& temporary, const std::string& fileName );
@@ -0,0 +1,71 @@
+/* 
+* Molecular Visualization HTTP Server
+* Copyright (C) 2011-2012 Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* aint with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+*/
+
+
+#include "MoleculeCache.h"
+
+bool MoleculeKey::operator<( const MoleculeKey& other ) const
+{
+   if( molecule != other.molecule ) return molecule < other.molecule;
+   if( structureType != other.structureType ) return structureType < other.structureType;
+   if( scheme != other.scheme ) return scheme < other.scheme;
+   if( atomSize != other.atomSize ) return atomSize < other.atomSize;
+   return stickSize < other.stickSize;
+}
+
+std::shared_ptr<const CachedMolecule> captureMolecule( GPUKERNEL& kernel, const int count, const float4& size )
+{
+   std::shared_ptr<CachedMolecule> molecule( new CachedMolecule );
+   molecule->size = size;
+   molecule->primitives.resize(count);
+   for( int i(0); i<count; ++i )
+   {
+      const Primitive& primitive = *kernel.getPrimitive(i);
+      CachedPrimitive& cached = molecule->primitives[i];
+      cached.type             = static_cast<PrimitiveType>(primitive.type);
+      cached.p0               = primitive.p0;
+      cached.p1               = primitive.p1;
+      cached.size             = primitive.size;
+      cached.materialId       = primitive.materialId;
+      cached.materialPaddingX = static_cast<int>(primitive.materialInfo.x);
+      cached.materialPaddingY = static_cast<int>(primitive.materialInfo.y);
+      // The PDB reader's own box, from 10 up: a hit must render the scene the miss did
+      cached.box              = kernel.getPrimitiveBox(i);
+   }
+   return molecule;
+}
+
+void uploadMolecule( GPUKERNEL& kernel, const CachedMolecule& molecule )
+{
+   for( size_t i(0); i<molecule.primitives.size(); ++i )
+   {
+      const CachedPrimitive& cached = molecule.primitives[i];
+      int index = kernel.addPrimitive( cached.type );
+      kernel.setPrimitive( 
+         index, cached.box,
+         cached.p0.x, cached.p0.y, cached.p0.z,
+         cached.p1.x, cached.p1.y, cached.p1.z,
+         cached.size.x, cached.size.y, cached.size.z,
+         cached.materialId, cached.materialPaddingX, cached.materialPaddingY );
+   }
+}
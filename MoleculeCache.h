@@ -0,0 +1,80 @@
+/* 
+* Molecular Visualization HTTP Server
+* Copyright (C) 2011-2012 Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* aint with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+*/
+
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "LruCache.h"
+#include "RenderContextPool.h"
+
+// ----------------------------------------------------------------------
+// What a built molecule depends on
+// ----------------------------------------------------------------------
+struct MoleculeKey
+{
+   std::string molecule;
+   int         structureType;
+   int         scheme;
+   float       atomSize;
+   float       stickSize;
+
+   bool operator<( const MoleculeKey& other ) const;
+};
+
+struct CachedPrimitive
+{
+   PrimitiveType type;
+   float4        p0;
+   float4        p1;
+   float4        size;
+   int           materialId;
+   int           materialPaddingX;
+   int           materialPaddingY;
+   int           box;
+};
+
+// ----------------------------------------------------------------------
+// Primitives of a molecule as the PDB reader built them, and its extent
+// ----------------------------------------------------------------------
+struct CachedMolecule
+{
+   std::vector<CachedPrimitive> primitives;
+   float4                       size;
+
+   size_t bytes() const { return sizeof(CachedMolecule) + primitives.capacity()*sizeof(CachedPrimitive); }
+};
+
+// Copies primitives [0,count) out of the kernel, with the boxes they are in
+std::shared_ptr<const CachedMolecule> captureMolecule( GPUKERNEL& kernel, const int count, const float4& size );
+
+// Adds the molecule's primitives to the kernel, no file I/O or parsing
+void uploadMolecule( GPUKERNEL& kernel, const CachedMolecule& molecule );
+
+// ----------------------------------------------------------------------
+// LRU cache of built molecules, bounded by a byte budget
+// ----------------------------------------------------------------------
+typedef LruCache<MoleculeKey, CachedMolecule> MoleculeCache;
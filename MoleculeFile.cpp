@@ -0,0 +1,231 @@
+/* 
+* Molecular Visualization HTTP Server
+* Copyright (C) 2011-2012 Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* aint with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+*/
+
+
+#include "MoleculeFile.h"
+#include "MappedFile.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <fstream>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+namespace
+{
+   const char     MAGIC[8]     = { 'I','M','V','M','O','L','\r','\n' };
+   const uint32_t VERSION      = 2; // 1 had boxes renumbered from 0, over the lamp's
+   const size_t   HEADER_BYTES = 128;
+   const int      ATOM_FLOATS  = 6;
+   const int      ATOM_INTS    = 4;
+   const int      BOND_FLOATS  = 9;
+   const int      BOND_INTS    = 4;
+
+   struct MoleculeFileHeader
+   {
+      char     magic[8];
+      uint32_t version;
+      int32_t  structureType;
+      int32_t  scheme;
+      float    atomSize;
+      float    stickSize;
+      float    size[4];
+      uint32_t atoms;
+      uint32_t bonds;
+      uint32_t reserved;
+      int64_t  sourceBytes;
+      int64_t  sourceTime;
+   };
+
+   // Elements in an array, padded to 16 bytes
+   inline size_t padded( const size_t count ) { return (count+3) & ~static_cast<size_t>(3); }
+
+   inline size_t fileBytes( const size_t atoms, const size_t bonds )
+   {
+      return HEADER_BYTES + ((ATOM_FLOATS+ATOM_INTS)*padded(atoms) + (BOND_FLOATS+BOND_INTS)*padded(bonds))*4;
+   }
+
+   MoleculeFileHeader makeHeader( const MoleculeKey& key, const std::string& pdbFileName )
+   {
+      MoleculeFileHeader header;
+      memset( &header, 0, sizeof(header) );
+      memcpy( header.magic, MAGIC, sizeof(MAGIC) );
+      header.version       = VERSION;
+      header.structureType = key.structureType;
+      header.scheme        = key.scheme;
+      header.atomSize      = key.atomSize;
+      header.stickSize     = key.stickSize;
+
+      struct stat source;
+      if( stat( pdbFileName.c_str(), &source ) == 0 )
+      {
+         header.sourceBytes = static_cast<int64_t>(source.st_size);
+         header.sourceTime  = static_cast<int64_t>(source.st_mtime);
+      }
+      return header;
+   }
+
+   template<class T>
+   void writeArray( std::ofstream& file, const std::vector<T>& values )
+   {
+      static const char zeros[16] = { 0 };
+      if( !values.empty() ) file.write( reinterpret_cast<const char*>(&values[0]), values.size()*sizeof(T) );
+      file.write( zeros, (padded(values.size())-values.size())*sizeof(T) );
+   }
+}
+
+std::string moleculeFileName( const std::string& pdbFileName, const MoleculeKey& key )
+{
+   std::string base( pdbFileName );
+   const size_t extension = base.rfind(".pdb");
+   if( extension != std::string::npos && extension+4 == base.length() ) base.erase(extension);
+   char suffix[32];
+   sprintf( suffix, ".%d.%d.imvmol", key.structureType, key.scheme );
+   return base + suffix;
+}
+
+std::shared_ptr<const CachedMolecule> loadMoleculeFile( const std::string& fileName, const MoleculeKey& key, const std::string& pdbFileName )
+{
+   MappedFile file( fileName );
+   if( file.size() < HEADER_BYTES ) return std::shared_ptr<const CachedMolecule>();
+
+   MoleculeFileHeader header;
+   memcpy( &header, file.data(), sizeof(header) );
+   const MoleculeFileHeader expected = makeHeader( key, pdbFileName );
+   if( memcmp( header.magic, MAGIC, sizeof(MAGIC) ) != 0 || header.version != VERSION ||
+       header.structureType != expected.structureType || header.scheme != expected.scheme ||
+       header.atomSize != expected.atomSize || header.stickSize != expected.stickSize ||
+       header.sourceBytes != expected.sourceBytes || header.sourceTime != expected.sourceTime ||
+       file.size() != fileBytes( header.atoms, header.bonds ) )
+   {
+      return std::shared_ptr<const CachedMolecule>();
+   }
+
+   std::shared_ptr<CachedMolecule> molecule( new CachedMolecule );
+   molecule->size.x = header.size[0];
+   molecule->size.y = header.size[1];
+   molecule->size.z = header.size[2];
+   molecule->size.w = header.size[3];
+   molecule->primitives.resize( header.atoms+header.bonds );
+
+   // Arrays are 16 byte aligned in a page aligned mapping
+   const size_t atoms = padded(header.atoms), bonds = padded(header.bonds);
+   const float*   atomFloats = reinterpret_cast<const float*>( file.data()+HEADER_BYTES );
+   const int32_t* atomInts   = reinterpret_cast<const int32_t*>( atomFloats+ATOM_FLOATS*atoms );
+   const float*   bondFloats = reinterpret_cast<const float*>( atomInts+ATOM_INTS*atoms );
+   const int32_t* bondInts   = reinterpret_cast<const int32_t*>( bondFloats+BOND_FLOATS*bonds );
+
+   for( uint32_t i(0); i<header.atoms; ++i )
+   {
+      CachedPrimitive& atom = molecule->primitives[i];
+      atom.type = ptSphere;
+      atom.p0.x = atomFloats[0*atoms+i];
+      atom.p0.y = atomFloats[1*atoms+i];
+      atom.p0.z = atomFloats[2*atoms+i];
+      atom.p0.w = 0.f;
+      atom.p1   = atom.p0;
+      atom.size.x = atomFloats[3*atoms+i];
+      atom.size.y = atomFloats[4*atoms+i];
+      atom.size.z = atomFloats[5*atoms+i];
+      atom.size.w = 0.f;
+      atom.materialId       = atomInts[0*atoms+i];
+      atom.materialPaddingX = atomInts[1*atoms+i];
+      atom.materialPaddingY = atomInts[2*atoms+i];
+      atom.box              = atomInts[3*atoms+i];
+   }
+   for( uint32_t i(0); i<header.bonds; ++i )
+   {
+      CachedPrimitive& bond = molecule->primitives[header.atoms+i];
+      bond.type = ptCylinder;
+      bond.p0.x = bondFloats[0*bonds+i];
+      bond.p0.y = bondFloats[1*bonds+i];
+      bond.p0.z = bondFloats[2*bonds+i];
+      bond.p0.w = 0.f;
+      bond.p1.x = bondFloats[3*bonds+i];
+      bond.p1.y = bondFloats[4*bonds+i];
+      bond.p1.z = bondFloats[5*bonds+i];
+      bond.p1.w = 0.f;
+      bond.size.x = bondFloats[6*bonds+i];
+      bond.size.y = bondFloats[7*bonds+i];
+      bond.size.z = bondFloats[8*bonds+i];
+      bond.size.w = 0.f;
+      bond.materialId       = bondInts[0*bonds+i];
+      bond.materialPaddingX = bondInts[1*bonds+i];
+      bond.materialPaddingY = bondInts[2*bonds+i];
+      bond.box              = bondInts[3*bonds+i];
+   }
+   return molecule;
+}
+
+bool saveMoleculeFile( const std::string& fileName, const MoleculeKey& key, const std::string& pdbFileName, const CachedMolecule& molecule )
+{
+   MoleculeFileHeader header = makeHeader( key, pdbFileName );
+   header.size[0] = molecule.size.x;
+   header.size[1] = molecule.size.y;
+   header.size[2] = molecule.size.z;
+   header.size[3] = molecule.size.w;
+
+   std::vector<float>   atomFloats[ATOM_FLOATS], bondFloats[BOND_FLOATS];
+   std::vector<int32_t> atomInts[ATOM_INTS], bondInts[BOND_INTS];
+   for( size_t i(0); i<molecule.primitives.size(); ++i )
+   {
+      const CachedPrimitive& primitive = molecule.primitives[i];
+      if( primitive.type == ptSphere )
+      {
+         const float   floats[ATOM_FLOATS] = { primitive.p0.x, primitive.p0.y, primitive.p0.z, primitive.size.x, primitive.size.y, primitive.size.z };
+         const int32_t ints[ATOM_INTS]     = { primitive.materialId, primitive.materialPaddingX, primitive.materialPaddingY, primitive.box };
+         for( int j(0); j<ATOM_FLOATS; ++j ) atomFloats[j].push_back( floats[j] );
+         for( int j(0); j<ATOM_INTS; ++j ) atomInts[j].push_back( ints[j] );
+      }
+      else if( primitive.type == ptCylinder )
+      {
+         const float   floats[BOND_FLOATS] = { primitive.p0.x, primitive.p0.y, primitive.p0.z, primitive.p1.x, primitive.p1.y, primitive.p1.z, primitive.size.x, primitive.size.y, primitive.size.z };
+         const int32_t ints[BOND_INTS]     = { primitive.materialId, primitive.materialPaddingX, primitive.materialPaddingY, primitive.box };
+         for( int j(0); j<BOND_FLOATS; ++j ) bondFloats[j].push_back( floats[j] );
+         for( int j(0); j<BOND_INTS; ++j ) bondInts[j].push_back( ints[j] );
+      }
+   }
+   header.atoms = static_cast<uint32_t>(atomFloats[0].size());
+   header.bonds = static_cast<uint32_t>(bondFloats[0].size());
+
+   const std::string temporary = temporaryFileName( fileName );
+   {
+      std::ofstream file( temporary.c_str(), std::ios::binary );
+      if( !file.is_open() ) return false;
+      char block[HEADER_BYTES] = { 0 };
+      memcpy( block, &header, sizeof(header) );
+      file.write( block, HEADER_BYTES );
+      for( int j(0); j<ATOM_FLOATS; ++j ) writeArray( file, atomFloats[j] );
+      for( int j(0); j<ATOM_INTS; ++j ) writeArray( file, atomInts[j] );
+      for( int j(0); j<BOND_FLOATS; ++j ) writeArray( file, bondFloats[j] );
+      for( int j(0); j<BOND_INTS; ++j ) writeArray( file, bondInts[j] );
+      if( !file )
+      {
+         file.close();
+         remove( temporary.c_str() );
+         return false;
+      }
+   }
+   return replaceFile( temporary, fileName );
+}
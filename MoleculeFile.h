@@ -0,0 +1,54 @@
+/* 
+* Molecular Visualization HTTP Server
+* Copyright (C) 2011-2012 Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* aint with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+*/
+
+
+#pragma once
+
+#include <string>
+#include <memory>
+
+#include "MoleculeCache.h"
+
+// ----------------------------------------------------------------------
+// Binary molecule files. A molecule built by the PDB reader for one
+// structure and scheme is written next to its PDB file the first time
+// it is built (or by -compile), and mapped in memory on the next cache
+// misses instead of parsing the PDB text again.
+//
+// Little endian, native floats. A 128 byte header (magic, version, key,
+// size of the molecule, size and date of the PDB file it comes from),
+// then structure of arrays, every array padded to 16 bytes:
+//   atoms: x y z, size x y z, material, material info x y, box
+//   bonds: p0 x y z, p1 x y z, size x y z, material, material info x y, box
+// Bonds are the cylinders the reader adds for stick structures
+// ----------------------------------------------------------------------
+
+// File of the molecule built from pdbFileName for the key's structure and scheme
+std::string moleculeFileName( const std::string& pdbFileName, const MoleculeKey& key );
+
+// Null when the file is missing, damaged, from another version, built
+// with other sizes, or not built from the current PDB file
+std::shared_ptr<const CachedMolecule> loadMoleculeFile( const std::string& fileName, const MoleculeKey& key, const std::string& pdbFileName );
+
+// Written aside then renamed. Primitives other than spheres and cylinders are not kept
+bool saveMoleculeFile( const std::string& fileName, const MoleculeKey& key, const std::string& pdbFileName, const CachedMolecule& molecule );
@@ -0,0 +1,246 @@
+/* 
+* Molecular Visualization HTTP Server
+* Copyright (C) 2011-2012 Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* aint with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+*/
+
+
+#include "PdbFetcher.h"
+#include "MappedFile.h"
+#include "RenderRequest.h"
+
+#include <stdio.h>
+#include <fstream>
+
+#pragma comment(lib, "wininet.lib")
+
+namespace
+{
+   const size_t READ_BYTES = 64*1024;
+
+   // PDB IDs are 4 characters, longer names are allowed for local files.
+   // Anything else could leave the directory or change the URL
+   bool validMolecule( const std::string& molecule )
+   {
+      if( molecule.empty() || molecule.length()>16 ) return false;
+      for( size_t i(0); i<molecule.length(); ++i )
+      {
+         const char c = molecule[i];
+         if( !((c>='0' && c<='9') || (c>='A' && c<='Z') || (c>='a' && c<='z') || c=='_' || c=='-') ) return false;
+      }
+      return true;
+   }
+
+   std::shared_future<PdbFetchResult> ready( const PdbFetchResult result )
+   {
+      std::promise<PdbFetchResult> promise;
+      promise.set_value( result );
+      return promise.get_future().share();
+   }
+}
+
+PdbFetcher::PdbFetcher()
+ : m_mirror("http://www.rcsb.org/pdb/files/"),
+   m_directory("../Pdb"),
+   m_internet(NULL),
+   m_callback(nullptr),
+   m_callbackContext(nullptr),
+   m_stopping(false)
+{
+   m_stats.downloads    = 0;
+   m_stats.deduplicated = 0;
+   m_stats.notFound     = 0;
+   m_stats.failures     = 0;
+   m_stats.bytes        = 0;
+   m_stats.pending      = 0;
+}
+
+PdbFetcher::~PdbFetcher()
+{
+   stop();
+}
+
+void PdbFetcher::start( const int threads )
+{
+   m_internet = ::InternetOpen("IMVWebServer", LOCAL_INTERNET_ACCESS, NULL, 0, 0);
+   m_stopping = false;
+   for( int i(0); i<threads; ++i )
+   {
+      m_threads.push_back( std::thread( &PdbFetcher::run, this ) );
+   }
+}
+
+void PdbFetcher::stop()
+{
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stopping = true;
+   }
+   m_wakeUp.notify_all();
+   for( size_t i(0); i<m_threads.size(); ++i ) m_threads[i].join();
+   m_threads.clear();
+
+   // Nobody will download what is left, release whoever waits for it
+   std::lock_guard<std::mutex> lock(m_mutex);
+   for( size_t i(0); i<m_queue.size(); ++i ) m_queue[i].promise->set_value( pfFailed );
+   m_queue.clear();
+   m_pending.clear();
+   if( m_internet ) ::InternetCloseHandle( m_internet );
+   m_internet = NULL;
+}
+
+std::string PdbFetcher::fileName( const std::string& molecule ) const
+{
+   return m_directory + "/" + canonicalMoleculeId( molecule ) + ".pdb";
+}
+
+std::shared_future<PdbFetchResult> PdbFetcher::fetch( const std::string& id )
+{
+   if( !validMolecule(id) ) return ready( pfNotFound );
+   const std::string molecule = canonicalMoleculeId( id );
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if( m_present.count( molecule ) ) return ready( pfCached );
+      std::map< std::string, std::shared_future<PdbFetchResult> >::iterator pending = m_pending.find( molecule );
+      if( pending != m_pending.end() )
+      {
+         ++m_stats.deduplicated;
+         return pending->second;
+      }
+   }
+
+   // Files only appear complete, under their final name. The disk is only
+   // asked once per molecule, and never with the lock held
+   std::ifstream file( fileName(molecule).c_str() );
+   const bool present = file.is_open();
+   file.close();
+
+   std::lock_guard<std::mutex> lock(m_mutex);
+   if( present )
+   {
+      m_present.insert( molecule );
+      return ready( pfCached );
+   }
+   // Another request may have started the download meanwhile
+   std::map< std::string, std::shared_future<PdbFetchResult> >::iterator pending = m_pending.find( molecule );
+   if( pending != m_pending.end() )
+   {
+      ++m_stats.deduplicated;
+      return pending->second;
+   }
+   if( m_stopping ) return ready( pfFailed );
+
+   Download download;
+   download.molecule = molecule;
+   download.promise.reset( new std::promise<PdbFetchResult> );
+   std::shared_future<PdbFetchResult> result = download.promise->get_future().share();
+   m_pending[molecule] = result;
+   m_queue.push_back( download );
+   m_wakeUp.notify_one();
+   return result;
+}
+
+void PdbFetcher::run()
+{
+   for( ;; )
+   {
+      Download download;
+      {
+         std::unique_lock<std::mutex> lock(m_mutex);
+         while( !m_stopping && m_queue.empty() ) m_wakeUp.wait(lock);
+         if( m_stopping ) return;
+         download = m_queue.front();
+         m_queue.pop_front();
+      }
+
+      const PdbFetchResult result = this->download( download.molecule );
+      {
+         // Gone from the pending downloads before the waiters hear about it: the
+         // next request finds the file, or starts another try
+         std::lock_guard<std::mutex> lock(m_mutex);
+         m_pending.erase( download.molecule );
+         if( result == pfDownloaded ) m_present.insert( download.molecule );
+         m_stats.downloads += (result == pfDownloaded) ? 1 : 0;
+         m_stats.notFound  += (result == pfNotFound) ? 1 : 0;
+         m_stats.failures  += (result == pfFailed) ? 1 : 0;
+      }
+      download.promise->set_value( result );
+      if( m_callback ) m_callback( m_callbackContext, download.molecule, result );
+   }
+}
+
+PdbFetchResult PdbFetcher::download( const std::string& molecule )
+{
+   const std::string url = m_mirror + molecule + ".pdb";
+   HINTERNET handle = ::InternetOpenUrl( m_internet, url.c_str(), NULL, 0, INTERNET_FLAG_RELOAD|INTERNET_FLAG_NO_CACHE_WRITE, 0 );
+   if( !handle ) return pfFailed;
+
+   // An unknown ID is a 404 page, which must not be saved as the molecule
+   DWORD status(0);
+   DWORD statusBytes( sizeof(status) );
+   if( ::HttpQueryInfo( handle, HTTP_QUERY_STATUS_CODE|HTTP_QUERY_FLAG_NUMBER, &status, &statusBytes, NULL ) == TRUE && status != 200 )
+   {
+      ::InternetCloseHandle( handle );
+      return (status == 404 || status == 410) ? pfNotFound : pfFailed;
+   }
+
+   const std::string name = fileName( molecule );
+   const std::string temporary = temporaryFileName( name );
+   bool complete(false);
+   size_t bytes(0);
+   {
+      std::ofstream file( temporary.c_str(), std::ios::binary );
+      if( file.is_open() )
+      {
+         std::vector<char> buffer( READ_BYTES );
+         DWORD read(0);
+         BOOL ok(FALSE);
+         while( (ok = ::InternetReadFile( handle, &buffer[0], static_cast<DWORD>(buffer.size()), &read )) == TRUE && read > 0 )
+         {
+            file.write( &buffer[0], read );
+            bytes += read;
+         }
+         complete = (ok == TRUE) && bytes > 0 && file.good();
+      }
+   }
+   ::InternetCloseHandle( handle );
+
+   if( complete )
+   {
+      complete = replaceFile( temporary, name );
+   }
+   if( !complete )
+   {
+      remove( temporary.c_str() );
+      return pfFailed;
+   }
+
+   std::lock_guard<std::mutex> lock(m_mutex);
+   m_stats.bytes += bytes;
+   return pfDownloaded;
+}
+
+PdbFetcher::Stats PdbFetcher::stats()
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   Stats stats = m_stats;
+   stats.pending = static_cast<int>(m_pending.size());
+   return stats;
+}
@@ -0,0 +1,116 @@
+/* 
+* Molecular Visualization HTTP Server
+* Copyright (C) 2011-2012 Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* aint with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+*/
+
+
+#pragma once
+
+#include <map>
+#include <set>
+#include <deque>
+#include <string>
+#include <vector>
+#include <memory>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <windows.h>
+#include <wininet.h>
+
+enum PdbFetchResult
+{
+   pfCached,     // the file was already there
+   pfDownloaded,
+   pfNotFound,   // the mirror does not have it, or the ID is not one
+   pfFailed      // network or disk error, worth another try later
+};
+
+// Told on a download thread that a download is over, whatever its result
+typedef void (*PdbFetchCallback)( void* context, const std::string& molecule, const PdbFetchResult result );
+
+// ----------------------------------------------------------------------
+// Downloads missing PDB files from a mirror, on its own threads. A
+// molecule is downloaded once however many requests ask for it: they
+// all wait on the same future. Files are written aside and renamed
+// once complete, so that a failed download leaves nothing behind
+// ----------------------------------------------------------------------
+class PdbFetcher
+{
+public:
+   PdbFetcher();
+   ~PdbFetcher();
+
+   // Base URL, the file name (1BNA.pdb) is appended to it
+   void setMirror( const std::string& mirror ) { m_mirror = mirror; }
+   void setDirectory( const std::string& directory ) { m_directory = directory; }
+   const std::string& mirror() const { return m_mirror; }
+   // Before start(). molecule is the ID as fetch() upper cased it
+   void setCallback( PdbFetchCallback callback, void* context ) { m_callback = callback; m_callbackContext = context; }
+
+   void start( const int threads );
+   void stop();
+
+   // Where the molecule's PDB file is, or goes. IDs are upper cased
+   std::string fileName( const std::string& molecule ) const;
+
+   // Ready at once when the file is there, otherwise the pending download.
+   // Molecules found or downloaded are remembered, the disk is asked once
+   std::shared_future<PdbFetchResult> fetch( const std::string& id );
+
+   struct Stats
+   {
+      size_t downloads;
+      size_t deduplicated; // requests that waited on a download already started
+      size_t notFound;
+      size_t failures;
+      size_t bytes;
+      int    pending;
+   };
+   Stats stats();
+
+private:
+   struct Download
+   {
+      std::string                                     molecule;
+      std::shared_ptr< std::promise<PdbFetchResult> > promise;
+   };
+
+   void run();
+   PdbFetchResult download( const std::string& molecule );
+
+private:
+   std::string                                               m_mirror;
+   std::string                                               m_directory;
+   HINTERNET                                                 m_internet;
+   PdbFetchCallback                                          m_callback;
+   void*                                                     m_callbackContext;
+   std::vector<std::thread>                                  m_threads;
+   std::deque<Download>                                      m_queue;
+   std::map< std::string, std::shared_future<PdbFetchResult> > m_pending;
+   std::set<std::string>                                     m_present;   // files known to be there
+   std::mutex                                                m_mutex;
+   std::condition_variable                                   m_wakeUp;
+   bool                                                      m_stopping;
+   Stats                                                     m_stats;
+};
@@ -0,0 +1,238 @@
+/* 
+* Molecular Visualization HTTP Server
+* Copyright (C) 2011-2012 Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* aint with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+*/
+
+
+#include "PdbParser.h"
+#include "MappedFile.h"
+
+#include <thread>
+
+namespace
+{
+   // Chunks smaller than this are not worth a thread
+   const size_t MIN_CHUNK_BYTES = 256*1024;
+
+   // Column range [first,last), 0 based, cut to the line
+   struct Field
+   {
+      const char* begin;
+      const char* end;
+   };
+
+   inline Field field( const char* line, const size_t length, const size_t first, const size_t last )
+   {
+      Field f;
+      f.begin = line + ((first<length) ? first : length);
+      f.end   = line + ((last<length) ? last : length);
+      return f;
+   }
+
+   inline bool blank( Field f )
+   {
+      for( ; f.begin<f.end; ++f.begin ) if( *f.begin != ' ' ) return false;
+      return true;
+   }
+
+   // Fixed width integer, blank is 0
+   inline int32_t toInt( Field f )
+   {
+      while( f.begin<f.end && *f.begin == ' ' ) ++f.begin;
+      bool negative = false;
+      if( f.begin<f.end && (*f.begin == '-' || *f.begin == '+') ) negative = (*f.begin++ == '-');
+      int32_t value = 0;
+      for( ; f.begin<f.end && *f.begin>='0' && *f.begin<='9'; ++f.begin ) value = value*10 + (*f.begin-'0');
+      return negative ? -value : value;
+   }
+
+   // Fixed width decimal such as "  -12.345", no exponent in PDB files
+   inline float toFloat( Field f )
+   {
+      while( f.begin<f.end && *f.begin == ' ' ) ++f.begin;
+      bool negative = false;
+      if( f.begin<f.end && (*f.begin == '-' || *f.begin == '+') ) negative = (*f.begin++ == '-');
+      int64_t mantissa = 0;
+      int decimals = -1;
+      for( ; f.begin<f.end; ++f.begin )
+      {
+         const char c = *f.begin;
+         if( c>='0' && c<='9' )
+         {
+            mantissa = mantissa*10 + (c-'0');
+            if( decimals>=0 ) ++decimals;
+         }
+         else if( c == '.' && decimals<0 ) decimals = 0;
+         else break;
+      }
+      static const float scales[] = { 1.f, 1e-1f, 1e-2f, 1e-3f, 1e-4f, 1e-5f, 1e-6f, 1e-7f, 1e-8f };
+      float value = static_cast<float>(mantissa);
+      if( decimals>0 ) value *= (decimals<=8) ? scales[decimals] : 0.f;
+      return negative ? -value : value;
+   }
+
+   inline uint32_t pack( Field f, const size_t width )
+   {
+      uint32_t value = 0;
+      for( size_t i(0); i<width; ++i ) value = (value<<8) | static_cast<unsigned char>( (f.begin+i<f.end) ? f.begin[i] : ' ' );
+      return value;
+   }
+
+   inline char upper( const char c ) { return (c>='a' && c<='z') ? static_cast<char>(c-'a'+'A') : c; }
+
+   // Element from columns 77-78, or from the atom name for files that predate them
+   inline uint16_t element( const char* line, const size_t length )
+   {
+      Field f = field( line, length, 76, 78 );
+      if( blank(f) )
+      {
+         f = field( line, length, 12, 14 );
+         char symbol = ' ';
+         for( const char* c = f.begin; c<f.end; ++c ) if( *c!=' ' && (*c<'0' || *c>'9') ) { symbol = *c; break; }
+         return static_cast<uint16_t>( (' '<<8) | static_cast<unsigned char>(upper(symbol)) );
+      }
+      const char first  = (f.begin<f.end) ? upper(f.begin[0]) : ' ';
+      const char second = (f.begin+1<f.end) ? upper(f.begin[1]) : ' ';
+      return (second == ' ') ? 
+         static_cast<uint16_t>( (' '<<8) | static_cast<unsigned char>(first) ) :
+         static_cast<uint16_t>( (static_cast<unsigned char>(first)<<8) | static_cast<unsigned char>(second) );
+   }
+
+   inline bool startsWith( const char* line, const size_t length, const char* record, const size_t recordLength )
+   {
+      if( length<recordLength ) return false;
+      for( size_t i(0); i<recordLength; ++i ) if( line[i] != record[i] ) return false;
+      return true;
+   }
+
+   void parseChunk( const char* begin, const char* end, PdbAtoms* atoms )
+   {
+      while( begin<end )
+      {
+         const char* eol = begin;
+         while( eol<end && *eol != '\n' ) ++eol;
+         size_t length = eol-begin;
+         if( length>0 && begin[length-1] == '\r' ) --length;
+         const char* line = begin;
+         begin = eol+1;
+
+         const bool atom = startsWith( line, length, "ATOM  ", 6 );
+         const bool hetero = !atom && startsWith( line, length, "HETATM", 6 );
+         if( atom || hetero )
+         {
+            if( length<54 ) continue;
+            atoms->x.push_back( toFloat( field(line,length,30,38) ) );
+            atoms->y.push_back( toFloat( field(line,length,38,46) ) );
+            atoms->z.push_back( toFloat( field(line,length,46,54) ) );
+            atoms->serial.push_back( toInt( field(line,length,6,11) ) );
+            atoms->name.push_back( pack( field(line,length,12,16), 4 ) );
+            atoms->residueName.push_back( pack( field(line,length,17,20), 3 ) );
+            atoms->chain.push_back( (length>21) ? line[21] : ' ' );
+            atoms->residue.push_back( toInt( field(line,length,22,26) ) );
+            atoms->element.push_back( element( line, length ) );
+            atoms->hetero.push_back( hetero ? 1 : 0 );
+         }
+         else if( startsWith( line, length, "CONECT", 6 ) )
+         {
+            const int32_t from = toInt( field(line,length,6,11) );
+            for( size_t column(11); column+5<=31; column+=5 )
+            {
+               const Field to = field( line, length, column, column+5 );
+               if( blank(to) ) break;
+               atoms->bondFrom.push_back( from );
+               atoms->bondTo.push_back( toInt(to) );
+            }
+         }
+      }
+   }
+
+   template<class T>
+   void appendTo( std::vector<T>& to, const std::vector<T>& from )
+   {
+      to.insert( to.end(), from.begin(), from.end() );
+   }
+}
+
+void PdbAtoms::clear()
+{
+   x.clear(); y.clear(); z.clear();
+   serial.clear(); name.clear(); residueName.clear(); residue.clear();
+   chain.clear(); element.clear(); hetero.clear();
+   bondFrom.clear(); bondTo.clear();
+}
+
+void PdbAtoms::append( const PdbAtoms& other )
+{
+   appendTo( x, other.x );
+   appendTo( y, other.y );
+   appendTo( z, other.z );
+   appendTo( serial, other.serial );
+   appendTo( name, other.name );
+   appendTo( residueName, other.residueName );
+   appendTo( residue, other.residue );
+   appendTo( chain, other.chain );
+   appendTo( element, other.element );
+   appendTo( hetero, other.hetero );
+   appendTo( bondFrom, other.bondFrom );
+   appendTo( bondTo, other.bondTo );
+}
+
+void parsePdb( const char* text, const size_t size, PdbAtoms& atoms, const int threads )
+{
+   atoms.clear();
+   size_t chunks = size/MIN_CHUNK_BYTES;
+   chunks = (chunks<1) ? 1 : ((chunks>static_cast<size_t>(threads)) ? static_cast<size_t>((threads<1) ? 1 : threads) : chunks);
+   if( chunks == 1 )
+   {
+      parseChunk( text, text+size, &atoms );
+      return;
+   }
+
+   // Chunks end after a line feed, so that no line is cut
+   std::vector<const char*> bounds( chunks+1, text+size );
+   bounds[0] = text;
+   for( size_t i(1); i<chunks; ++i )
+   {
+      const char* bound = text + size/chunks*i;
+      bound = (bound<bounds[i-1]) ? bounds[i-1] : bound;
+      while( bound<text+size && *bound != '\n' ) ++bound;
+      bounds[i] = (bound<text+size) ? bound+1 : bound;
+   }
+
+   std::vector<PdbAtoms> parts( chunks );
+   std::vector<std::thread> workers;
+   for( size_t i(1); i<chunks; ++i )
+   {
+      workers.push_back( std::thread( parseChunk, bounds[i], bounds[i+1], &parts[i] ) );
+   }
+   parseChunk( bounds[0], bounds[1], &atoms );
+   for( size_t i(0); i<workers.size(); ++i ) workers[i].join();
+   for( size_t i(1); i<chunks; ++i ) atoms.append( parts[i] );
+}
+
+bool parsePdbFile( const std::string& fileName, PdbAtoms& atoms, const int threads )
+{
+   MappedFile file( fileName );
+   atoms.clear();
+   if( !file.data() ) return false;
+   parsePdb( reinterpret_cast<const char*>(file.data()), file.size(), atoms, threads );
+   return true;
+}
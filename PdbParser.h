@@ -0,0 +1,63 @@
+/* 
+* Molecular Visualization HTTP Server
+* Copyright (C) 2011-2012 Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* aint with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+*/
+
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+
+// ----------------------------------------------------------------------
+// Atoms of a PDB file, one array per field
+// ----------------------------------------------------------------------
+struct PdbAtoms
+{
+   std::vector<float>    x, y, z;
+   std::vector<int32_t>  serial;
+   std::vector<uint32_t> name;        // atom name, 4 characters packed, spaces included
+   std::vector<uint32_t> residueName; // 3 characters packed
+   std::vector<int32_t>  residue;     // residue sequence number
+   std::vector<char>     chain;
+   std::vector<uint16_t> element;     // 2 characters packed, upper case, ' ' padded on the left
+   std::vector<char>     hetero;      // HETATM rather than ATOM
+
+   // CONECT records, by serial number. A bond listed by both atoms appears twice
+   std::vector<int32_t>  bondFrom, bondTo;
+
+   size_t size() const { return x.size(); }
+   void clear();
+   void append( const PdbAtoms& other );
+};
+
+// ----------------------------------------------------------------------
+// Parses ATOM, HETATM and CONECT records straight out of the text: the
+// text is split into line aligned chunks parsed on their own threads,
+// fixed width fields are read in place, and the chunks are appended in
+// file order. Other records, and atoms without coordinates, are skipped
+// ----------------------------------------------------------------------
+void parsePdb( const char* text, const size_t size, PdbAtoms& atoms, const int threads );
+
+// Maps the file and parses it. False when it cannot be read
+bool parsePdbFile( const std::string& fileName, PdbAtoms& atoms, const int threads );
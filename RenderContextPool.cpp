@@ -0,0 +1,118 @@
+/* 
+* Molecular Visualization HTTP Server
+* Copyright (C) 2011-2012 Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* aint with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+*/
+
+
+#include "RenderContextPool.h"
+#include "CpuKernel.h"
+
+#include <thread>
+
+#include "../../../RaytracingEngine/tags/version-00.02.00/Cuda/CudaKernel.h"
+
+RenderContextPool::RenderContextPool()
+ : m_setup(nullptr),
+   m_backend(rbCuda),
+   m_maxWidth(0),
+   m_maxHeight(0),
+   m_depth(0)
+{
+}
+
+RenderContextPool::~RenderContextPool()
+{
+   for( size_t i(0); i<m_contexts.size(); ++i )
+   {
+      delete m_contexts[i]->kernel;
+      delete m_contexts[i];
+   }
+}
+
+void RenderContextPool::initialize( const int size, const unsigned int maxWidth, const unsigned int maxHeight, const unsigned int depth, 
+                                    const SceneInfo& sceneInfo, RenderContextSetup setup, const RenderBackend backend )
+{
+   m_setup     = setup;
+   m_backend   = backend;
+   m_maxWidth  = maxWidth;
+   m_maxHeight = maxHeight;
+   m_depth     = depth;
+
+   // Buffers are allocated from the scene size, so initialize them for the largest image
+   SceneInfo largest(sceneInfo);
+   largest.width.x  = maxWidth;
+   largest.height.x = maxHeight;
+   largest.pathTracingIteration.x = 0;
+
+   int threads = static_cast<int>(std::thread::hardware_concurrency())/size;
+   threads = (threads<1) ? 1 : threads;
+
+   for( int i(0); i<size; ++i )
+   {
+      RenderContext* context = new RenderContext;
+      if( m_backend == rbCpu )
+      {
+         context->kernel = new CpuKernel(false, true, threads);
+      }
+      else
+      {
+         context->kernel = new CudaKernel(false, true);
+      }
+      context->kernel->setSceneInfo( largest );
+      context->kernel->initBuffers();
+      context->image.resize( imageBytes() );
+      m_setup( *context->kernel );
+      m_contexts.push_back(context);
+      m_free.push_back(context);
+   }
+}
+
+RenderContext* RenderContextPool::acquire()
+{
+   RenderContext* context(nullptr);
+   {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      while( m_free.empty() ) m_released.wait(lock);
+      context = m_free.back();
+      m_free.pop_back();
+   }
+
+   // resetAll() also empties the material table, which the setup puts back.
+   // Both only touch host side tables, the device buffers stay
+   context->kernel->resetAll();
+   m_setup( *context->kernel );
+   return context;
+}
+
+void RenderContextPool::release( RenderContext* context )
+{
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_free.push_back(context);
+   }
+   m_released.notify_one();
+}
+
+int RenderContextPool::available()
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   return static_cast<int>(m_free.size());
+}
@@ -0,0 +1,115 @@
+/* 
+* Molecular Visualization HTTP Server
+* Copyright (C) 2011-2012 Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* aint with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+*/
+
+
+#pragma once
+
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+
+#include "../../../RaytracingEngine/tags/version-00.02.00/Consts.h"
+#include "../../../RaytracingEngine/tags/version-00.02.00/GPUKernel.h"
+
+// Contexts are created for the backend chosen at startup, the rest of
+// the server only sees the kernel interface
+typedef GPUKernel GPUKERNEL;
+
+enum RenderBackend
+{
+   rbCuda,
+   rbCpu
+};
+
+// ----------------------------------------------------------------------
+// Render context: a kernel whose buffers were allocated once, for the
+// largest image the pool serves, and the host frame buffer that goes
+// with it
+// ----------------------------------------------------------------------
+struct RenderContext
+{
+   GPUKERNEL*        kernel;
+   std::vector<char> image;
+};
+
+// Fills the kernel with what every request shares (the material table)
+typedef void (*RenderContextSetup)( GPUKERNEL& kernel );
+
+// ----------------------------------------------------------------------
+// Pool of render contexts created at startup. Requests check one out,
+// reset the scene and hand it back, instead of paying for the device
+// and buffer setup every time
+// ----------------------------------------------------------------------
+class RenderContextPool
+{
+public:
+   RenderContextPool();
+   ~RenderContextPool();
+
+   // Creates the contexts, sized for maxWidth x maxHeight x depth images. CPU
+   // contexts share the cores between them
+   void initialize( const int size, const unsigned int maxWidth, const unsigned int maxHeight, const unsigned int depth, 
+                    const SceneInfo& sceneInfo, RenderContextSetup setup, const RenderBackend backend = rbCuda );
+
+   // Waits for a free context. The previous scene is gone, the shared setup is in place
+   RenderContext* acquire();
+   void release( RenderContext* context );
+
+   int size() const { return static_cast<int>(m_contexts.size()); }
+   int available();
+   unsigned int maxWidth() const { return m_maxWidth; }
+   unsigned int maxHeight() const { return m_maxHeight; }
+   RenderBackend backend() const { return m_backend; }
+
+   // Host frame buffer per context. Device buffers are owned by the kernel
+   size_t imageBytes() const { return static_cast<size_t>(m_maxWidth)*m_maxHeight*m_depth; }
+
+private:
+   std::vector<RenderContext*> m_contexts;
+   std::vector<RenderContext*> m_free;
+   std::mutex                  m_mutex;
+   std::condition_variable     m_released;
+   RenderContextSetup          m_setup;
+   RenderBackend               m_backend;
+   unsigned int                m_maxWidth;
+   unsigned int                m_maxHeight;
+   unsigned int                m_depth;
+};
+
+// Checks a context out of the pool for the lifetime of the object
+class RenderContextLease
+{
+public:
+   explicit RenderContextLease( RenderContextPool& pool ) : m_pool(pool), m_context(pool.acquire()) {}
+   ~RenderContextLease() { m_pool.release(m_context); }
+
+   RenderContext* operator->() const { return m_context; }
+   RenderContext& operator*() const { return *m_context; }
+
+private:
+   RenderContextLease( const RenderContextLease& );
+   RenderContextLease& operator=( const RenderContextLease& );
+
+   RenderContextPool& m_pool;
+   RenderContext*     m_context;
+};
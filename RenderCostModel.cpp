@@ -0,0 +1,95 @@
+/* 
+* Molecular Visualization HTTP Server
+* Copyright (C) 2011-2012 Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* aint with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+*/
+
+
+#include "RenderCostModel.h"
+
+#include <math.h>
+#include <sstream>
+
+// Until a render has been measured: about 10 seconds for 2048x2048x20
+// iterations of a 10000 primitive molecule
+static const double INITIAL_RATE       = 9e-9;
+static const double INITIAL_PRIMITIVES = 10000.0;
+// Weight of the latest measure in the moving averages
+static const double LEARNING_RATE      = 0.2;
+
+RenderCostModel::RenderCostModel()
+ : m_averagePrimitives(INITIAL_PRIMITIVES),
+   m_samples(0)
+{
+   for( int i(0); i<3; ++i )
+   {
+      m_rates[i]    = INITIAL_RATE;
+      m_measured[i] = false;
+   }
+}
+
+std::string RenderCostModel::sceneKey( const RenderRequest& request )
+{
+   std::ostringstream key;
+   key << request.molecule << "/" << request.structureType;
+   return key.str();
+}
+
+// Everything but the rate
+double RenderCostModel::complexity( const RenderRequest& request ) const
+{
+   std::map<std::string, int>::const_iterator it = m_primitives.find( sceneKey(request) );
+   const double primitives = ( it != m_primitives.end() ) ? it->second : m_averagePrimitives;
+   return static_cast<double>(request.cost())*log(2.0+primitives)/log(2.0);
+}
+
+double RenderCostModel::predict( const RenderRequest& request ) const
+{
+   return complexity(request)*m_rates[request.postProcessing];
+}
+
+void RenderCostModel::learn( const RenderRequest& request, const int primitives, const double seconds )
+{
+   if( primitives > 0 )
+   {
+      m_primitives[sceneKey(request)] = primitives;
+      m_averagePrimitives += LEARNING_RATE*(primitives-m_averagePrimitives);
+   }
+
+   const double units = complexity(request);
+   if( units <= 0.0 || seconds <= 0.0 ) return;
+   const double rate = seconds/units;
+   const int postProcessing = request.postProcessing;
+   if( m_measured[postProcessing] )
+   {
+      m_rates[postProcessing] += LEARNING_RATE*(rate-m_rates[postProcessing]);
+   }
+   else
+   {
+      // The first measure replaces the guess, effects not measured yet follow it
+      m_rates[postProcessing] = rate;
+      m_measured[postProcessing] = true;
+      for( int i(0); i<3; ++i )
+      {
+         if( !m_measured[i] ) m_rates[i] = rate;
+      }
+   }
+   ++m_samples;
+}
@@ -0,0 +1,61 @@
+/* 
+* Molecular Visualization HTTP Server
+* Copyright (C) 2011-2012 Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* aint with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+*/
+
+
+#pragma once
+
+#include <map>
+#include <string>
+
+#include "RenderRequest.h"
+
+// ----------------------------------------------------------------------
+// Predicts how long a request takes to render, in seconds:
+//   pixels x iterations x log2(2+primitives) x rate[postprocessing]
+// Path tracing is linear in pixels and iterations, and roughly
+// logarithmic in the scene size thanks to the boxes. The rates, and the
+// primitive count of each molecule and structure, are learnt from the
+// renders that complete. Not thread safe
+// ----------------------------------------------------------------------
+class RenderCostModel
+{
+public:
+   RenderCostModel();
+
+   double predict( const RenderRequest& request ) const;
+   void   learn( const RenderRequest& request, const int primitives, const double seconds );
+
+   // Seconds per pixel x iteration x log2(2+primitives)
+   double rate( const int postProcessing ) const { return m_rates[postProcessing]; }
+   size_t samples() const { return m_samples; }
+
+private:
+   static std::string sceneKey( const RenderRequest& request );
+   double complexity( const RenderRequest& request ) const;
+
+   std::map<std::string, int> m_primitives; // by molecule and structure
+   double                     m_averagePrimitives;
+   double                     m_rates[3];
+   bool                       m_measured[3];
+   size_t                     m_samples;
+};
@@ -0,0 +1,346 @@
+/* 
+* Molecular Visualization HTTP Server
+* Copyright (C) 2011-2012 Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* aint with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+*/
+
+
+#include "RenderRequest.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <random>
+#include <sstream>
+#include <iomanip>
+
+#include "JpegEncoder.h"
+
+// Most path tracing iterations a request can ask for
+static const int MAX_QUALITY = 20;
+
+// "x,y,z", missing components are 0
+static float4 readFloat3( const char* value )
+{
+   float4 result = {0.f,0.f,0.f,0.f};
+   float* components[3] = { &result.x, &result.y, &result.z };
+   for( int i(0); i<3 && *value; ++i )
+   {
+      *components[i] = static_cast<float>(atof(value));
+      const char* comma = strchr(value, ',');
+      if( comma == nullptr ) break;
+      value = comma+1;
+   }
+   return result;
+}
+
+RenderRequest::RenderRequest( const SceneInfo& defaults )
+ : structureType(0),
+   scheme(0),
+   quality(defaults.maxPathTracingIterations.x),
+   deadline(0),
+   noiseTarget(0.f),
+   width(defaults.width.x),
+   height(defaults.height.x),
+   backgroundColor(defaults.backgroundColor),
+   postProcessing(0),
+   jpegSubsampling(JO_SUBSAMPLING_420),
+   jpegOptimize(false),
+   jpegProgressive(false),
+   binaryResponse(false),
+   seed(0),
+   m_given(0),
+   m_frames(12),
+   m_hasTo(false)
+{
+   float4 noRotation = {0.f,0.f,0.f,0.f};
+   rotation = noRotation;
+   m_to     = noRotation;
+}
+
+std::string canonicalMoleculeId( const std::string& id )
+{
+   std::string upper( id );
+   for( size_t i(0); i<upper.length(); ++i )
+   {
+      upper[i] = (upper[i]>='a' && upper[i]<='z') ? static_cast<char>(upper[i]-'a'+'A') : upper[i];
+   }
+   return upper;
+}
+
+bool RenderRequest::set( const char* name, const char* value )
+{
+   if( strcmp(name,"molecule")==0 )
+   {
+      // --------------------------------------------------------------------------------
+      // Molecule
+      // --------------------------------------------------------------------------------
+      molecule = canonicalMoleculeId( value );
+      m_given |= givenMolecule;
+   }
+   else if ( strcmp(name,"rotation") == 0 )
+   {
+      // --------------------------------------------------------------------------------
+      // rotation angles, in degrees
+      // --------------------------------------------------------------------------------
+      rotation = readFloat3(value);
+      m_given |= givenRotation;
+   }
+   else if ( strcmp(name,"bkcolor") == 0 )
+   {
+      // --------------------------------------------------------------------------------
+      // Backgroud color
+      // --------------------------------------------------------------------------------
+      backgroundColor = readFloat3(value);
+      backgroundColor.x = (backgroundColor.x<0.f) ? 0.f : (backgroundColor.x>255.f) ? 1.f : backgroundColor.x/255.f;
+      backgroundColor.y = (backgroundColor.y<0.f) ? 0.f : (backgroundColor.y>255.f) ? 1.f : backgroundColor.y/255.f;
+      backgroundColor.z = (backgroundColor.z<0.f) ? 0.f : (backgroundColor.z>255.f) ? 1.f : backgroundColor.z/255.f;
+   }
+   else if ( strcmp(name,"structure") == 0 )
+   {
+      // --------------------------------------------------------------------------------
+      // structure
+      // --------------------------------------------------------------------------------
+      structureType = atoi(value);
+      if( structureType<0 || structureType>4 ) structureType = 0;
+      m_given |= givenStructure;
+   }
+   else if ( strcmp(name,"scheme") == 0 )
+   {
+      // --------------------------------------------------------------------------------
+      // scheme
+      // --------------------------------------------------------------------------------
+      scheme = atoi(value);
+      if( scheme<0 || scheme>2 ) scheme = 0;
+      m_given |= givenScheme;
+   }
+   else if ( strcmp(name,"quality") == 0 )
+   {
+      // --------------------------------------------------------------------------------
+      // Quality
+      // --------------------------------------------------------------------------------
+      quality = atoi(value);
+      quality = (quality>MAX_QUALITY) ? MAX_QUALITY : (quality<1) ? 1 : quality;
+      m_given |= givenQuality;
+   }
+   else if ( strcmp(name,"size") == 0 )
+   {
+      // --------------------------------------------------------------------------------
+      // Image Size
+      // --------------------------------------------------------------------------------
+      switch( atoi(value) ) 
+      {
+      case  1: width=1024; height=1024; break;
+      case  2: width=1600; height=1600; break;
+      case  3: width=1920; height=1920; break;
+      case  4: width=2048; height=2048; break;
+      default: width=768;  height=768;  break;
+      }
+   }
+   else if ( strcmp(name,"postprocessing") == 0 )
+   {
+      // --------------------------------------------------------------------------------
+      // Post processing effect
+      // --------------------------------------------------------------------------------
+      postProcessing = atoi(value);
+      if( postProcessing<0 || postProcessing>2 ) postProcessing = 0;
+   }
+   else if ( strcmp(name,"subsampling") == 0 )
+   {
+      // --------------------------------------------------------------------------------
+      // JPEG chroma subsampling
+      // --------------------------------------------------------------------------------
+      switch( atoi(value) )
+      {
+      case 444: jpegSubsampling = JO_SUBSAMPLING_444; break;
+      case 422: jpegSubsampling = JO_SUBSAMPLING_422; break;
+      default:  jpegSubsampling = JO_SUBSAMPLING_420; break;
+      }
+   }
+   else if ( strcmp(name,"optimize") == 0 )
+   {
+      // --------------------------------------------------------------------------------
+      // JPEG Huffman tables built for the image, smaller but slower to encode
+      // --------------------------------------------------------------------------------
+      jpegOptimize = ( atoi(value) != 0 );
+   }
+   else if ( strcmp(name,"progressive") == 0 )
+   {
+      // --------------------------------------------------------------------------------
+      // Progressive JPEG, a coarse image shows up before the whole file has arrived
+      // --------------------------------------------------------------------------------
+      jpegProgressive = ( atoi(value) != 0 );
+   }
+   else if ( strcmp(name,"format") == 0 )
+   {
+      // --------------------------------------------------------------------------------
+      // Response body: base64 data URI (default) or jpeg for the raw image/jpeg bytes
+      // --------------------------------------------------------------------------------
+      binaryResponse = ( strcmp(value,"jpeg") == 0 );
+   }
+   else if ( strcmp(name,"seed") == 0 )
+   {
+      // --------------------------------------------------------------------------------
+      // Seed of everything left to chance
+      // --------------------------------------------------------------------------------
+      seed = static_cast<unsigned int>(strtoul(value, nullptr, 10));
+   }
+   else if ( strcmp(name,"deadline") == 0 )
+   {
+      // --------------------------------------------------------------------------------
+      // Rendering time budget, in milliseconds (300 or 300ms)
+      // --------------------------------------------------------------------------------
+      deadline = atoi(value);
+      deadline = (deadline<0) ? 0 : deadline;
+   }
+   else if ( strcmp(name,"noise") == 0 )
+   {
+      // --------------------------------------------------------------------------------
+      // Noise target: stop once an iteration changes the image less than this
+      // --------------------------------------------------------------------------------
+      noiseTarget = static_cast<float>(atof(value));
+      noiseTarget = (noiseTarget<0.f) ? 0.f : noiseTarget;
+   }
+   else if ( strcmp(name,"frames") == 0 )
+   {
+      // --------------------------------------------------------------------------------
+      // Turntable: number of views
+      // --------------------------------------------------------------------------------
+      m_frames = atoi(value);
+   }
+   else if ( strcmp(name,"to") == 0 )
+   {
+      // --------------------------------------------------------------------------------
+      // Turntable: rotation angles the views go to, in degrees
+      // --------------------------------------------------------------------------------
+      m_to = readFloat3(value);
+      m_hasTo = true;
+   }
+   else if ( strcmp(name,"rotations") == 0 )
+   {
+      // --------------------------------------------------------------------------------
+      // Turntable: explicit views, x,y,z;x,y,z;... in degrees
+      // --------------------------------------------------------------------------------
+      m_rotations.clear();
+      std::string list(value);
+      size_t start(0);
+      while( start < list.length() )
+      {
+         size_t end = list.find(';', start);
+         end = (end == std::string::npos) ? list.length() : end;
+         if( end > start ) m_rotations.push_back( readFloat3(list.substr(start, end-start).c_str()) );
+         start = end+1;
+      }
+   }
+   else
+   {
+      return false;
+   }
+   return true;
+}
+
+void RenderRequest::resolve( const std::vector<std::string>& molecules )
+{
+   if( seed != 0 )
+   {
+      // mt19937 produces the same sequence everywhere. Every value is drawn whether it is
+      // used or not, so that a parameter's draw does not depend on which others were given
+      std::mt19937 generator(seed);
+      const std::string drawnMolecule = molecules.empty() ? std::string() : molecules[generator()%molecules.size()];
+      float4 drawnRotation = {0.f,0.f,0.f,0.f};
+      drawnRotation.x = static_cast<float>(generator()%360);
+      drawnRotation.y = static_cast<float>(generator()%360);
+      const int drawnStructure = static_cast<int>(generator()%5);
+      const int drawnScheme    = static_cast<int>(generator()%3);
+
+      if( !(m_given & givenMolecule) )  molecule      = drawnMolecule;
+      if( !(m_given & givenRotation) )  rotation      = drawnRotation;
+      if( !(m_given & givenStructure) ) structureType = drawnStructure;
+      if( !(m_given & givenScheme) )    scheme        = drawnScheme;
+   }
+   if( molecule.empty() && !molecules.empty() )
+   {
+      molecule = molecules[0];
+   }
+   if( adaptive() && !(m_given & givenQuality) )
+   {
+      quality = MAX_QUALITY;
+   }
+   m_given = givenMolecule | givenRotation | givenStructure | givenScheme | givenQuality;
+}
+
+// Views of a turntable, and pixels of its sprite sheet, are bounded
+static const int    MAX_TURNTABLE_FRAMES = 72;
+static const double MAX_TURNTABLE_PIXELS = 16.0*1024.0*1024.0;
+
+void RenderRequest::makeTurntable()
+{
+   int maxFrames = static_cast<int>(MAX_TURNTABLE_PIXELS/(static_cast<double>(width)*height));
+   maxFrames = (maxFrames > MAX_TURNTABLE_FRAMES) ? MAX_TURNTABLE_FRAMES : (maxFrames < 1) ? 1 : maxFrames;
+
+   views = m_rotations;
+   if( views.empty() )
+   {
+      float4 to = m_to;
+      if( !m_hasTo )
+      {
+         // One turn around y
+         to = rotation;
+         to.y += 360.f;
+      }
+      const int frames = (m_frames < 1) ? 1 : (m_frames > maxFrames) ? maxFrames : m_frames;
+      for( int i(0); i<frames; ++i )
+      {
+         const float t = static_cast<float>(i)/frames;
+         float4 view = rotation;
+         view.x += (to.x-rotation.x)*t;
+         view.y += (to.y-rotation.y)*t;
+         view.z += (to.z-rotation.z)*t;
+         views.push_back(view);
+      }
+   }
+   if( static_cast<int>(views.size()) > maxFrames ) views.resize(maxFrames);
+}
+
+std::string RenderRequest::canonicalKey() const
+{
+   // 9 significant digits give every float back exactly
+   std::ostringstream key;
+   key << std::setprecision(9)
+       << "molecule=" << molecule
+       << "&rotation=" << rotation.x << "," << rotation.y << "," << rotation.z
+       << "&structure=" << structureType
+       << "&scheme=" << scheme
+       << "&quality=" << quality
+       << "&size=" << width << "x" << height
+       << "&bkcolor=" << backgroundColor.x << "," << backgroundColor.y << "," << backgroundColor.z
+       << "&postprocessing=" << postProcessing
+       << "&subsampling=" << jpegSubsampling
+       << "&optimize=" << jpegOptimize
+       << "&progressive=" << jpegProgressive;
+   if( adaptive() )
+   {
+      key << "&deadline=" << deadline << "&noise=" << noiseTarget;
+   }
+   for( size_t i(0); i<views.size(); ++i )
+   {
+      key << ((i==0) ? "&views=" : ";") << views[i].x << "," << views[i].y << "," << views[i].z;
+   }
+   return key.str();
+}
@@ -0,0 +1,116 @@
+/* 
+* Molecular Visualization HTTP Server
+* Copyright (C) 2011-2012 Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* aint with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+*/
+
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "../../../RaytracingEngine/tags/version-00.02.00/Consts.h"
+
+// PDB IDs are not case sensitive: every request, key, cache entry and
+// file name takes them upper cased, so 1bna and 1BNA are one picture
+std::string canonicalMoleculeId( const std::string& id );
+
+// ----------------------------------------------------------------------
+// Everything a /get picture depends on. What a request leaves out gets a
+// fixed default, or a value drawn from its seed, so that the same URL
+// always gives the same picture:
+//   molecule        first of the molecule list, or drawn from the seed
+//   rotation        0,0,0 degrees, or x and y in [0,360) from the seed
+//   structure       0 (atoms), or [0,4] from the seed
+//   scheme          0 (standard), or [0,2] from the seed
+//   seed            0, nothing is drawn
+//   quality, size and bkcolor come from the server's SceneInfo,
+//   postprocessing 0, subsampling 420, optimize 0, progressive 0
+//
+// With a deadline or a noise target, quality is the most iterations (20
+// when not given), and the render stops earlier once the budget would be
+// exceeded or the image has converged. The picture then depends on the
+// server's speed, the first one rendered is the one cached
+//
+// A turntable renders several views of the same scene into one sprite
+// sheet: ceil(sqrt(frames)) columns, frames left to right then top to
+// bottom
+// ----------------------------------------------------------------------
+struct RenderRequest
+{
+   std::string  molecule;
+   float4       rotation;        // degrees
+   int          structureType;
+   int          scheme;
+   int          quality;         // path tracing iterations, the most with a deadline or noise target
+   int          deadline;        // milliseconds of rendering, 0 for none
+   float        noiseTarget;     // RMS change between iterations in 8 bit levels, 0 for none
+   int          width;
+   int          height;
+   float4       backgroundColor;
+   int          postProcessing;
+   int          jpegSubsampling; // JO_SUBSAMPLING_*
+   bool         jpegOptimize;
+   bool         jpegProgressive;
+   bool         binaryResponse;  // how the picture is sent, not part of it
+   unsigned int seed;
+   std::vector<float4> views;    // rotations of a turntable, degrees. Empty for one picture
+
+   explicit RenderRequest( const SceneInfo& defaults );
+
+   // Takes one query parameter. Returns false when the name is unknown
+   bool set( const char* name, const char* value );
+
+   // Fills in what the query did not give, once all parameters are set
+   void resolve( const std::vector<std::string>& molecules );
+
+   // Turns the request into a turntable, after resolve(). The views are the
+   // rotations list when given, else frames steps from rotation to the to
+   // angles (one turn around y by default), the end excluded
+   void makeTurntable();
+
+   // Stable text form of every field the picture depends on, after resolve().
+   // The seed is not part of it: it only picked values that are
+   std::string canonicalKey() const;
+
+   bool adaptive() const { return deadline > 0 || noiseTarget > 0.f; }
+
+   // Estimated render cost: pixels x path tracing iterations, for every view
+   uint64_t cost() const { return static_cast<uint64_t>(width)*height*quality*(views.empty() ? 1 : views.size()); }
+
+private:
+   enum
+   {
+      givenMolecule  = 1,
+      givenRotation  = 2,
+      givenStructure = 4,
+      givenScheme    = 8,
+      givenQuality   = 16
+   };
+   int m_given;
+
+   // Turntable parameters, see makeTurntable()
+   int                 m_frames;
+   float4              m_to;
+   bool                m_hasTo;
+   std::vector<float4> m_rotations;
+};
@@ -0,0 +1,213 @@
+/* 
+* Molecular Visualization HTTP Server
+* Copyright (C) 2011-2012 Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* aint with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+*/
+
+
+#include "RenderWorkers.h"
+
+// Seconds of predicted render time that one second of waiting makes up for
+static const double AGING = 1.0;
+
+RenderWorkers::RenderWorkers()
+ : m_eventPump(nullptr),
+   m_render(nullptr),
+   m_complete(nullptr),
+   m_queued(0),
+   m_busy(0),
+   m_stopping(false),
+   m_budget(UINT64_MAX),
+   m_clientBudget(UINT64_MAX),
+   m_outstandingCost(0),
+   m_admitted(0),
+   m_rejected(0),
+   m_started(0),
+   m_totalWait(0.0),
+   m_maxWait(0.0),
+   m_outstandingSeconds(0.0)
+{
+   m_epoch = std::chrono::steady_clock::now();
+}
+
+RenderWorkers::~RenderWorkers()
+{
+   stop();
+}
+
+void RenderWorkers::start( const int size, Lacewing::EventPump& eventPump, RenderJobHandler render, RenderJobCompletion complete )
+{
+   m_eventPump = &eventPump;
+   m_render    = render;
+   m_complete  = complete;
+   for( int i(0); i<size; ++i )
+   {
+      m_threads.push_back( std::thread( &RenderWorkers::run, this ) );
+   }
+}
+
+void RenderWorkers::stop()
+{
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stopping = true;
+   }
+   m_submitted.notify_all();
+   for( size_t i(0); i<m_threads.size(); ++i )
+   {
+      m_threads[i].join();
+   }
+   m_threads.clear();
+}
+
+void RenderWorkers::setBudget( const uint64_t budget, const uint64_t clientBudget )
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   m_budget       = budget;
+   m_clientBudget = clientBudget;
+}
+
+bool RenderWorkers::submit( RenderJob* job )
+{
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      uint64_t& clientCost = m_clientCosts[job->client];
+      if( (m_outstandingCost != 0 && m_outstandingCost+job->cost > m_budget) ||
+          (clientCost != 0 && clientCost+job->cost > m_clientBudget) )
+      {
+         if( clientCost == 0 ) m_clientCosts.erase(job->client);
+         ++m_rejected;
+         return false;
+      }
+      clientCost        += job->cost;
+      m_outstandingCost += job->cost;
+      ++m_admitted;
+      ++m_queued;
+
+      // Aging shifts every queued job by the same amount, so the order can
+      // be fixed now: predicted time minus AGING x time of arrival
+      job->queuedAt  = std::chrono::steady_clock::now();
+      job->predicted = m_costModel.predict( job->renderRequest );
+      job->priority  = job->predicted-AGING*std::chrono::duration<double>(job->queuedAt-m_epoch).count();
+      m_outstandingSeconds += job->predicted;
+      m_queues[job->client].insert( ClientQueue::value_type(job->priority, job) );
+   }
+   m_submitted.notify_one();
+   return true;
+}
+
+int RenderWorkers::retryAfter()
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   if( m_threads.empty() ) return 5;
+   const double seconds = m_outstandingSeconds/m_threads.size();
+   return (seconds < 1.0) ? 1 : (seconds > 120.0) ? 120 : static_cast<int>(seconds+0.5);
+}
+
+RenderWorkers::Stats RenderWorkers::stats()
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   Stats stats;
+   stats.queued             = m_queued;
+   stats.busy               = m_busy;
+   stats.outstandingCost    = m_outstandingCost;
+   stats.budget             = m_budget;
+   stats.clientBudget       = m_clientBudget;
+   stats.admitted           = m_admitted;
+   stats.rejected           = m_rejected;
+   stats.averageWait        = (m_started == 0) ? 0.0 : m_totalWait/m_started;
+   stats.maxWait            = m_maxWait;
+   stats.outstandingSeconds = m_outstandingSeconds;
+   stats.rate               = m_costModel.rate(0);
+   stats.measuredRenders    = m_costModel.samples();
+   return stats;
+}
+
+// Job of smallest priority, among the first of each client. Called with the lock held
+RenderJob* RenderWorkers::next()
+{
+   ClientQueues::iterator best = m_queues.begin();
+   for( ClientQueues::iterator it = m_queues.begin(); it != m_queues.end(); ++it )
+   {
+      if( it->second.begin()->first < best->second.begin()->first ) best = it;
+   }
+   RenderJob* job = best->second.begin()->second;
+   best->second.erase( best->second.begin() );
+   if( best->second.empty() ) m_queues.erase(best);
+   --m_queued;
+   ++m_busy;
+
+   job->startedAt = std::chrono::steady_clock::now();
+   const double wait = std::chrono::duration<double>(job->startedAt-job->queuedAt).count();
+   ++m_started;
+   m_totalWait += wait;
+   m_maxWait = (wait > m_maxWait) ? wait : m_maxWait;
+   return job;
+}
+
+// Gives the job's cost back and refines the cost model with the time the
+// render took, not the scene build nor a read from the response cache
+void RenderWorkers::finished( RenderJob* job )
+{
+   std::lock_guard<std::mutex> lock(m_mutex);
+   --m_busy;
+   m_outstandingCost -= job->cost;
+   std::map<std::string, uint64_t>::iterator it = m_clientCosts.find(job->client);
+   it->second -= job->cost;
+   if( it->second == 0 ) m_clientCosts.erase(it);
+
+   m_outstandingSeconds -= job->predicted;
+   m_outstandingSeconds = (m_outstandingSeconds < 0.0) ? 0.0 : m_outstandingSeconds;
+
+   // Failed renders say nothing about render time
+   if( job->image && job->primitives > 0 && job->renderTime > 0.0 )
+   {
+      // A deadline or noise target may have stopped it before quality iterations
+      RenderRequest rendered( job->renderRequest );
+      rendered.quality = (job->image->iterations > 0) ? job->image->iterations : rendered.quality;
+      m_costModel.learn( rendered, job->primitives, job->renderTime );
+   }
+}
+
+void RenderWorkers::run()
+{
+   for(;;)
+   {
+      RenderJob* job(nullptr);
+      {
+         std::unique_lock<std::mutex> lock(m_mutex);
+         while( m_queues.empty() && !m_stopping ) m_submitted.wait(lock);
+         if( m_stopping ) return;
+         job = next();
+      }
+
+      try
+      {
+         m_render( *job );
+      }
+      catch(...)
+      {
+         job->image.reset();
+         job->error = "An exception occured :-( Please try again";
+      }
+      finished( job );
+      m_eventPump->Post( (void*)m_complete, job );
+   }
+}
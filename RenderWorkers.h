@@ -0,0 +1,185 @@
+/* 
+* Molecular Visualization HTTP Server
+* Copyright (C) 2011-2012 Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* aint with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+*/
+
+
+#pragma once
+
+#include <lacewing.h>
+
+#include <stdint.h>
+#include <map>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+#include "RenderRequest.h"
+#include "ResponseCache.h"
+#include "RenderCostModel.h"
+
+// A client waiting for the picture of a job. request is cleared when the
+// client goes away before the picture is ready
+struct RenderJobRequest
+{
+   Lacewing::Webserver::Request* request;
+   bool                          binaryResponse;
+};
+
+// ----------------------------------------------------------------------
+// A picture to render for one or more identical /get requests. The
+// worker fills image (or error), the event loop writes the responses.
+// Only the event loop touches requests and previews
+// ----------------------------------------------------------------------
+struct RenderJob
+{
+   std::vector<RenderJobRequest>         requests;
+   std::vector<RenderJobRequest>         previewRequests;  // answered by the next preview
+   std::shared_ptr<const CachedImage>    preview;          // latest one
+   int                                   previewIteration; // iterations in it, 0 for none
+   std::atomic<bool>                     previews;         // encode previews while rendering
+   std::atomic<bool>                     cancelled;        // nobody waits anymore, stop rendering
+   RenderRequest                         renderRequest;
+   std::string                           cacheKey;
+   std::string                           client;     // address, for fairness
+   uint64_t                              cost;       // pixels x iterations
+   double                                predicted;  // seconds, from the cost model
+   double                                priority;   // smallest first
+   int                                   primitives; // set by the render, 0 if unknown
+   double                                renderTime; // seconds of path tracing, set by the render
+   std::chrono::steady_clock::time_point queuedAt;
+   std::chrono::steady_clock::time_point startedAt;  // taken by a worker
+   std::shared_ptr<const CachedImage>    image;
+   std::string                           error;      // written instead of the picture
+
+   RenderJob( const RenderRequest& renderRequest, const std::string& cacheKey, const std::string& client )
+    : previewIteration(0), previews(false), cancelled(false), renderRequest(renderRequest), cacheKey(cacheKey), client(client), 
+      cost(renderRequest.cost()), predicted(0.0), priority(0.0), primitives(0), renderTime(0.0) {}
+
+   void attach( Lacewing::Webserver::Request& request, const bool binaryResponse )
+   {
+      RenderJobRequest waiting = { &request, binaryResponse };
+      requests.push_back( waiting );
+   }
+
+   void attachPreview( Lacewing::Webserver::Request& request, const bool binaryResponse )
+   {
+      RenderJobRequest waiting = { &request, binaryResponse };
+      previewRequests.push_back( waiting );
+   }
+};
+
+// Renders a job, on a worker thread
+typedef void (*RenderJobHandler)( RenderJob& job );
+// Writes the response and deletes the job, on the event loop thread
+typedef void (*RenderJobCompletion)( RenderJob* job );
+
+// ----------------------------------------------------------------------
+// Threads rendering queued jobs, so that the event loop only parses
+// requests and writes responses. Lacewing objects are not thread safe:
+// a finished job is posted back to the event pump for completion.
+//
+// Outstanding work (queued and rendering) is bounded by a cost budget,
+// and each client by a smaller one, so that one address cannot fill the
+// queue.
+//
+// The job predicted to be the shortest runs first, so that thumbnails do
+// not wait behind posters. Waiting lowers the priority as much as the
+// predicted time, which bounds how long an expensive job can be passed
+// over. Each client's jobs are kept in their own queue
+// ----------------------------------------------------------------------
+class RenderWorkers
+{
+public:
+   RenderWorkers();
+   ~RenderWorkers();
+
+   void start( const int size, Lacewing::EventPump& eventPump, RenderJobHandler render, RenderJobCompletion complete );
+   void stop();
+
+   // Costs in pixels x iterations. A job is always taken when its client, or
+   // the server, has nothing outstanding, so that no request is too big to run
+   void setBudget( const uint64_t budget, const uint64_t clientBudget );
+
+   // Takes ownership of the job, or returns false when it is over budget
+   bool submit( RenderJob* job );
+
+   // Seconds until the outstanding work is done, as predicted
+   int retryAfter();
+
+   struct Stats
+   {
+      int      queued;
+      int      busy;
+      uint64_t outstandingCost;
+      uint64_t budget;
+      uint64_t clientBudget;
+      size_t   admitted;
+      size_t   rejected;
+      double   averageWait; // seconds in the queue
+      double   maxWait;
+      double   outstandingSeconds; // predicted
+      double   rate;               // of plain renders, see RenderCostModel
+      size_t   measuredRenders;
+   };
+   Stats stats();
+
+   int size() const { return static_cast<int>(m_threads.size()); }
+
+   // Runs function(parameter) on the event loop thread
+   void post( void* function, void* parameter ) { m_eventPump->Post( function, parameter ); }
+
+private:
+   void run();
+   RenderJob* next();
+   void finished( RenderJob* job );
+
+   typedef std::multimap<double, RenderJob*>  ClientQueue; // by priority
+   typedef std::map<std::string, ClientQueue> ClientQueues;
+
+   std::vector<std::thread>          m_threads;
+   ClientQueues                      m_queues;
+   RenderCostModel                   m_costModel;
+   std::chrono::steady_clock::time_point m_epoch;
+   std::map<std::string, uint64_t>   m_clientCosts;
+   std::mutex                        m_mutex;
+   std::condition_variable           m_submitted;
+   Lacewing::EventPump*              m_eventPump;
+   RenderJobHandler                  m_render;
+   RenderJobCompletion               m_complete;
+   int                               m_queued;
+   int                               m_busy;
+   bool                              m_stopping;
+   uint64_t                          m_budget;
+   uint64_t                          m_clientBudget;
+   uint64_t                          m_outstandingCost;
+   size_t                            m_admitted;
+   size_t                            m_rejected;
+   size_t                            m_started;
+   double                            m_totalWait;
+   double                            m_maxWait;
+   double                            m_outstandingSeconds;
+};
@@ -0,0 +1,147 @@
+/* 
+* Molecular Visualization HTTP Server
+* Copyright (C) 2011-2012 Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* aint with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+*/
+
+
+#include "ResponseCache.h"
+#include "MappedFile.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <fstream>
+#include <iterator>
+
+// 64 bit FNV-1a
+static uint64_t hashBytes( const unsigned char* data, const size_t size )
+{
+   uint64_t hash = 14695981039346656037ULL;
+   for( size_t i(0); i<size; ++i )
+   {
+      hash ^= data[i];
+      hash *= 1099511628211ULL;
+   }
+   return hash;
+}
+
+static std::string toHex( const uint64_t value )
+{
+   char text[17];
+   sprintf( text, "%08x%08x", static_cast<unsigned int>(value>>32), static_cast<unsigned int>(value) );
+   return text;
+}
+
+std::shared_ptr<const CachedImage> makeCachedImage( const unsigned char* jpeg, const size_t size, const int iterations, const float noise )
+{
+   std::shared_ptr<CachedImage> image( new CachedImage );
+   image->jpeg.assign( jpeg, jpeg+size );
+   image->etag = "\"" + toHex( hashBytes(jpeg, size) ) + "\"";
+   image->iterations = iterations;
+   image->noise      = noise;
+   return image;
+}
+
+ResponseCache::ResponseCache( const size_t budget )
+ : m_memory(budget),
+   m_diskHits(0),
+   m_diskWrites(0)
+{
+}
+
+// Files are named after a hash of the key, and start with the key itself to rule out collisions.
+// An optional "#render iterations noise" line follows, then the JPEG (which starts with 0xFF)
+std::string ResponseCache::fileName( const std::string& key ) const
+{
+   return m_directory + "/" + toHex( hashBytes( (const unsigned char*)key.c_str(), key.length() ) ) + ".jpgcache";
+}
+
+std::shared_ptr<const CachedImage> ResponseCache::find( const std::string& key )
+{
+   std::shared_ptr<const CachedImage> image = m_memory.find(key);
+   return image ? image : findOnDisk(key);
+}
+
+std::shared_ptr<const CachedImage> ResponseCache::findOnDisk( const std::string& key )
+{
+   std::shared_ptr<const CachedImage> image;
+   if( m_directory.empty() ) return image;
+
+   std::ifstream file( fileName(key).c_str(), std::ios::binary );
+   std::string storedKey;
+   if( !file.is_open() || !std::getline(file, storedKey) || storedKey != key ) return image;
+
+   int iterations(0);
+   float noise(-1.f);
+   if( file.peek() == '#' )
+   {
+      std::string render;
+      std::getline(file, render);
+      sscanf( render.c_str(), "#render %d %f", &iterations, &noise );
+   }
+   std::vector<unsigned char> jpeg( (std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>() );
+   if( jpeg.empty() ) return image;
+   image = makeCachedImage( &jpeg[0], jpeg.size(), iterations, noise );
+   m_memory.insert( key, image );
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      ++m_diskHits;
+   }
+   return image;
+}
+
+void ResponseCache::insert( const std::string& key, const std::shared_ptr<const CachedImage>& image )
+{
+   m_memory.insert( key, image );
+   if( m_directory.empty() || image->jpeg.empty() ) return;
+
+   // Written aside then renamed, so that a reader never sees half a file
+   // and workers finishing the same picture do not write into one file
+   const std::string name = fileName(key);
+   const std::string temporary = temporaryFileName( name );
+   {
+      std::ofstream file( temporary.c_str(), std::ios::binary );
+      if( !file.is_open() ) return;
+      file << key << '\n';
+      file << "#render " << image->iterations << " " << image->noise << '\n';
+      file.write( (const char*)&image->jpeg[0], image->jpeg.size() );
+      if( !file )
+      {
+         file.close();
+         remove( temporary.c_str() );
+         return;
+      }
+   }
+   if( replaceFile( temporary, name ) )
+   {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      ++m_diskWrites;
+   }
+}
+
+ResponseCache::Stats ResponseCache::stats()
+{
+   Stats stats;
+   stats.memory = m_memory.stats();
+   std::lock_guard<std::mutex> lock(m_mutex);
+   stats.diskHits   = m_diskHits;
+   stats.diskWrites = m_diskWrites;
+   return stats;
+}
@@ -0,0 +1,85 @@
+/* 
+* Molecular Visualization HTTP Server
+* Copyright (C) 2011-2012 Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Library General Public
+* License as published by the Free Software Foundation; either
+* version 2 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Library General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* aint with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+* Author: Cyrille Favreau <cyrille_favreau@hotmail.com>
+*
+*/
+
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+
+#include "LruCache.h"
+
+// ----------------------------------------------------------------------
+// An encoded picture and its strong ETag (hash of the bytes, quoted),
+// with how the render went
+// ----------------------------------------------------------------------
+struct CachedImage
+{
+   std::vector<unsigned char> jpeg;
+   std::string                etag;
+   int                        iterations; // path tracing iterations, 0 if unknown
+   float                      noise;      // RMS change of the last iteration, negative if not measured
+
+   size_t bytes() const { return sizeof(CachedImage) + jpeg.capacity() + etag.capacity(); }
+};
+
+std::shared_ptr<const CachedImage> makeCachedImage( const unsigned char* jpeg, const size_t size, const int iterations = 0, const float noise = -1.f );
+
+// ----------------------------------------------------------------------
+// Encoded pictures by canonical request. A memory LRU tier, and an
+// optional directory that survives restarts (not size bounded)
+// ----------------------------------------------------------------------
+class ResponseCache
+{
+public:
+   explicit ResponseCache( const size_t budget );
+
+   void setBudget( const size_t budget ) { m_memory.setBudget(budget); }
+   void setDirectory( const std::string& directory ) { m_directory = directory; }
+
+   // Memory first, then disk. Null when the picture has to be rendered
+   std::shared_ptr<const CachedImage> find( const std::string& key );
+   // Each tier alone. The disk may take a while, findOnDisk is for worker threads.
+   // A picture found on disk is put back in memory
+   std::shared_ptr<const CachedImage> findInMemory( const std::string& key ) { return m_memory.find(key); }
+   std::shared_ptr<const CachedImage> findOnDisk( const std::string& key );
+   void insert( const std::string& key, const std::shared_ptr<const CachedImage>& image );
+
+   struct Stats
+   {
+      LruCache<std::string, CachedImage>::Stats memory;
+      size_t                                    diskHits;
+      size_t                                    diskWrites;
+   };
+   Stats stats();
+
+private:
+   std::string fileName( const std::string& key ) const;
+
+   LruCache<std::string, CachedImage> m_memory;
+   std::string                        m_directory;
+   std::mutex                         m_mutex;
+   size_t                             m_diskHits;
+   size_t                             m_diskWrites;
+};